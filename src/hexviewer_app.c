@@ -81,11 +81,17 @@ static void app_startup (GApplication *app)
 	GtkBuilder	*builder;
 	GMenuModel	*sys_menu;
 	const gchar	*quit_accels[2] = { "<Ctrl>Q", NULL };
+	const gchar	*find_accels[2] = { "<Ctrl>F", NULL };
+	const gchar	*find_next_accels[2] = { "<Ctrl>G", NULL };
+	const gchar	*find_prev_accels[2] = { "<Ctrl><Shift>G", NULL };
 
 	G_APPLICATION_CLASS (hexviewer_app_parent_class)->startup (app);
 
 	g_action_map_add_action_entries (G_ACTION_MAP (app), sys_menu_entries, G_N_ELEMENTS (sys_menu_entries), app);
 	gtk_application_set_accels_for_action (GTK_APPLICATION (app), "app.quit", quit_accels);
+	gtk_application_set_accels_for_action (GTK_APPLICATION (app), "win.find", find_accels);
+	gtk_application_set_accels_for_action (GTK_APPLICATION (app), "win.find_next", find_next_accels);
+	gtk_application_set_accels_for_action (GTK_APPLICATION (app), "win.find_prev", find_prev_accels);
 
 	builder = gtk_builder_new_from_resource ("/org/gnome/hexviewer/app_sys_menu.ui");
 	sys_menu = G_MENU_MODEL (gtk_builder_get_object (builder, "sysmenu"));
@@ -115,19 +121,20 @@ static void app_open(GApplication *app, GFile **files, gint n_files, const gchar
 	HexViewerWindow *window;
 	gchar			*fileName;
 
+	// Windows show up right away, the files are opened in parallel and
+	// missing ones are reported by their window
 	for (int i = 0; i < n_files; i++)
 	{
 		fileName = g_file_get_parse_name (files[i]);
 		
 		g_message ("App: Try to open following file: %s", fileName);
 		
-		if (g_file_test (fileName, G_FILE_TEST_EXISTS))
+		window = hexviewer_window_new (HEXVIEWER_APP (app));
+			
+		if (window)
 		{
-			window = hexviewer_window_new (HEXVIEWER_APP (app));
 			hexviewer_window_open (window, files[i]);
-			
-			if (window)
-				gtk_window_present (GTK_WINDOW (window));
+			gtk_window_present (GTK_WINDOW (window));
 		}
 		
 		g_free(fileName);
@@ -33,6 +33,7 @@ struct _HexViewerPreferencesPrivate
 	GtkWidget	*chk_show_adresses;
 	GtkWidget	*chk_auto_fit;
 	GtkWidget	*chk_show_statusbar;
+	GtkWidget	*chk_inflate_gzip;
 	GtkWidget	*font;
 	GtkWidget	*print_font;
 };
@@ -65,6 +66,7 @@ static void hexviewer_preferences_init (HexViewerPreferences *prefs)
 	g_settings_bind (priv->settings, "show-addresses", priv->chk_show_adresses, "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind (priv->settings, "auto-fit", priv->chk_auto_fit, "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind (priv->settings, "show-statusbar", priv->chk_show_statusbar, "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind (priv->settings, "inflate-gzip", priv->chk_inflate_gzip, "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind (priv->settings, "font", priv->font, "font", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind (priv->settings, "print-font", priv->print_font, "font", G_SETTINGS_BIND_DEFAULT);
 
@@ -97,6 +99,7 @@ static void hexviewer_preferences_class_init (HexViewerPreferencesClass *class)
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, chk_show_adresses);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, chk_auto_fit);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, chk_show_statusbar);
+  gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, chk_inflate_gzip);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, font);
   gtk_widget_class_bind_template_child_private (GTK_WIDGET_CLASS (class), HexViewerPreferences, print_font);
 }
@@ -20,6 +20,8 @@
 #include "hexviewer_win.h"
 #include "rphexview.h"
 #include "rphexfile.h"
+#include "rpsearch.h"
+#include "rpsignature.h"
 #include "hexviewer_prefs.h"
 
 typedef struct _HexViewerWindow HexViewerWindow;
@@ -32,9 +34,22 @@ struct _HexViewerWindow
 	GtkScrolledWindow		*scrolledWindow;
 	GtkButton				*btn_open;
 	GtkButton				*btn_save;
+	GtkButton				*btn_cancel;
+	GtkSearchBar			*search_bar;
+	GtkSearchEntry			*search_entry;
+	GtkToggleButton			*search_text;
+	GtkToggleButton			*search_regex;
+	GtkSpinButton			*search_max_len;
 	GtkWidget				*hex_view;
 	RPHexFile				*hex_file;
 	GSettings				*settings;
+	GCancellable			*save_cancellable;	// Set while a save is running
+	GCancellable			*open_cancellable;	// Set while a file is being opened
+	GCancellable			*find_cancellable;	// Set while a search is running
+	RPSearchPattern			*find_pattern;		// Pattern of the newest search
+	GCancellable			*scan_cancellable;	// Set while signatures are scanned for
+	RPSignatureSet			*scan_set;			// Signatures of the last scan
+	GList					*hit_windows;		// Hit lists of the document shown
 };
 
 G_DEFINE_TYPE (HexViewerWindow, hexviewer_window, GTK_TYPE_APPLICATION_WINDOW)
@@ -43,6 +58,9 @@ static GList *window_list = NULL;
 
 static void hexviewer_window_dispose 	(GObject *object);
 static void hexviewer_window_update_file_data (HexViewerWindow *window, gboolean bChanged);
+static void hexviewer_window_show_file (HexViewerWindow *window);
+static void hexviewer_window_close_file (HexViewerWindow *window);
+static void hexviewer_window_offer_journal (HexViewerWindow *window);
 static void callback_byte_pos_changed	(RPHexView *widget, guint64 position, HexViewerWindow *window);
 static void callback_selection_changed	(RPHexView *widget, HexViewerWindow *window);
 static void callback_data_changed		(RPHexFile *hex_file, gboolean changed, HexViewerWindow *window);
@@ -50,13 +68,41 @@ static void action_open_file 			(GSimpleAction *action, GVariant *parameter, gpo
 static void action_save_file 			(GSimpleAction *action, GVariant *parameter, gpointer window);
 static void action_print_print			(GSimpleAction *action, GVariant *parameter, gpointer window);
 static void action_preferences 			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_edit_undo			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_edit_redo			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_cancel_save			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_follow_file			(GSimpleAction *action, GVariant *value, gpointer window);
+static void action_find					(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_find_next			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void action_find_prev			(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void callback_find_progress		(RPHexFile *hex_file, guint64 done, guint64 total, gpointer window);
+static void callback_find_done			(GObject *source, GAsyncResult *result, gpointer window);
+static void action_scan_signatures		(GSimpleAction *action, GVariant *parameter, gpointer window);
+static void callback_scan_progress		(RPHexFile *hex_file, guint64 done, guint64 total, gpointer window);
+static void callback_scan_done			(GObject *source, GAsyncResult *result, gpointer window);
+static void callback_search_next		(GtkSearchEntry *entry, HexViewerWindow *window);
+static void callback_search_prev		(GtkSearchEntry *entry, HexViewerWindow *window);
+static void callback_search_mode		(GtkToggleButton *button, HexViewerWindow *window);
+static void callback_search_stopped		(GtkSearchEntry *entry, HexViewerWindow *window);
+static void callback_save_progress		(RPHexFile *hex_file, guint64 done, guint64 total, gpointer window);
+static void callback_save_done			(GObject *source, GAsyncResult *result, gpointer window);
+static void callback_open_done			(GObject *source, GAsyncResult *result, gpointer window);
 static void action_prefs				(GSettings *settings, gchar *key, gpointer user_data);
+static RPHexFileSync hexviewer_window_get_sync_mode (GSettings *settings);
 
 static GActionEntry win_action_entries[] = {
 	{ "open_file", action_open_file, NULL, NULL, NULL },
 	{ "save_file", action_save_file, NULL, NULL, NULL },
 	{ "print", action_print_print, NULL, NULL, NULL },
-	{ "preferences", action_preferences, NULL, NULL, NULL }
+	{ "preferences", action_preferences, NULL, NULL, NULL },
+	{ "undo", action_edit_undo, NULL, NULL, NULL },
+	{ "redo", action_edit_redo, NULL, NULL, NULL },
+	{ "cancel_save", action_cancel_save, NULL, NULL, NULL },
+	{ "follow", NULL, NULL, "false", action_follow_file },
+	{ "find", action_find, NULL, NULL, NULL },
+	{ "find_next", action_find_next, NULL, NULL, NULL },
+	{ "find_prev", action_find_prev, NULL, NULL, NULL },
+	{ "scan_signatures", action_scan_signatures, NULL, NULL, NULL }
 };
 
 static void hexviewer_window_class_init (HexViewerWindowClass *klass)
@@ -71,6 +117,12 @@ static void hexviewer_window_class_init (HexViewerWindowClass *klass)
 	gtk_widget_class_bind_template_child (class, HexViewerWindow, scrolledWindow);
 	gtk_widget_class_bind_template_child (class, HexViewerWindow, btn_open);
 	gtk_widget_class_bind_template_child (class, HexViewerWindow, btn_save);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, btn_cancel);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, search_bar);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, search_entry);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, search_text);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, search_regex);
+	gtk_widget_class_bind_template_child (class, HexViewerWindow, search_max_len);
 }
 
 static void hexviewer_window_init (HexViewerWindow *window)
@@ -87,12 +139,46 @@ static void hexviewer_window_init (HexViewerWindow *window)
 	GAction *action_print_print = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[2].name);
 	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_print_print), FALSE);
 
+	GAction *action_undo = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[4].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_undo), FALSE);
+
+	GAction *action_redo = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[5].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_redo), FALSE);
+
+	GAction *action_follow = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[7].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_follow), FALSE);
+
+	for (guint i = 8; i <= 11; i++)
+	{
+		GAction *action_find = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[i].name);
+		g_simple_action_set_enabled (G_SIMPLE_ACTION (action_find), FALSE);
+	}
+
+	gtk_search_bar_connect_entry (window->search_bar, GTK_ENTRY (window->search_entry));
+
+	g_signal_connect (G_OBJECT (window->search_entry), "activate", G_CALLBACK (callback_search_next), window);
+	g_signal_connect (G_OBJECT (window->search_entry), "next-match", G_CALLBACK (callback_search_next), window);
+	g_signal_connect (G_OBJECT (window->search_entry), "previous-match", G_CALLBACK (callback_search_prev), window);
+	g_signal_connect (G_OBJECT (window->search_entry), "stop-search", G_CALLBACK (callback_search_stopped), window);
+	g_signal_connect (G_OBJECT (window->search_text), "toggled", G_CALLBACK (callback_search_mode), window);
+	g_signal_connect (G_OBJECT (window->search_regex), "toggled", G_CALLBACK (callback_search_mode), window);
+
+	g_object_bind_property (window->search_regex, "active", window->search_max_len, "sensitive", G_BINDING_SYNC_CREATE);
+
 	window->hex_view = NULL;
 	window->hex_file = NULL;
+	window->save_cancellable = NULL;
+	window->open_cancellable = NULL;
+	window->find_cancellable = NULL;
+	window->find_pattern = NULL;
+	window->scan_cancellable = NULL;
+	window->scan_set = NULL;
+	window->hit_windows = NULL;
 
 	window->settings = g_settings_new ("org.gnome.hexviewer");
 
 	g_settings_bind (window->settings, "show-statusbar", window->statusbar, "visible", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind (window->settings, "regex-max-length", window->search_max_len, "value", G_SETTINGS_BIND_DEFAULT);
 
 	g_signal_connect (G_OBJECT (window->settings), "changed", G_CALLBACK (action_prefs), window);
 
@@ -104,10 +190,37 @@ static void hexviewer_window_dispose (GObject *object)
 	g_message ("Win: called Dispose");
 	HexViewerWindow *window = HEXVIEWER_WINDOW (object);
 
+	// A file still being opened is dropped in callback_open_done
+	if (window->open_cancellable)
+	{
+		g_cancellable_cancel (window->open_cancellable);
+		g_clear_object (&window->open_cancellable);
+	}
+
+	if (window->find_cancellable)
+	{
+		g_cancellable_cancel (window->find_cancellable);
+		g_clear_object (&window->find_cancellable);
+	}
+
+	if (window->scan_cancellable)
+	{
+		g_cancellable_cancel (window->scan_cancellable);
+		g_clear_object (&window->scan_cancellable);
+	}
+
+	g_clear_pointer (&window->find_pattern, rp_search_pattern_unref);
+	g_clear_pointer (&window->scan_set, rp_signature_set_unref);
+
+	// Each one takes itself off the list
+	while (window->hit_windows)
+		gtk_widget_destroy (window->hit_windows->data);
+
 	G_OBJECT_CLASS (hexviewer_window_parent_class)->dispose (object);
 
 	if (window->hex_file)
 	{
+		g_signal_handlers_disconnect_by_data (window->hex_file, window);
 		g_object_unref (window->hex_file);
 		window->hex_file = NULL;
 	}
@@ -120,19 +233,151 @@ HexViewerWindow *hexviewer_window_new (HexViewerApp *app)
 	return g_object_new (TYPE_HEXVIEWER_WINDOW, "application", app, NULL);
 }
 
+/* Start opening file, the window shows it once it is ready. Returns FALSE
+ * if the open could not be started.
+ */
 gboolean hexviewer_window_open (HexViewerWindow *window, GFile *file)
 {
-	GError 		file_error;
+	gchar	*fileName;
+	gchar	status[256];
+	guint	context_id;
+	RPHexFileOpenFlags	flags;
+
+	g_return_val_if_fail (HEXVIEWER_WINDOW_IS_WINDOW (window), FALSE);
+	g_return_val_if_fail (window->hex_file == NULL, FALSE);
+
+	// A newer request replaces one still running
+	if (window->open_cancellable)
+	{
+		g_cancellable_cancel (window->open_cancellable);
+		g_clear_object (&window->open_cancellable);
+	}
+
+	window->open_cancellable = g_cancellable_new ();
+
+	fileName = g_file_get_basename (file);
+	g_snprintf (status, sizeof(status), "Loading %s...", fileName);
+	g_free (fileName);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "open");
+	gtk_statusbar_pop (window->statusbar, context_id);
+	gtk_statusbar_push (window->statusbar, context_id, status);
+
+	GAction *action_open_file = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[0].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_open_file), FALSE); 
+
+	// gzip files are inflated unless the compressed bytes are wanted
+	flags = g_settings_get_boolean (window->settings, "inflate-gzip") ? RP_HEX_FILE_OPEN_NONE : RP_HEX_FILE_OPEN_RAW;
+	rp_hex_file_new_async (file, flags, window->open_cancellable, callback_open_done, g_object_ref (window));
+
+	return TRUE;
+}
+
+static void callback_open_done (GObject *source, GAsyncResult *result, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	GError			*error = NULL;
+	RPHexFile		*hex_file;
+	guint			context_id;
+
+	hex_file = rp_hex_file_new_finish (result, &error);
+
+	// Cancelled because the window was closed or another file was chosen
+	if (g_task_get_cancellable (G_TASK (result)) != window->open_cancellable ||
+		g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+		g_clear_object (&hex_file);
+		g_clear_error (&error);
+		g_object_unref (window);
+		return;
+	}
+
+	g_clear_object (&window->open_cancellable);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "open");
+	gtk_statusbar_pop (window->statusbar, context_id);
+
+	GAction *action_open_file = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[0].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_open_file), TRUE); 
+
+	if (hex_file == NULL)
+	{
+		GtkWidget *dialog = gtk_message_dialog_new (
+			GTK_WINDOW (window), 
+			GTK_DIALOG_MODAL, 
+			GTK_MESSAGE_ERROR, 
+			GTK_BUTTONS_OK, 
+			"Opening failed: %s", error ? error->message : "Read error");
+		gtk_dialog_run (GTK_DIALOG (dialog));
+		gtk_widget_destroy (dialog);
+		g_clear_error (&error);
+	}
+	else
+	{
+		window->hex_file = hex_file;
+		hexviewer_window_show_file (window);
+		hexviewer_window_offer_journal (window);
+	}
+
+	g_object_unref (window);
+}
+
+/* Unsaved changes a crash left behind are put back if the user wants them */
+static void hexviewer_window_offer_journal (HexViewerWindow *window)
+{
+	GtkWidget	*dialog;
+	GError		*error = NULL;
+	guint		count = 0;
+	gint		id;
+
+	if (!rp_hex_file_has_journal (window->hex_file))
+		return;
+
+	dialog = gtk_message_dialog_new (
+		GTK_WINDOW (window), 
+		GTK_DIALOG_MODAL, 
+		GTK_MESSAGE_QUESTION, 
+		GTK_BUTTONS_YES_NO, 
+		"This file has unsaved changes from a session that ended unexpectedly. Restore them?");
+	id = gtk_dialog_run (GTK_DIALOG (dialog));
+	gtk_widget_destroy (dialog);
+
+	if (id != GTK_RESPONSE_YES)
+	{
+		rp_hex_file_discard_journal (window->hex_file);
+		return;
+	}
+
+	if (!rp_hex_file_replay_journal (window->hex_file, &count, &error))
+	{
+		dialog = gtk_message_dialog_new (
+			GTK_WINDOW (window), 
+			GTK_DIALOG_MODAL, 
+			GTK_MESSAGE_WARNING, 
+			GTK_BUTTONS_OK, 
+			"Only %u changes could be restored: %s", count, error ? error->message : "Read error");
+		gtk_dialog_run (GTK_DIALOG (dialog));
+		gtk_widget_destroy (dialog);
+		g_clear_error (&error);
+	}
+
+	g_message ("Win: %u changes restored from the journal", count);
+}
+
+/* Create the view for the freshly opened window->hex_file */
+static void hexviewer_window_show_file (HexViewerWindow *window)
+{
 	gboolean	bEnable = FALSE;
 	guchar 		*font = NULL;
 	
-	g_return_val_if_fail (HEXVIEWER_WINDOW_IS_WINDOW (window), FALSE);
+	rp_hex_file_set_cache_size (window->hex_file, 
+								(gsize)g_settings_get_uint (window->settings, "cache-size") * 1024 * 1024);
+	rp_hex_file_set_undo_limit (window->hex_file, 
+								(gsize)g_settings_get_uint (window->settings, "undo-limit") * 1024 * 1024);
+	rp_hex_file_set_sync_mode (window->hex_file, hexviewer_window_get_sync_mode (window->settings));
 
-	window->hex_file = rp_hex_file_new_with_file (file, FALSE, &file_error);
-	g_return_val_if_fail (window->hex_file != NULL, FALSE);
-	
 	window->hex_view = rp_hex_view_new_with_file (window->hex_file);
-	g_return_val_if_fail (window->hex_view != NULL, FALSE);
+	g_return_if_fail (window->hex_view != NULL);
 
 	gtk_container_add (GTK_CONTAINER(window->scrolledWindow), window->hex_view);
 	gtk_widget_show (window->hex_view);
@@ -152,6 +397,22 @@ gboolean hexviewer_window_open (HexViewerWindow *window, GFile *file)
 														win_action_entries[2].name);
 	g_simple_action_set_enabled (G_SIMPLE_ACTION(action_print), TRUE);
 
+	for (guint i = 8; i <= 11; i++)
+	{
+		GAction *action_find = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[i].name);
+		g_simple_action_set_enabled (G_SIMPLE_ACTION (action_find), TRUE);
+	}
+
+	// A newly opened file is followed as well if the last one was
+	GAction *action_follow = g_action_map_lookup_action (G_ACTION_MAP (window), 
+														 win_action_entries[7].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION(action_follow), TRUE);
+	bEnable = g_variant_get_boolean (g_action_get_state (action_follow));
+	rp_hex_file_set_follow (window->hex_file, bEnable);
+	rp_hex_view_toggle_follow (window->hex_view, bEnable);
+
+	rp_hex_view_set_prefetch (window->hex_view, g_settings_get_uint (window->settings, "prefetch-viewports"));
+
 	bEnable = g_settings_get_boolean (window->settings, "show-addresses");
 	rp_hex_view_toggle_draw_addresses (window->hex_view, bEnable);
 
@@ -172,8 +433,67 @@ gboolean hexviewer_window_open (HexViewerWindow *window, GFile *file)
 	if (font)
 		rp_hex_view_toggle_print_font (window->hex_view, font);
 	g_free (font);
+}
 
-	return TRUE;
+/* Drop the document shown. The actions working on it stay disabled until
+ * callback_open_done shows the next one, which may never come if opening
+ * fails.
+ */
+static void hexviewer_window_close_file (HexViewerWindow *window)
+{
+	const guint	file_actions[] = { 1, 2, 4, 5, 7, 8, 9, 10, 11 };
+
+	// A search of the old document must not select in the new one
+	if (window->find_cancellable)
+	{
+		g_cancellable_cancel (window->find_cancellable);
+		g_clear_object (&window->find_cancellable);
+	}
+
+	g_clear_pointer (&window->find_pattern, rp_search_pattern_unref);
+	gtk_statusbar_pop (window->statusbar, gtk_statusbar_get_context_id (window->statusbar, "find"));
+
+	// Neither do a scan or hits of the old document
+	if (window->scan_cancellable)
+	{
+		g_cancellable_cancel (window->scan_cancellable);
+		g_clear_object (&window->scan_cancellable);
+	}
+
+	g_clear_pointer (&window->scan_set, rp_signature_set_unref);
+	gtk_statusbar_pop (window->statusbar, gtk_statusbar_get_context_id (window->statusbar, "scan"));
+
+	while (window->hit_windows)
+		gtk_widget_destroy (window->hit_windows->data);
+
+	for (guint i = 0; i < G_N_ELEMENTS (file_actions); i++)
+	{
+		GAction *action = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[file_actions[i]].name);
+		g_simple_action_set_enabled (G_SIMPLE_ACTION (action), FALSE);
+	}
+
+	if (window->hex_view)
+	{
+		gtk_widget_destroy (window->hex_view);
+		window->hex_view = NULL;
+	}
+
+	// Snapshots of running jobs can keep the file and its monitor alive
+	g_signal_handlers_disconnect_by_data (window->hex_file, window);
+	g_clear_object (&window->hex_file);
+}
+
+static RPHexFileSync hexviewer_window_get_sync_mode (GSettings *settings)
+{
+	g_autofree gchar *mode = g_settings_get_string (settings, "save-sync");
+
+	if (g_strcmp0 (mode, "none") == 0)
+		return RP_HEX_FILE_SYNC_NONE;
+	
+	if (g_strcmp0 (mode, "full") == 0)
+		return RP_HEX_FILE_SYNC_FULL;
+
+	return RP_HEX_FILE_SYNC_DATA;
 }
 
 const GList *hexviewer_window_get_list ()
@@ -197,13 +517,24 @@ static void hexviewer_window_update_file_data (HexViewerWindow *window, gboolean
 	
 	g_free (fileName);
 
+	// Nothing can change until a running save is done
+	GAction *action_open_file = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[0].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_open_file), 
+								 window->save_cancellable == NULL && window->open_cancellable == NULL); 
+
 	GAction *action_save_file = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[1].name);
-	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_save_file), bChanged); 
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_save_file), bChanged && window->save_cancellable == NULL); 
+
+	GAction *action_undo = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[4].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_undo), rp_hex_file_can_undo (window->hex_file));
+
+	GAction *action_redo = g_action_map_lookup_action (G_ACTION_MAP (window), win_action_entries[5].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_redo), rp_hex_file_can_redo (window->hex_file));
 }
 
 static void callback_byte_pos_changed (RPHexView *widget, guint64 position, HexViewerWindow *window)
 {
-	g_message ("Win: Byte position changed received. %li", position);
+	g_message ("Win: Byte position changed received. %" G_GUINT64_FORMAT, position);
 	g_return_if_fail (RP_IS_HEX_VIEW (widget));
 	g_return_if_fail (HEXVIEWER_WINDOW_IS_WINDOW (window));
 }
@@ -251,11 +582,7 @@ static void action_open_file (GSimpleAction *action, GVariant *parameter, gpoint
 			file = gtk_file_chooser_get_file (GTK_FILE_CHOOSER (dlg_openfile));
 
 			if (window->hex_file)
-			{
-				g_object_unref (window->hex_file);
-				window->hex_file = NULL;
-				gtk_widget_destroy (window->hex_view);
-			}
+				hexviewer_window_close_file (window);
 
 			hexviewer_window_open (window, file);
 
@@ -273,33 +600,493 @@ static void action_open_file (GSimpleAction *action, GVariant *parameter, gpoint
 
 static void action_save_file (GSimpleAction *action, GVariant *parameter, gpointer data)
 {
-	gboolean 		bRet = FALSE;
 	HexViewerWindow	*window;
+	guint			context_id;
 
 	window = HEXVIEWER_WINDOW (data);
 	
 	g_return_if_fail (HEXVIEWER_WINDOW_IS_WINDOW (window));
 
-	if (rp_hex_file_only_overtype_changes (window->hex_file))
+	if (window->save_cancellable != NULL)
+		return;
+
+	// Don't overwrite what someone else wrote without asking
+	if (rp_hex_file_get_disk_changed (window->hex_file))
 	{
-		bRet = rp_hex_file_write_in_place (window->hex_file);
-		g_message ("Win: Action save successful ? %s", bRet ? "True" : "False");
+		GtkWidget *dialog = gtk_message_dialog_new (
+			GTK_WINDOW (window), 
+			GTK_DIALOG_MODAL, 
+			GTK_MESSAGE_WARNING, 
+			GTK_BUTTONS_OK_CANCEL, 
+			"The file was changed by another program. Save anyway and overwrite those changes?");
+		gint id = gtk_dialog_run (GTK_DIALOG (dialog));
+		gtk_widget_destroy (dialog);
+
+		if (id != GTK_RESPONSE_OK)
+			return;
 	}
+
+	// The file is written on a worker thread, editing is blocked meanwhile
+	window->save_cancellable = g_cancellable_new ();
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "save");
+	gtk_statusbar_push (window->statusbar, context_id, "Saving...");
+	gtk_widget_show (GTK_WIDGET (window->btn_cancel));
+
+	// Keep the application running until the file is complete
+	g_application_hold (g_application_get_default ());
+
+	rp_hex_file_save_async (window->hex_file, window->save_cancellable, 
+							callback_save_progress, window,
+							callback_save_done, g_object_ref (window));
+
+	hexviewer_window_update_file_data (window, TRUE);
+}
+
+static void callback_save_progress (RPHexFile *hex_file, guint64 done, guint64 total, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	gchar			status[64];
+	guint			context_id;
+
+	if (window->hex_file == NULL)
+		return;
+
+	g_snprintf (status, sizeof(status), "Saving... %d%%", (total > 0) ? (gint)(done * 100 / total) : 100);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "save");
+	gtk_statusbar_pop (window->statusbar, context_id);
+	gtk_statusbar_push (window->statusbar, context_id, status);
+}
+
+static void callback_save_done (GObject *source, GAsyncResult *result, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	GError			*error = NULL;
+	gboolean		bRet;
+	guint			context_id;
+
+	bRet = rp_hex_file_save_finish (RP_HEX_FILE (source), result, &error);
+	g_message ("Win: Action save successful ? %s", bRet ? "True" : "False");
+
+	g_application_release (g_application_get_default ());
+	g_clear_object (&window->save_cancellable);
+
+	// The window may have been closed while saving
+	if (window->hex_file != NULL)
+	{
+		context_id = gtk_statusbar_get_context_id (window->statusbar, "save");
+		gtk_statusbar_pop (window->statusbar, context_id);
+		gtk_widget_hide (GTK_WIDGET (window->btn_cancel));
+
+		hexviewer_window_update_file_data (window, rp_hex_file_get_is_modified (window->hex_file));
+
+		if (!bRet && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		{
+			GtkWidget *dialog = gtk_message_dialog_new (
+				GTK_WINDOW (window), 
+				GTK_DIALOG_MODAL, 
+				GTK_MESSAGE_ERROR, 
+				GTK_BUTTONS_OK, 
+				"Saving failed: %s", error ? error->message : "Write error");
+			gtk_dialog_run (GTK_DIALOG (dialog));
+			gtk_widget_destroy (dialog);
+		}
+	}
+
+	g_clear_error (&error);
+	g_object_unref (window);
+}
+
+static void action_follow_file (GSimpleAction *action, GVariant *value, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	gboolean		bEnable = g_variant_get_boolean (value);
+
+	g_return_if_fail (HEXVIEWER_WINDOW_IS_WINDOW (window));
+
+	g_simple_action_set_state (action, value);
+
+	if (window->hex_file == NULL)
+		return;
+
+	rp_hex_file_set_follow (window->hex_file, bEnable);
+	rp_hex_view_toggle_follow (window->hex_view, bEnable);
+}
+
+static void action_cancel_save (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	HexViewerWindow	*window;
+
+	g_assert (data != NULL);
+
+	window = HEXVIEWER_WINDOW (data);
+
+	if (window->save_cancellable != NULL)
+		g_cancellable_cancel (window->save_cancellable);
+}
+
+static void action_find (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+
+	gtk_search_bar_set_search_mode (window->search_bar, TRUE);
+	gtk_widget_grab_focus (GTK_WIDGET (window->search_entry));
+}
+
+/* Search from the cursor for what the search bar holds. The document is
+ * searched as it is now on a worker thread, a new search replaces one
+ * still running.
+ */
+static void hexviewer_window_find (HexViewerWindow *window, gboolean bForward)
+{
+	g_autoptr(GError)	error = NULL;
+	RPSearchPattern		*pattern;
+	const gchar			*text;
+	guint64				from;
+	guint				context_id;
+
+	if (window->hex_file == NULL)
+		return;
+
+	text = gtk_entry_get_text (GTK_ENTRY (window->search_entry));
+
+	if (*text == '\0')
+	{
+		action_find (NULL, NULL, window);
+		return;
+	}
+
+	if (gtk_toggle_button_get_active (window->search_regex))
+		pattern = rp_search_pattern_new_regex (text, g_settings_get_uint (window->settings, "regex-max-length"), &error);
+	else if (gtk_toggle_button_get_active (window->search_text))
+		pattern = rp_search_pattern_new ((const guchar *)text, strlen (text));
 	else
+		pattern = rp_search_pattern_new_from_hex (text, &error);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "find");
+	gtk_statusbar_pop (window->statusbar, context_id);
+
+	if (pattern == NULL)
 	{
-		GtkWidget *dialog = gtk_message_dialog_new (
-			NULL, 
-			GTK_DIALOG_MODAL, 
-			GTK_MESSAGE_INFO, 
-			GTK_BUTTONS_OK, 
-			"Insert mode - Not implemented yet.");
+		gtk_statusbar_push (window->statusbar, context_id, error->message);
+		return;
+	}
+
+	if (window->find_cancellable)
+	{
+		g_cancellable_cancel (window->find_cancellable);
+		g_clear_object (&window->find_cancellable);
+	}
+
+	g_clear_pointer (&window->find_pattern, rp_search_pattern_unref);
+
+	window->find_cancellable	= g_cancellable_new ();
+	window->find_pattern		= pattern;
+
+	// Step past the match found last
+	from = rp_hex_view_get_position (window->hex_view);
+
+	if (bForward && rp_hex_view_has_selection (window->hex_view))
+		from++;
+
+	gtk_statusbar_push (window->statusbar, context_id, "Searching...");
+
+	rp_hex_file_find_async (window->hex_file, pattern, from, bForward, 
+							g_settings_get_uint (window->settings, "search-threads"), window->find_cancellable,
+							callback_find_progress, window,
+							callback_find_done, g_object_ref (window));
+}
+
+static void action_find_next (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	hexviewer_window_find (HEXVIEWER_WINDOW (data), TRUE);
+}
+
+static void action_find_prev (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	hexviewer_window_find (HEXVIEWER_WINDOW (data), FALSE);
+}
+
+static void callback_search_next (GtkSearchEntry *entry, HexViewerWindow *window)
+{
+	hexviewer_window_find (window, TRUE);
+}
+
+static void callback_search_prev (GtkSearchEntry *entry, HexViewerWindow *window)
+{
+	hexviewer_window_find (window, FALSE);
+}
+
+/* Text and regular expression exclude each other, neither means hex bytes */
+static void callback_search_mode (GtkToggleButton *button, HexViewerWindow *window)
+{
+	if (!gtk_toggle_button_get_active (button))
+		return;
+
+	if (button == window->search_text)
+		gtk_toggle_button_set_active (window->search_regex, FALSE);
+	else
+		gtk_toggle_button_set_active (window->search_text, FALSE);
+}
+
+static void callback_search_stopped (GtkSearchEntry *entry, HexViewerWindow *window)
+{
+	if (window->find_cancellable)
+		g_cancellable_cancel (window->find_cancellable);
+
+	gtk_search_bar_set_search_mode (window->search_bar, FALSE);
+
+	if (window->hex_view)
+		gtk_widget_grab_focus (window->hex_view);
+}
+
+static void callback_find_progress (RPHexFile *hex_file, guint64 done, guint64 total, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	gchar			status[64];
+	guint			context_id;
+
+	if (window->hex_file == NULL || window->find_cancellable == NULL)
+		return;
+
+	g_snprintf (status, sizeof(status), "Searching... %d%%", (total > 0) ? (gint)(done * 100 / total) : 100);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "find");
+	gtk_statusbar_pop (window->statusbar, context_id);
+	gtk_statusbar_push (window->statusbar, context_id, status);
+}
+
+/* Length of the match found at address. The search only reports where a
+ * match starts, a regular expression is matched once more to learn where
+ * it ends.
+ */
+static gsize hexviewer_window_match_length (HexViewerWindow *window, guint64 address)
+{
+	gssize match = rp_hex_file_match (window->hex_file, window->find_pattern, address);
+
+	return (match > 0) ? (gsize)match : 1;
+}
+
+static void callback_find_done (GObject *source, GAsyncResult *result, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	GError			*error = NULL;
+	guint64			address = 0;
+	gboolean		bFound;
+	guint			context_id;
+
+	bFound = rp_hex_file_find_finish (RP_HEX_FILE (source), result, &address, &error);
+
+	// Only the newest search counts, the window may be gone as well
+	if (window->hex_file != NULL && window->find_cancellable != NULL &&
+		g_task_get_cancellable (G_TASK (result)) == window->find_cancellable)
+	{
+		g_clear_object (&window->find_cancellable);
+
+		context_id = gtk_statusbar_get_context_id (window->statusbar, "find");
+		gtk_statusbar_pop (window->statusbar, context_id);
+
+		if (bFound)
+			rp_hex_view_select_range (window->hex_view, address, hexviewer_window_match_length (window, address));
+		else if (error == NULL)
+		{
+			gtk_statusbar_push (window->statusbar, context_id, "Not found");
+			gdk_display_beep (gdk_display_get_default ());
+		}
+	}
+
+	g_clear_error (&error);
+	g_object_unref (window);
+}
+
+/* Scan the document for every signature in a signature file at once */
+static void action_scan_signatures (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	HexViewerWindow		*window = HEXVIEWER_WINDOW (data);
+	g_autoptr(GError)	error = NULL;
+	g_autofree gchar	*path = NULL;
+	GtkWidget			*dialog;
+	RPSignatureSet		*set;
+	guint				context_id;
+
+	if (window->hex_file == NULL)
+		return;
+
+	dialog = gtk_file_chooser_dialog_new ("Open Signatures", GTK_WINDOW (window),
+										  GTK_FILE_CHOOSER_ACTION_OPEN,
+										  "Cancel", GTK_RESPONSE_REJECT,
+										  "Open", GTK_RESPONSE_ACCEPT, NULL);
+
+	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+		path = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+
+	gtk_widget_destroy (dialog);
+
+	if (path == NULL)
+		return;
+
+	set = rp_signature_set_new ();
+
+	if (!rp_signature_set_load (set, path, &error))
+	{
+		rp_signature_set_unref (set);
+
+		dialog = gtk_message_dialog_new (GTK_WINDOW (window), 
+										 GTK_DIALOG_MODAL, 
+										 GTK_MESSAGE_ERROR, 
+										 GTK_BUTTONS_OK, 
+										 "Failed to load the signatures: %s", error->message);
 		gtk_dialog_run (GTK_DIALOG (dialog));
 		gtk_widget_destroy (dialog);
+		return;
+	}
+
+	if (window->scan_cancellable)
+	{
+		g_cancellable_cancel (window->scan_cancellable);
+		g_clear_object (&window->scan_cancellable);
+	}
+
+	g_clear_pointer (&window->scan_set, rp_signature_set_unref);
+
+	window->scan_cancellable	= g_cancellable_new ();
+	window->scan_set			= set;
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "scan");
+	gtk_statusbar_pop (window->statusbar, context_id);
+	gtk_statusbar_push (window->statusbar, context_id, "Scanning...");
+
+	rp_hex_file_scan_async (window->hex_file, set, window->scan_cancellable,
+							callback_scan_progress, window,
+							callback_scan_done, g_object_ref (window));
+}
+
+static void callback_scan_progress (RPHexFile *hex_file, guint64 done, guint64 total, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	gchar			status[64];
+	guint			context_id;
+
+	if (window->hex_file == NULL || window->scan_cancellable == NULL)
+		return;
+
+	g_snprintf (status, sizeof(status), "Scanning... %d%%", (total > 0) ? (gint)(done * 100 / total) : 100);
+
+	context_id = gtk_statusbar_get_context_id (window->statusbar, "scan");
+	gtk_statusbar_pop (window->statusbar, context_id);
+	gtk_statusbar_push (window->statusbar, context_id, status);
+}
+
+enum
+{
+	HIT_COLUMN_ADDRESS,
+	HIT_COLUMN_LENGTH,
+	HIT_COLUMN_OFFSET,
+	HIT_COLUMN_NAME,
+	HIT_COLUMNS
+};
 
+static void callback_hit_activated (GtkTreeView *tree_view, GtkTreePath *path, GtkTreeViewColumn *column,
+									HexViewerWindow *window)
+{
+	GtkTreeModel	*model = gtk_tree_view_get_model (tree_view);
+	GtkTreeIter		iter;
+	guint64			address;
+	guint64			len;
+
+	// The hits are only good for the document they were found in
+	if (window->hex_view == NULL || g_object_get_data (G_OBJECT (tree_view), "hex-file") != window->hex_file ||
+		!gtk_tree_model_get_iter (model, &iter, path))
 		return;
+
+	gtk_tree_model_get (model, &iter, HIT_COLUMN_ADDRESS, &address, HIT_COLUMN_LENGTH, &len, -1);
+	rp_hex_view_select_range (window->hex_view, address, len);
+}
+
+static void callback_hit_window_destroyed (GtkWidget *hit_window, HexViewerWindow *window)
+{
+	window->hit_windows = g_list_remove (window->hit_windows, hit_window);
+}
+
+/* List of the hits, activating one selects it in the document */
+static void hexviewer_window_show_hits (HexViewerWindow *window, RPSignatureSet *set, GArray *hits)
+{
+	GtkListStore	*store = gtk_list_store_new (HIT_COLUMNS, G_TYPE_UINT64, G_TYPE_UINT64, G_TYPE_STRING, G_TYPE_STRING);
+	GtkWidget		*hit_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+	GtkWidget		*scrolled = gtk_scrolled_window_new (NULL, NULL);
+	GtkWidget		*tree_view = gtk_tree_view_new_with_model (GTK_TREE_MODEL (store));
+	gint			width = rp_hex_view_get_address_width (window->hex_view);
+	gchar			title[64];
+
+	for (guint i = 0; i < hits->len; i++)
+	{
+		RPSignatureHit	*hit = &g_array_index (hits, RPSignatureHit, i);
+		gchar			offset[32];
+
+		g_snprintf (offset, sizeof(offset), "%0*" G_GINT64_MODIFIER "X", width, hit->address);
+		gtk_list_store_insert_with_values (store, NULL, -1,
+										   HIT_COLUMN_ADDRESS, hit->address,
+										   HIT_COLUMN_LENGTH, (guint64)rp_signature_set_get_length (set, hit->id),
+										   HIT_COLUMN_OFFSET, offset,
+										   HIT_COLUMN_NAME, rp_signature_set_get_name (set, hit->id), -1);
 	}
-	
-	hexviewer_window_update_file_data (window, FALSE);
+
+	g_object_unref (store);
+
+	gtk_tree_view_append_column (GTK_TREE_VIEW (tree_view),
+		gtk_tree_view_column_new_with_attributes ("Offset", gtk_cell_renderer_text_new (), "text", HIT_COLUMN_OFFSET, NULL));
+	gtk_tree_view_append_column (GTK_TREE_VIEW (tree_view),
+		gtk_tree_view_column_new_with_attributes ("Signature", gtk_cell_renderer_text_new (), "text", HIT_COLUMN_NAME, NULL));
+
+	g_object_set_data_full (G_OBJECT (tree_view), "hex-file", g_object_ref (window->hex_file), g_object_unref);
+	g_signal_connect (G_OBJECT (tree_view), "row-activated", G_CALLBACK (callback_hit_activated), window);
+
+	if (hits->len >= RP_SIGNATURE_MAX_HITS)
+		g_snprintf (title, sizeof(title), "Signatures - first %u hits", hits->len);
+	else
+		g_snprintf (title, sizeof(title), "Signatures - %u hits", hits->len);
+
+	gtk_window_set_title (GTK_WINDOW (hit_window), title);
+	gtk_window_set_transient_for (GTK_WINDOW (hit_window), GTK_WINDOW (window));
+	gtk_window_set_destroy_with_parent (GTK_WINDOW (hit_window), TRUE);
+	gtk_window_set_default_size (GTK_WINDOW (hit_window), 400, 500);
+
+	gtk_container_add (GTK_CONTAINER (scrolled), tree_view);
+	gtk_container_add (GTK_CONTAINER (hit_window), scrolled);
+	gtk_widget_show_all (hit_window);
+
+	window->hit_windows = g_list_prepend (window->hit_windows, hit_window);
+	g_signal_connect (G_OBJECT (hit_window), "destroy", G_CALLBACK (callback_hit_window_destroyed), window);
+}
+
+static void callback_scan_done (GObject *source, GAsyncResult *result, gpointer data)
+{
+	HexViewerWindow	*window = HEXVIEWER_WINDOW (data);
+	GError			*error = NULL;
+	GArray			*hits;
+	guint			context_id;
+
+	hits = rp_hex_file_scan_finish (RP_HEX_FILE (source), result, &error);
+
+	// Only the newest scan counts, the window may be gone as well
+	if (window->hex_file != NULL && window->scan_cancellable != NULL &&
+		g_task_get_cancellable (G_TASK (result)) == window->scan_cancellable)
+	{
+		g_clear_object (&window->scan_cancellable);
+
+		context_id = gtk_statusbar_get_context_id (window->statusbar, "scan");
+		gtk_statusbar_pop (window->statusbar, context_id);
+
+		if (hits != NULL && hits->len > 0)
+			hexviewer_window_show_hits (window, window->scan_set, hits);
+		else if (hits != NULL)
+			gtk_statusbar_push (window->statusbar, context_id, "No signatures found");
+	}
+
+	g_clear_pointer (&hits, g_array_unref);
+	g_clear_error (&error);
+	g_object_unref (window);
 }
 
 static void action_print_print (GSimpleAction *action, GVariant *parameter, gpointer data)
@@ -313,6 +1100,10 @@ static void action_print_print (GSimpleAction *action, GVariant *parameter, gpoi
 	g_assert (data != NULL);
 
 	window 		= HEXVIEWER_WINDOW (data);
+
+	if (window->hex_file == NULL)
+		return;
+
 	file_name 	= rp_hex_file_get_file_name (window->hex_file);
 
 	g_snprintf (print_title, sizeof(print_title), "HexViewer - %s", file_name);
@@ -342,6 +1133,30 @@ static void action_preferences (GSimpleAction *action, GVariant *parameter, gpoi
 	gtk_window_present (GTK_WINDOW (prefs));
 }
 
+static void action_edit_undo (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	HexViewerWindow	*window;
+
+	g_assert (data != NULL);
+
+	window = HEXVIEWER_WINDOW (data);
+
+	if (window->hex_view)
+		rp_hex_view_undo (window->hex_view);
+}
+
+static void action_edit_redo (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	HexViewerWindow	*window;
+
+	g_assert (data != NULL);
+
+	window = HEXVIEWER_WINDOW (data);
+
+	if (window->hex_view)
+		rp_hex_view_redo (window->hex_view);
+}
+
 static void action_prefs (GSettings *settings, gchar *key, gpointer user_data)
 {
 	HexViewerWindow	*window;
@@ -352,9 +1167,37 @@ static void action_prefs (GSettings *settings, gchar *key, gpointer user_data)
 
 	window = HEXVIEWER_WINDOW (user_data);
 
-	if (!window->hex_view)
+	if (!window->hex_view || !window->hex_file)
 		return;
 
+	if (strcmp (key, "cache-size") == 0)
+	{
+		guint iSize = g_settings_get_uint (settings, key);
+		g_message ("Win: Action Prefs called. %s with %u MiB", key, iSize);
+		rp_hex_file_set_cache_size (window->hex_file, (gsize)iSize * 1024 * 1024);
+	}
+	else
+	if (strcmp (key, "save-sync") == 0)
+	{
+		g_message ("Win: Action Prefs called. %s", key);
+		rp_hex_file_set_sync_mode (window->hex_file, hexviewer_window_get_sync_mode (settings));
+	}
+	else
+	if (strcmp (key, "prefetch-viewports") == 0)
+	{
+		guint iViewports = g_settings_get_uint (settings, key);
+		g_message ("Win: Action Prefs called. %s with %u", key, iViewports);
+		rp_hex_view_set_prefetch (window->hex_view, iViewports);
+	}
+	else
+	if (strcmp (key, "undo-limit") == 0)
+	{
+		guint iSize = g_settings_get_uint (settings, key);
+		g_message ("Win: Action Prefs called. %s with %u MiB", key, iSize);
+		rp_hex_file_set_undo_limit (window->hex_file, (gsize)iSize * 1024 * 1024);
+	}
+	else
+
 	if (strcmp (key, "show-addresses") == 0)
 	{
 		bEnable = g_settings_get_boolean (settings, key);
@@ -0,0 +1,126 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpaddbuffer.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "rpaddbuffer.h"
+
+#define RP_ADD_BUFFER_MIN_CHUNK	(4 * 1024)
+#define RP_ADD_BUFFER_MAX_CHUNK	(1024 * 1024)
+
+struct _RPAddBuffer
+{
+    GPtrArray	*chunks;
+    guchar		*tail;			// Next free byte in the newest chunk
+    gsize		room;			// Free bytes left after tail
+    gsize		next_chunk;		// Size of the next regular chunk
+    gsize		size;			// Bytes handed out so far
+    gint		ref_count;
+};
+
+RPAddBuffer *rp_add_buffer_new (void)
+{
+    RPAddBuffer *add_buffer = g_new0 (RPAddBuffer, 1);
+
+    add_buffer->chunks		= g_ptr_array_new_with_free_func (g_free);
+    add_buffer->next_chunk	= RP_ADD_BUFFER_MIN_CHUNK;
+    add_buffer->ref_count	= 1;
+
+    return add_buffer;
+}
+
+RPAddBuffer *rp_add_buffer_ref (RPAddBuffer *add_buffer)
+{
+    g_atomic_int_inc (&add_buffer->ref_count);
+
+    return add_buffer;
+}
+
+void rp_add_buffer_unref (RPAddBuffer *add_buffer)
+{
+    if (add_buffer == NULL || !g_atomic_int_dec_and_test (&add_buffer->ref_count))
+        return;
+
+    g_ptr_array_unref (add_buffer->chunks);
+    g_free (add_buffer);
+}
+
+/* Releases all memory, every pointer handed out before becomes invalid */
+void rp_add_buffer_clear (RPAddBuffer *add_buffer)
+{
+    g_ptr_array_set_size (add_buffer->chunks, 0);
+
+    add_buffer->tail		= NULL;
+    add_buffer->room		= 0;
+    add_buffer->next_chunk	= RP_ADD_BUFFER_MIN_CHUNK;
+    add_buffer->size		= 0;
+}
+
+/* Copy len bytes into the buffer and return where they were put. With
+ * data == NULL the space is only reserved for the caller to fill in.
+ * Chunks double in size up to RP_ADD_BUFFER_MAX_CHUNK, larger appends
+ * (big pastes) get a chunk of their own.
+ */
+guchar *rp_add_buffer_append (RPAddBuffer *add_buffer, const guchar *data, gsize len)
+{
+    guchar *mem;
+
+    if (len > add_buffer->room)
+    {
+        gsize chunk_len = MAX (len, add_buffer->next_chunk);
+
+        mem = g_malloc (chunk_len);
+        g_ptr_array_add (add_buffer->chunks, mem);
+
+        add_buffer->tail = mem;
+        add_buffer->room = chunk_len;
+
+        if (add_buffer->next_chunk < RP_ADD_BUFFER_MAX_CHUNK)
+            add_buffer->next_chunk *= 2;
+    }
+
+    mem = add_buffer->tail;
+
+    if (data != NULL)
+        memcpy (mem, data, len);
+
+    add_buffer->tail += len;
+    add_buffer->room -= len;
+    add_buffer->size += len;
+
+    return mem;
+}
+
+/* Append len bytes directly behind 'end' if that is the last byte handed
+ * out and the chunk has room left. Lets a run of keystrokes grow a single
+ * slice without copying it.
+ */
+gboolean rp_add_buffer_extend (RPAddBuffer *add_buffer, const guchar *end, const guchar *data, gsize len)
+{
+    if (end != add_buffer->tail || len > add_buffer->room)
+        return FALSE;
+
+    rp_add_buffer_append (add_buffer, data, len);
+
+    return TRUE;
+}
+
+gsize rp_add_buffer_get_size (RPAddBuffer *add_buffer)
+{
+    return add_buffer->size;
+}
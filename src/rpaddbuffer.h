@@ -0,0 +1,45 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpaddbuffer.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_ADD_BUFFER_H__
+#define __RP_ADD_BUFFER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Append-only arena holding every byte typed or pasted into a document.
+ * Memory is handed out from a list of chunks that never move or shrink,
+ * so pointers returned by rp_add_buffer_append stay valid until the
+ * buffer is cleared or its last reference dropped. loc_mem pieces and
+ * undo records point straight into it.
+ */
+typedef struct _RPAddBuffer	RPAddBuffer;
+
+RPAddBuffer	*rp_add_buffer_new (void);
+RPAddBuffer	*rp_add_buffer_ref (RPAddBuffer *add_buffer);
+void		rp_add_buffer_unref (RPAddBuffer *add_buffer);
+void		rp_add_buffer_clear (RPAddBuffer *add_buffer);
+guchar		*rp_add_buffer_append (RPAddBuffer *add_buffer, const guchar *data, gsize len);
+gboolean	rp_add_buffer_extend (RPAddBuffer *add_buffer, const guchar *end, const guchar *data, gsize len);
+gsize		rp_add_buffer_get_size (RPAddBuffer *add_buffer);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,353 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpbench.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Timings for the document and search code without the GUI:
+ *
+ *   rpbench [--size=MIB] [--rounds=N] [--keystrokes=N] [--raw] [FILE]
+ *
+ * FILE is opened read-only and never written to, a gzip file is inflated
+ * unless --raw is given. Without one a temporary
+ * file of random bytes is used, that one is opened for writing so typing
+ * goes to the journal too. Every search figure is the best of several
+ * rounds over data that is in the page cache already.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "rphexfile.h"
+#include "rpsearch.h"
+
+#define RP_BENCH_BLOCK_SIZE		(1024 * 1024)
+#define RP_BENCH_PATTERN_LEN	16
+#define RP_BENCH_STEPS			10
+#define RP_BENCH_MEMORY_MAX		(1024 * 1024 * 1024)
+
+static gint		bench_size		= 256;
+static gint		bench_rounds	= 3;
+static gint		bench_keystrokes = 100000;
+static gboolean	bench_raw		= FALSE;
+
+static GOptionEntry bench_entries[] =
+{
+    { "size", 's', 0, G_OPTION_ARG_INT, &bench_size, "Size of the temporary file in MiB", "MIB" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &bench_rounds, "Rounds per figure, the best one counts", "N" },
+    { "keystrokes", 'k', 0, G_OPTION_ARG_INT, &bench_keystrokes, "Bytes typed into the document", "N" },
+    { "raw", 0, 0, G_OPTION_ARG_NONE, &bench_raw, "Don't inflate a gzip file", NULL },
+    { NULL }
+};
+
+/* Fill a temporary file with pseudo random bytes, returns its name */
+static gchar *rp_bench_make_file (guint64 size, GError **error)
+{
+    gchar		*path = NULL;
+    guint64		*block;
+    guint64		state = 0x9e3779b97f4a7c15;
+    guint64		done;
+    gint		fd;
+
+    fd = g_file_open_tmp ("rpbench-XXXXXX", &path, error);
+
+    if (fd < 0)
+        return NULL;
+
+    block = g_malloc (RP_BENCH_BLOCK_SIZE);
+
+    for (done = 0; done < size; )
+    {
+        gsize	len = MIN (RP_BENCH_BLOCK_SIZE, size - done);
+        gssize	actual;
+
+        for (gsize i = 0; i < RP_BENCH_BLOCK_SIZE / sizeof (guint64); i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[i] = state;
+        }
+
+        actual = write (fd, block, len);
+
+        if (actual < 0 && errno == EINTR)
+            continue;
+
+        if (actual < 0)
+        {
+            gint saved_errno = errno;
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                         "Can't write %s: %s", path, g_strerror (saved_errno));
+            break;
+        }
+
+        done += actual;
+    }
+
+    g_free (block);
+    close (fd);
+
+    if (done < size)
+    {
+        g_unlink (path);
+        g_clear_pointer (&path, g_free);
+    }
+
+    return path;
+}
+
+static void rp_bench_random_bytes (guchar *bytes, gsize len)
+{
+    for (gsize i = 0; i < len; i++)
+        bytes[i] = g_random_int_range (0, 256);
+}
+
+/* Best time in seconds for a forward pass over the whole snapshot */
+static gdouble rp_bench_find (RPHexSnapshot *snapshot, RPSearchPattern *pattern, guint threads)
+{
+    gdouble	best = G_MAXDOUBLE;
+
+    for (gint round = 0; round < bench_rounds; round++)
+    {
+        gint64	start = g_get_monotonic_time ();
+        guint64	address;
+
+        if (rp_hex_snapshot_find (snapshot, pattern, 0, TRUE, threads, NULL, &address))
+            g_print ("  pattern found at %" G_GUINT64_FORMAT ", the pass ended early\n", address);
+
+        best = MIN (best, (g_get_monotonic_time () - start) / 1e6);
+    }
+
+    return best;
+}
+
+/* Search the whole document for a pattern that isn't in it, with one
+ * thread up to one per processor
+ */
+static void rp_bench_search (RPHexFile *hex_file)
+{
+    RPHexSnapshot	*snapshot = rp_hex_file_snapshot (hex_file);
+    guint64			size = rp_hex_snapshot_get_size (snapshot);
+    guint			processors = g_get_num_processors ();
+    guchar			bytes[RP_BENCH_PATTERN_LEN];
+    RPSearchPattern	*pattern;
+    gdouble			base = 0;
+
+    rp_bench_random_bytes (bytes, sizeof (bytes));
+    pattern = rp_search_pattern_new (bytes, sizeof (bytes));
+
+    g_print ("search: %" G_GUINT64_FORMAT " MiB, %d byte pattern, %u processors\n",
+             size >> 20, RP_BENCH_PATTERN_LEN, processors);
+    g_print ("  threads      MiB/s  speedup\n");
+
+    // Fault the file in before anything is timed
+    rp_bench_find (snapshot, pattern, processors);
+
+    for (guint threads = 1; threads <= processors; threads++)
+    {
+        gdouble	best = rp_bench_find (snapshot, pattern, threads);
+
+        if (threads == 1)
+            base = best;
+
+        g_print ("  %7u %10.0f %8.2f\n", threads, size / best / (1024 * 1024), base / best);
+    }
+
+    rp_search_pattern_unref (pattern);
+    rp_hex_snapshot_unref (snapshot);
+}
+
+/* Compare the search kernel with memmem from the C library, both going
+ * forward over up to 1 GiB of the document copied to memory. What find
+ * adds on top of the kernel is the difference to the 1 thread figure.
+ */
+static void rp_bench_memmem (RPHexFile *hex_file)
+{
+    RPHexSnapshot	*snapshot = rp_hex_file_snapshot (hex_file);
+    gsize			len = MIN (rp_hex_snapshot_get_size (snapshot), RP_BENCH_MEMORY_MAX);
+    guchar			*buf = g_malloc (len);
+    guchar			bytes[RP_BENCH_PATTERN_LEN];
+    RPSearchPattern	*pattern;
+    gdouble			best_memmem = G_MAXDOUBLE;
+    gdouble			best_scan = G_MAXDOUBLE;
+    guint			found = 0;
+
+    len = rp_hex_snapshot_get_data (snapshot, buf, len, 0);
+    rp_bench_random_bytes (bytes, sizeof (bytes));
+    pattern = rp_search_pattern_new (bytes, sizeof (bytes));
+
+    for (gint round = 0; round < bench_rounds; round++)
+    {
+        gint64	start = g_get_monotonic_time ();
+        gint64	middle;
+
+        if (memmem (buf, len, bytes, sizeof (bytes)) != NULL)
+            found++;
+
+        middle = g_get_monotonic_time ();
+
+        if (rp_search_pattern_scan (pattern, buf, len, TRUE) >= 0)
+            found++;
+
+        best_memmem	= MIN (best_memmem, (middle - start) / 1e6);
+        best_scan	= MIN (best_scan, (g_get_monotonic_time () - middle) / 1e6);
+    }
+
+    g_print ("memory: %" G_GSIZE_FORMAT " MiB, %d byte pattern\n", len >> 20, RP_BENCH_PATTERN_LEN);
+    g_print ("               MiB/s\n");
+    g_print ("  memmem  %10.0f\n", len / best_memmem / (1024 * 1024));
+    g_print ("  kernel  %10.0f\n", len / best_scan / (1024 * 1024));
+
+    if (found > 0)
+        g_print ("  pattern found, the passes ended early\n");
+
+    rp_search_pattern_unref (pattern);
+    g_free (buf);
+    rp_hex_snapshot_unref (snapshot);
+}
+
+/* Type into the document the way RPHexView does, in runs of up to 64
+ * keystrokes at random places, inserting or overtyping. The time per
+ * keystroke is printed for every tenth of them, it shouldn't grow with
+ * the number of edits before.
+ */
+static void rp_bench_typing (RPHexFile *hex_file)
+{
+    guint64	address = 0;
+    guint	num_entered = 0;
+    guint	run = 0;
+    gboolean	bInsert = TRUE;
+    gint	step = MAX (bench_keystrokes / RP_BENCH_STEPS, 1);
+    gint64	start = g_get_monotonic_time ();
+
+    g_print ("typing: %d keystrokes in runs at random places, journal %s\n",
+             bench_keystrokes, rp_hex_file_is_read_only (hex_file) ? "off" : "on");
+    g_print ("  keystrokes   ns/key   pieces\n");
+
+    for (gint i = 1; i <= bench_keystrokes; i++)
+    {
+        guchar c = 'a' + i % 26;
+
+        if (run == 0)
+        {
+            run			= g_random_int_range (1, 65);
+            bInsert		= g_random_boolean ();
+            address		= rp_hex_file_get_size (hex_file) * g_random_double ();
+            num_entered	= 0;
+        }
+
+        if (address == rp_hex_file_get_size (hex_file))
+            bInsert = TRUE;
+
+        rp_hex_file_begin_user_action (hex_file);
+        rp_hex_file_change_data (hex_file, bInsert ? mod_insert : mod_replace, address, 1, &c,
+                                 num_entered);
+        rp_hex_file_end_user_action (hex_file);
+
+        address++;
+        num_entered += 2;
+        run--;
+
+        if (i % step == 0 || i == bench_keystrokes)
+        {
+            gint64 now = g_get_monotonic_time ();
+
+            g_print ("  %10d %8.0f %8u\n", i, (now - start) * 1000.0 / (i % step ? i % step : step),
+                     rp_piece_tree_get_count (hex_file->loc));
+            start = now;
+        }
+    }
+
+    rp_hex_file_discard_journal (hex_file);
+}
+
+int main (int argc, char *argv[])
+{
+    GOptionContext	*context;
+    GError			*error = NULL;
+    gchar			*temp_path = NULL;
+    const gchar		*path;
+    GFile			*file;
+    RPHexFile		*hex_file;
+    RPHexFileOpenFlags	flags = RP_HEX_FILE_OPEN_NONE;
+
+    context = g_option_context_new ("[FILE] - time the document and search code of HexViewer");
+    g_option_context_add_main_entries (context, bench_entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+        return 1;
+    }
+
+    g_option_context_free (context);
+    bench_rounds = MAX (bench_rounds, 1);
+
+    if (argc > 1)
+        path = argv[1];
+    else
+    {
+        temp_path = rp_bench_make_file ((guint64)MAX (bench_size, 1) << 20, &error);
+
+        if (temp_path == NULL)
+        {
+            g_printerr ("%s\n", error->message);
+            g_error_free (error);
+            return 1;
+        }
+
+        path = temp_path;
+    }
+
+    if (temp_path == NULL)
+        flags |= RP_HEX_FILE_OPEN_READ_ONLY;
+
+    if (bench_raw)
+        flags |= RP_HEX_FILE_OPEN_RAW;
+
+    file = g_file_new_for_path (path);
+    hex_file = rp_hex_file_new_with_file (file, flags, &error);
+    g_object_unref (file);
+
+    if (hex_file == NULL)
+    {
+        g_printerr ("Can't open %s: %s\n", path, error->message);
+        g_error_free (error);
+
+        if (temp_path != NULL)
+            g_unlink (temp_path);
+
+        g_free (temp_path);
+        return 1;
+    }
+
+    rp_bench_search (hex_file);
+    rp_bench_memmem (hex_file);
+    rp_bench_typing (hex_file);
+
+    g_object_unref (hex_file);
+
+    if (temp_path != NULL)
+        g_unlink (temp_path);
+
+    g_free (temp_path);
+    return 0;
+}
@@ -0,0 +1,295 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpblockcache.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "rpblockcache.h"
+
+typedef struct _RPCacheBlock RPCacheBlock;
+
+struct _RPCacheBlock
+{
+    guint64	index;		// Block number, offset / RP_BLOCK_CACHE_BLOCK_SIZE
+    gsize	len;		// Less than a full block only at end of file
+    gboolean prefetched;	// Read ahead and not looked at yet
+    GList	link;		// Position in the LRU queue
+    guchar	data[RP_BLOCK_CACHE_BLOCK_SIZE];
+};
+
+struct _RPBlockCache
+{
+    gsize			budget;		// Memory budget in bytes
+    gsize			used;
+    GHashTable		*blocks;	// Block number -> RPCacheBlock
+    GQueue			lru;		// Most recently used block at the head
+    RPBlockFillFunc	fill;
+    gpointer		user_data;
+    guint64			hits;
+    guint64			misses;
+    guint64			prefetched;	// Blocks added by rp_block_cache_insert
+    guint64			prefetch_hits;
+    guint64			prefetch_wasted;	// Evicted before anyone read them
+};
+
+RPBlockCache *rp_block_cache_new (gsize budget, RPBlockFillFunc fill, gpointer user_data)
+{
+    RPBlockCache *cache = g_new0 (RPBlockCache, 1);
+
+    cache->budget		= budget;
+    cache->blocks		= g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, g_free);
+    cache->fill			= fill;
+    cache->user_data	= user_data;
+    g_queue_init (&cache->lru);
+
+    return cache;
+}
+
+void rp_block_cache_free (RPBlockCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    g_message ("BlockCache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+               cache->hits, cache->misses);
+    g_message ("BlockCache: %" G_GUINT64_FORMAT " prefetched, %" G_GUINT64_FORMAT " used, %" 
+               G_GUINT64_FORMAT " wasted", cache->prefetched, cache->prefetch_hits, cache->prefetch_wasted);
+
+    g_hash_table_destroy (cache->blocks);
+    g_free (cache);
+}
+
+static void rp_block_cache_remove (RPBlockCache *cache, RPCacheBlock *block)
+{
+    g_queue_unlink (&cache->lru, &block->link);
+    cache->used -= sizeof (RPCacheBlock);
+    g_hash_table_remove (cache->blocks, &block->index);
+}
+
+/* Drop least recently used blocks until we are within budget */
+static void rp_block_cache_evict (RPBlockCache *cache)
+{
+    while (cache->used > cache->budget && cache->lru.tail != NULL)
+    {
+        RPCacheBlock *block = cache->lru.tail->data;
+
+        if (block->prefetched)
+            cache->prefetch_wasted++;
+
+        rp_block_cache_remove (cache, block);
+    }
+}
+
+void rp_block_cache_set_budget (RPBlockCache *cache, gsize budget)
+{
+    cache->budget = budget;
+    rp_block_cache_evict (cache);
+}
+
+void rp_block_cache_clear (RPBlockCache *cache)
+{
+    g_hash_table_remove_all (cache->blocks);
+    g_queue_init (&cache->lru);
+    cache->used = 0;
+}
+
+/* Forget all cached blocks overlapping the given file range */
+void rp_block_cache_invalidate (RPBlockCache *cache, guint64 offset, guint64 len)
+{
+    guint64 first, last;
+
+    if (len == 0)
+        return;
+
+    first	= offset / RP_BLOCK_CACHE_BLOCK_SIZE;
+    last	= (offset + len - 1) / RP_BLOCK_CACHE_BLOCK_SIZE;
+
+    if (last - first < g_hash_table_size (cache->blocks))
+    {
+        for (guint64 i = first; i <= last; i++)
+        {
+            RPCacheBlock *block = g_hash_table_lookup (cache->blocks, &i);
+
+            if (block != NULL)
+                rp_block_cache_remove (cache, block);
+        }
+    }
+    else
+    {
+        GHashTableIter	iter;
+        RPCacheBlock	*block;
+
+        g_hash_table_iter_init (&iter, cache->blocks);
+
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&block))
+        {
+            if (block->index >= first && block->index <= last)
+            {
+                g_queue_unlink (&cache->lru, &block->link);
+                cache->used -= sizeof (RPCacheBlock);
+                g_hash_table_iter_remove (&iter);
+            }
+        }
+    }
+}
+
+static RPCacheBlock *rp_block_cache_get_block (RPBlockCache *cache, guint64 index)
+{
+    RPCacheBlock	*block = g_hash_table_lookup (cache->blocks, &index);
+    gssize			actual;
+
+    if (block != NULL)
+    {
+        cache->hits++;
+
+        if (block->prefetched)
+        {
+            cache->prefetch_hits++;
+            block->prefetched = FALSE;
+        }
+
+        g_queue_unlink (&cache->lru, &block->link);
+        g_queue_push_head_link (&cache->lru, &block->link);
+        return block;
+    }
+
+    cache->misses++;
+
+    block = g_malloc (sizeof (RPCacheBlock));
+    actual = cache->fill (cache->user_data, index * RP_BLOCK_CACHE_BLOCK_SIZE,
+                          block->data, RP_BLOCK_CACHE_BLOCK_SIZE);
+
+    if (actual <= 0)
+    {
+        g_free (block);
+        return NULL;
+    }
+
+    block->index		= index;
+    block->len			= actual;
+    block->prefetched	= FALSE;
+    block->link.data	= block;
+    block->link.prev	= block->link.next = NULL;
+
+    g_hash_table_insert (cache->blocks, &block->index, block);
+    g_queue_push_head_link (&cache->lru, &block->link);
+    cache->used += sizeof (RPCacheBlock);
+
+    rp_block_cache_evict (cache);
+
+    return block;
+}
+
+/* TRUE if the block holding offset is cached. Doesn't count as a use. */
+gboolean rp_block_cache_contains (RPBlockCache *cache, guint64 offset)
+{
+    guint64 index = offset / RP_BLOCK_CACHE_BLOCK_SIZE;
+
+    return g_hash_table_contains (cache->blocks, &index);
+}
+
+/* Add a block read ahead of time by someone else, offset must be block
+ * aligned. Blocks that got cached meanwhile are left alone.
+ */
+void rp_block_cache_insert (RPBlockCache *cache, guint64 offset, const guchar *data, gsize len)
+{
+    RPCacheBlock	*block;
+    guint64			index = offset / RP_BLOCK_CACHE_BLOCK_SIZE;
+
+    g_return_if_fail (offset % RP_BLOCK_CACHE_BLOCK_SIZE == 0 && len <= RP_BLOCK_CACHE_BLOCK_SIZE);
+
+    if (len == 0 || cache->budget < sizeof (RPCacheBlock) || g_hash_table_contains (cache->blocks, &index))
+        return;
+
+    block = g_malloc (sizeof (RPCacheBlock));
+    memcpy (block->data, data, len);
+
+    block->index		= index;
+    block->len			= len;
+    block->prefetched	= TRUE;
+    block->link.data	= block;
+    block->link.prev	= block->link.next = NULL;
+
+    g_hash_table_insert (cache->blocks, &block->index, block);
+    g_queue_push_head_link (&cache->lru, &block->link);
+    cache->used += sizeof (RPCacheBlock);
+    cache->prefetched++;
+
+    rp_block_cache_evict (cache);
+}
+
+/* Copy len bytes at offset into buf, filling missing blocks on the way.
+ * Returns the number of bytes copied, which is short at end of file or on
+ * a read error.
+ */
+gsize rp_block_cache_read (RPBlockCache *cache, guint64 offset, guchar *buf, gsize len)
+{
+    gsize done = 0;
+
+    // No room for even a single block, read straight through
+    if (cache->budget < sizeof (RPCacheBlock))
+    {
+        gssize actual = cache->fill (cache->user_data, offset, buf, len);
+
+        return MAX (actual, 0);
+    }
+
+    while (done < len)
+    {
+        guint64 	pos		= offset + done;
+        gsize		start	= pos % RP_BLOCK_CACHE_BLOCK_SIZE;
+        gsize		tocopy;
+        RPCacheBlock *block;
+
+        block = rp_block_cache_get_block (cache, pos / RP_BLOCK_CACHE_BLOCK_SIZE);
+
+        if (block == NULL || start >= block->len)
+            break;
+
+        // The block may be evicted by the next lookup, copy it out now
+        tocopy = MIN (len - done, block->len - start);
+        memcpy (buf + done, block->data + start, tocopy);
+        done += tocopy;
+
+        if (block->len < RP_BLOCK_CACHE_BLOCK_SIZE)
+            break;
+    }
+
+    return done;
+}
+
+void rp_block_cache_get_stats (RPBlockCache *cache, guint64 *hits, guint64 *misses)
+{
+    if (hits)
+        *hits = cache->hits;
+
+    if (misses)
+        *misses = cache->misses;
+}
+
+void rp_block_cache_get_prefetch_stats (RPBlockCache *cache, guint64 *prefetched, guint64 *used, 
+                                        guint64 *wasted)
+{
+    if (prefetched)
+        *prefetched = cache->prefetched;
+
+    if (used)
+        *used = cache->prefetch_hits;
+
+    if (wasted)
+        *wasted = cache->prefetch_wasted;
+}
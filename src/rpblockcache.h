@@ -0,0 +1,55 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpblockcache.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_BLOCK_CACHE_H__
+#define __RP_BLOCK_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Cache of aligned file blocks for backends where every read is expensive
+ * (GIO streams on NFS, FUSE, remote URIs). Blocks are evicted in least
+ * recently used order once the memory budget is exceeded. A budget of 0
+ * disables caching and passes every read straight to the fill function.
+ */
+#define RP_BLOCK_CACHE_BLOCK_SIZE	(64 * 1024)
+
+typedef struct _RPBlockCache	RPBlockCache;
+
+/* Reads up to len bytes at offset into buf, returns the number of bytes
+ * read (short at end of file) or -1 on error.
+ */
+typedef gssize (*RPBlockFillFunc) (gpointer user_data, guint64 offset, guchar *buf, gsize len);
+
+RPBlockCache	*rp_block_cache_new (gsize budget, RPBlockFillFunc fill, gpointer user_data);
+void			rp_block_cache_free (RPBlockCache *cache);
+void			rp_block_cache_set_budget (RPBlockCache *cache, gsize budget);
+void			rp_block_cache_clear (RPBlockCache *cache);
+void			rp_block_cache_invalidate (RPBlockCache *cache, guint64 offset, guint64 len);
+gsize			rp_block_cache_read (RPBlockCache *cache, guint64 offset, guchar *buf, gsize len);
+gboolean		rp_block_cache_contains (RPBlockCache *cache, guint64 offset);
+void			rp_block_cache_insert (RPBlockCache *cache, guint64 offset, const guchar *data, gsize len);
+void			rp_block_cache_get_stats (RPBlockCache *cache, guint64 *hits, guint64 *misses);
+void			rp_block_cache_get_prefetch_stats (RPBlockCache *cache, guint64 *prefetched, guint64 *used,
+                                                   guint64 *wasted);
+
+G_END_DECLS
+
+#endif
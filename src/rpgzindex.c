@@ -0,0 +1,613 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpgzindex.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <glib/gstdio.h>
+#include "rpgzindex.h"
+
+#define RP_GZ_INDEX_WINDOW		32768			// Farthest a deflate match reaches back
+#define RP_GZ_INDEX_CHUNK		(64 * 1024)		// Compressed bytes read at once
+#define RP_GZ_INDEX_MAX_POINTS	16384			// Wider spans for larger files
+#define RP_GZ_INDEX_REPORT		(100 * 1000)	// µs between progress reports
+#define RP_GZ_INDEX_MAGIC		"RPGZIDX1"
+
+typedef struct
+{
+    guint64	out;			// Offset in the uncompressed data
+    guint64	in;				// First full byte of the deflate block in the file
+    gint	bits;			// Bits of the block in the byte before, 0 to 7
+    guchar	*window;		// Output in front of out, compressed
+    gsize	window_len;
+} RPGzPoint;
+
+struct _RPGzIndex
+{
+    gint		ref_count;
+    gint		fd;
+    gchar		*cache_path;	// Where the index is kept between runs
+    guint64		span;			// Output between two checkpoints
+    GMutex		lock;			// Guards points, size and complete
+    GArray		*points;
+    guint64		size;			// Uncompressed bytes that can be read
+    gboolean	complete;
+};
+
+/* Checks the magic bytes, the name may be anything */
+gboolean rp_gz_index_is_gzip (const gchar *path)
+{
+    guchar	magic[2];
+    gint	fd = g_open (path, O_RDONLY, 0);
+    gssize	actual;
+
+    if (fd < 0)
+        return FALSE;
+
+    actual = pread (fd, magic, sizeof (magic), 0);
+    close (fd);
+
+    return actual == sizeof (magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/* Indexes are looked up by inode, size and modification time of the
+ * file, a rewritten file doesn't find the old one.
+ */
+static gchar *rp_gz_index_cache_path (struct stat *st)
+{
+    g_autofree gchar *name = NULL;
+
+    name = g_strdup_printf ("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%"
+                            G_GINT64_MODIFIER "x.%09ld.idx", (guint64)st->st_dev, (guint64)st->st_ino,
+                            (guint64)st->st_size, (guint64)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+
+    return g_build_filename (g_get_user_cache_dir (), "hexviewer", "gzindex", name, NULL);
+}
+
+RPGzIndex *rp_gz_index_new (const gchar *path, GError **error)
+{
+    RPGzIndex	*index;
+    struct stat	st;
+    gint		fd = g_open (path, O_RDONLY, 0);
+
+    if (fd < 0 || fstat (fd, &st) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't open %s: %s", path, g_strerror (saved_errno));
+
+        if (fd >= 0)
+            close (fd);
+
+        return NULL;
+    }
+
+    index = g_new0 (RPGzIndex, 1);
+
+    index->ref_count	= 1;
+    index->fd			= fd;
+    index->cache_path	= rp_gz_index_cache_path (&st);
+    index->span			= MAX (RP_GZ_INDEX_SPAN, st.st_size / RP_GZ_INDEX_MAX_POINTS * 4);
+    index->points		= g_array_new (FALSE, FALSE, sizeof (RPGzPoint));
+    g_mutex_init (&index->lock);
+
+    return index;
+}
+
+RPGzIndex *rp_gz_index_ref (RPGzIndex *index)
+{
+    g_atomic_int_inc (&index->ref_count);
+
+    return index;
+}
+
+void rp_gz_index_unref (RPGzIndex *index)
+{
+    if (index == NULL || !g_atomic_int_dec_and_test (&index->ref_count))
+        return;
+
+    for (guint i = 0; i < index->points->len; i++)
+        g_free (g_array_index (index->points, RPGzPoint, i).window);
+
+    g_array_free (index->points, TRUE);
+    g_mutex_clear (&index->lock);
+    g_free (index->cache_path);
+    close (index->fd);
+    g_free (index);
+}
+
+/* window holds the RP_GZ_INDEX_WINDOW bytes of output in front of out */
+static gboolean rp_gz_index_add_point (RPGzIndex *index, guint64 out, guint64 in, gint bits,
+                                       const guchar *window)
+{
+    RPGzPoint	point;
+    uLongf		len = compressBound (RP_GZ_INDEX_WINDOW);
+
+    point.out		= out;
+    point.in		= in;
+    point.bits		= bits;
+    point.window	= g_malloc (len);
+
+    if (compress2 (point.window, &len, window, RP_GZ_INDEX_WINDOW, 1) != Z_OK)
+    {
+        g_free (point.window);
+        return FALSE;
+    }
+
+    point.window		= g_realloc (point.window, len);
+    point.window_len	= len;
+
+    g_mutex_lock (&index->lock);
+    g_array_append_val (index->points, point);
+    index->size = out;
+    g_mutex_unlock (&index->lock);
+
+    return TRUE;
+}
+
+/* Inflate the whole file once, adding a checkpoint at the first deflate
+ * block boundary after every span bytes of output. Files of several
+ * members, as pigz and bgzip write them, are followed to the last one,
+ * trailing garbage is ignored. A truncated file keeps what was indexed.
+ */
+gboolean rp_gz_index_build (RPGzIndex *index, GCancellable *cancellable, RPGzIndexProgress progress,
+                            gpointer user_data, GError **error)
+{
+    z_stream			strm;
+    g_autofree guchar	*input = g_malloc (RP_GZ_INDEX_CHUNK);
+    g_autofree guchar	*window = g_malloc0 (RP_GZ_INDEX_WINDOW);
+    g_autofree guchar	*linear = g_malloc (RP_GZ_INDEX_WINDOW);
+    guint64				pos = 0;
+    guint64				totin = 0;
+    guint64				totout = 0;
+    guint64				last = 0;
+    gint64				reported = 0;
+    gboolean			bMemberEnd = FALSE;
+    gboolean			bRet = FALSE;
+    gint				ret;
+
+    memset (&strm, 0, sizeof (strm));
+
+    // 47: 32 + 15, a gzip or zlib header is detected
+    if (inflateInit2 (&strm, 47) != Z_OK)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Out of memory");
+        return FALSE;
+    }
+
+    for (;;)
+    {
+        if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            break;
+
+        if (strm.avail_in == 0)
+        {
+            gssize actual = pread (index->fd, input, RP_GZ_INDEX_CHUNK, pos);
+
+            if (actual < 0 && errno == EINTR)
+                continue;
+
+            if (actual < 0)
+            {
+                gint saved_errno = errno;
+                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                             "Error reading compressed data: %s", g_strerror (saved_errno));
+                break;
+            }
+
+            if (actual == 0)
+            {
+                bRet = bMemberEnd;
+
+                if (!bRet)
+                    g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                                 "Compressed data ends after %" G_GUINT64_FORMAT " bytes", totout);
+                break;
+            }
+
+            pos				+= actual;
+            strm.next_in	= input;
+            strm.avail_in	= actual;
+        }
+
+        if (bMemberEnd)
+        {
+            if (strm.next_in[0] != 0x1f)
+            {
+                bRet = TRUE;
+                break;
+            }
+
+            inflateReset (&strm);
+            bMemberEnd = FALSE;
+        }
+
+        // The last 32 KiB of output stay in window, written round
+        if (strm.avail_out == 0)
+        {
+            strm.next_out	= window;
+            strm.avail_out	= RP_GZ_INDEX_WINDOW;
+        }
+
+        totin	+= strm.avail_in;
+        totout	+= strm.avail_out;
+        ret		= inflate (&strm, Z_BLOCK);
+        totin	-= strm.avail_in;
+        totout	-= strm.avail_out;
+
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Corrupt compressed data at %"
+                         G_GUINT64_FORMAT ": %s", totin, strm.msg ? strm.msg : "out of memory");
+            break;
+        }
+
+        if (ret == Z_STREAM_END)
+        {
+            bMemberEnd = TRUE;
+            continue;
+        }
+
+        // Between two blocks, and not behind the last one of a member
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > index->span))
+        {
+            gsize head = RP_GZ_INDEX_WINDOW - strm.avail_out;
+
+            memcpy (linear, window + head, strm.avail_out);
+            memcpy (linear + strm.avail_out, window, head);
+
+            if (!rp_gz_index_add_point (index, totout, totin, strm.data_type & 7, linear))
+            {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Out of memory");
+                break;
+            }
+
+            last = totout;
+
+            if (progress != NULL && g_get_monotonic_time () - reported > RP_GZ_INDEX_REPORT)
+            {
+                progress (totout, user_data);
+                reported = g_get_monotonic_time ();
+            }
+        }
+    }
+
+    inflateEnd (&strm);
+
+    // Everything inflated can be read, even if the rest is broken
+    g_mutex_lock (&index->lock);
+    index->size		= (index->points->len > 0) ? totout : 0;
+    index->complete	= bRet;
+    g_mutex_unlock (&index->lock);
+
+    if (progress != NULL)
+        progress (index->size, user_data);
+
+    return bRet;
+}
+
+/* Read the index written for this file before, FALSE if there is none */
+gboolean rp_gz_index_load (RPGzIndex *index)
+{
+    g_autofree gchar	*contents = NULL;
+    gsize				length;
+    const gchar			*p;
+    const gchar			*end;
+    guint64				size;
+    guint32				count;
+    GArray				*points;
+
+    if (!g_file_get_contents (index->cache_path, &contents, &length, NULL) ||
+        length < strlen (RP_GZ_INDEX_MAGIC) + sizeof (size) + sizeof (count) ||
+        memcmp (contents, RP_GZ_INDEX_MAGIC, strlen (RP_GZ_INDEX_MAGIC)) != 0)
+        return FALSE;
+
+    p	= contents + strlen (RP_GZ_INDEX_MAGIC);
+    end	= contents + length;
+
+    memcpy (&size, p, sizeof (size));
+    p += sizeof (size);
+    memcpy (&count, p, sizeof (count));
+    p += sizeof (count);
+
+    points = g_array_sized_new (FALSE, FALSE, sizeof (RPGzPoint), count);
+
+    for (guint32 i = 0; i < count; i++)
+    {
+        RPGzPoint	point;
+        guint32		bits, window_len;
+
+        if (end - p < (gssize)(2 * sizeof (guint64) + 2 * sizeof (guint32)))
+            break;
+
+        memcpy (&point.out, p, sizeof (guint64));
+        memcpy (&point.in, p + 8, sizeof (guint64));
+        memcpy (&bits, p + 16, sizeof (guint32));
+        memcpy (&window_len, p + 20, sizeof (guint32));
+        p += 24;
+
+        if (end - p < (gssize)window_len || bits > 7)
+            break;
+
+        point.bits			= bits;
+        point.window		= g_malloc (window_len);
+        point.window_len	= window_len;
+        memcpy (point.window, p, window_len);
+        p += window_len;
+
+        g_array_append_val (points, point);
+    }
+
+    if (points->len != count || count == 0)
+    {
+        for (guint i = 0; i < points->len; i++)
+            g_free (g_array_index (points, RPGzPoint, i).window);
+
+        g_array_free (points, TRUE);
+        return FALSE;
+    }
+
+    g_mutex_lock (&index->lock);
+    g_array_free (index->points, TRUE);
+    index->points	= points;
+    index->size		= size;
+    index->complete	= TRUE;
+    g_mutex_unlock (&index->lock);
+
+    return TRUE;
+}
+
+/* Keep a complete index for the next time the file is opened */
+gboolean rp_gz_index_save (RPGzIndex *index, GError **error)
+{
+    g_autofree gchar	*dir = g_path_get_dirname (index->cache_path);
+    GByteArray			*data;
+    guint32				count;
+    gboolean			bRet;
+
+    g_return_val_if_fail (index->complete, FALSE);
+
+    if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't create %s: %s", dir, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    count	= index->points->len;
+    data	= g_byte_array_new ();
+
+    g_byte_array_append (data, (const guint8 *)RP_GZ_INDEX_MAGIC, strlen (RP_GZ_INDEX_MAGIC));
+    g_byte_array_append (data, (const guint8 *)&index->size, sizeof (index->size));
+    g_byte_array_append (data, (const guint8 *)&count, sizeof (count));
+
+    for (guint32 i = 0; i < count; i++)
+    {
+        RPGzPoint	*point = &g_array_index (index->points, RPGzPoint, i);
+        guint32		bits = point->bits;
+        guint32		window_len = point->window_len;
+
+        g_byte_array_append (data, (const guint8 *)&point->out, sizeof (point->out));
+        g_byte_array_append (data, (const guint8 *)&point->in, sizeof (point->in));
+        g_byte_array_append (data, (const guint8 *)&bits, sizeof (bits));
+        g_byte_array_append (data, (const guint8 *)&window_len, sizeof (window_len));
+        g_byte_array_append (data, point->window, window_len);
+    }
+
+    bRet = g_file_set_contents (index->cache_path, (const gchar *)data->data, data->len, error);
+    g_byte_array_unref (data);
+
+    return bRet;
+}
+
+/* Uncompressed bytes that can be read now */
+guint64 rp_gz_index_get_size (RPGzIndex *index)
+{
+    guint64 size;
+
+    g_mutex_lock (&index->lock);
+    size = index->size;
+    g_mutex_unlock (&index->lock);
+
+    return size;
+}
+
+gboolean rp_gz_index_is_complete (RPGzIndex *index)
+{
+    gboolean complete;
+
+    g_mutex_lock (&index->lock);
+    complete = index->complete;
+    g_mutex_unlock (&index->lock);
+
+    return complete;
+}
+
+/* Copy out the last checkpoint at or before offset, FALSE if there is
+ * none yet
+ */
+static gboolean rp_gz_index_find_point (RPGzIndex *index, guint64 offset, RPGzPoint *point)
+{
+    guint lo = 0;
+    guint hi;
+
+    g_mutex_lock (&index->lock);
+
+    hi = index->points->len;
+
+    while (hi - lo > 1)
+    {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (g_array_index (index->points, RPGzPoint, mid).out <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // The windows are never freed or moved before the index is
+    if (hi > 0)
+        *point = g_array_index (index->points, RPGzPoint, lo);
+
+    g_mutex_unlock (&index->lock);
+
+    return hi > 0;
+}
+
+/* Reads up to len bytes at offset, inflating from the closest checkpoint.
+ * Safe to call from any thread, also while the index is being built.
+ * Returns the number of bytes read, short at the end of the data, or -1.
+ */
+gssize rp_gz_index_read (RPGzIndex *index, guint64 offset, guchar *buf, gsize len)
+{
+    z_stream			strm;
+    RPGzPoint			point;
+    g_autofree guchar	*window = NULL;
+    g_autofree guchar	*input = NULL;
+    uLongf				window_len = RP_GZ_INDEX_WINDOW;
+    guint64				pos;
+    guint64				skip;
+    gsize				done = 0;
+    gint				trailer = 0;		// Bytes of a member trailer still to skip
+    gboolean			bRaw = TRUE;		// No gzip header or trailer expected
+    gboolean			bNextMember = FALSE;
+    gint				ret = Z_OK;
+
+    if (len == 0 || !rp_gz_index_find_point (index, offset, &point))
+        return 0;
+
+    window = g_malloc (RP_GZ_INDEX_WINDOW);
+
+    if (uncompress (window, &window_len, point.window, point.window_len) != Z_OK ||
+        window_len != RP_GZ_INDEX_WINDOW)
+        return -1;
+
+    memset (&strm, 0, sizeof (strm));
+
+    if (inflateInit2 (&strm, -15) != Z_OK)
+        return -1;
+
+    // The checkpoint block may start inside a byte
+    if (point.bits > 0)
+    {
+        guchar c;
+
+        if (pread (index->fd, &c, 1, point.in - 1) != 1)
+        {
+            inflateEnd (&strm);
+            return -1;
+        }
+
+        inflatePrime (&strm, point.bits, c >> (8 - point.bits));
+    }
+
+    inflateSetDictionary (&strm, window, RP_GZ_INDEX_WINDOW);
+
+    input	= g_malloc (RP_GZ_INDEX_CHUNK);
+    pos		= point.in;
+    skip	= offset - point.out;
+
+    while (done < len)
+    {
+        guint before;
+
+        if (strm.avail_in == 0)
+        {
+            gssize actual = pread (index->fd, input, RP_GZ_INDEX_CHUNK, pos);
+
+            if (actual < 0 && errno == EINTR)
+                continue;
+
+            if (actual <= 0)
+            {
+                ret = (actual < 0) ? Z_ERRNO : Z_OK;
+                break;
+            }
+
+            pos				+= actual;
+            strm.next_in	= input;
+            strm.avail_in	= actual;
+        }
+
+        if (trailer > 0)
+        {
+            guint n = MIN ((guint)trailer, strm.avail_in);
+
+            strm.next_in	+= n;
+            strm.avail_in	-= n;
+            trailer			-= n;
+            bNextMember		= (trailer == 0);
+            continue;
+        }
+
+        if (bNextMember)
+        {
+            if (strm.next_in[0] != 0x1f)
+                break;
+
+            // The header of the next member is parsed by zlib
+            inflateReset2 (&strm, 31);
+            bRaw		= FALSE;
+            bNextMember	= FALSE;
+        }
+
+        // Output in front of offset goes to window, which is free now
+        if (skip > 0)
+        {
+            strm.next_out	= window;
+            strm.avail_out	= MIN (skip, RP_GZ_INDEX_WINDOW);
+        }
+        else
+        {
+            strm.next_out	= buf + done;
+            strm.avail_out	= MIN (len - done, G_MAXUINT);
+        }
+
+        before	= strm.avail_out;
+        ret		= inflate (&strm, Z_NO_FLUSH);
+
+        if (skip > 0)
+            skip -= before - strm.avail_out;
+        else
+            done += before - strm.avail_out;
+
+        if (ret == Z_STREAM_END)
+        {
+            // Raw inflate leaves the 8 byte gzip trailer, gzip mode eats it
+            trailer		= bRaw ? 8 : 0;
+            bNextMember	= !bRaw;
+            ret			= Z_OK;
+            continue;
+        }
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            break;
+    }
+
+    inflateEnd (&strm);
+
+    if (done == 0 && ret != Z_OK && ret != Z_BUF_ERROR)
+        return -1;
+
+    return done;
+}
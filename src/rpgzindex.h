@@ -0,0 +1,59 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpgzindex.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_GZ_INDEX_H__
+#define __RP_GZ_INDEX_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Random access into a gzip file. One pass over the file records a
+ * checkpoint about every RP_GZ_INDEX_SPAN bytes of output: where the
+ * deflate block starts in the compressed file and the 32 KiB of output in
+ * front of it. A read then only inflates from the closest checkpoint
+ * before it. Windows are kept compressed, in memory and on disk.
+ *
+ * Checkpoints are added by rp_gz_index_build on one thread while others
+ * read what is indexed so far.
+ */
+#define RP_GZ_INDEX_SPAN	(1024 * 1024)
+
+typedef struct _RPGzIndex	RPGzIndex;
+
+/* Called from the thread running rp_gz_index_build with the number of
+ * bytes that can be read so far.
+ */
+typedef void (*RPGzIndexProgress) (guint64 size, gpointer user_data);
+
+gboolean	rp_gz_index_is_gzip (const gchar *path);
+RPGzIndex	*rp_gz_index_new (const gchar *path, GError **error);
+RPGzIndex	*rp_gz_index_ref (RPGzIndex *index);
+void		rp_gz_index_unref (RPGzIndex *index);
+gboolean	rp_gz_index_build (RPGzIndex *index, GCancellable *cancellable, RPGzIndexProgress progress,
+                               gpointer user_data, GError **error);
+gboolean	rp_gz_index_load (RPGzIndex *index);
+gboolean	rp_gz_index_save (RPGzIndex *index, GError **error);
+guint64		rp_gz_index_get_size (RPGzIndex *index);
+gboolean	rp_gz_index_is_complete (RPGzIndex *index);
+gssize		rp_gz_index_read (RPGzIndex *index, guint64 offset, guchar *buf, gsize len);
+
+G_END_DECLS
+
+#endif
@@ -17,60 +17,120 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include <glib/gstdio.h>
 #include "rphexfile.h"
 
+#define RP_HEX_FILE_OPEN_ATTRIBUTES		G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+										G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+										G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE "," \
+										G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+										G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+#define RP_HEX_FILE_DISK_ATTRIBUTES		G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+										G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+										G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+#define RP_HEX_FILE_COPY_BUFFER_SIZE	(1024 * 1024)
+#define RP_HEX_FILE_COPY_CHUNK_SIZE		(64 * 1024 * 1024)	// Work between two progress reports
+#define RP_HEX_FILE_GAP_BRIDGE			4096		// Unchanged bytes rewritten to join two patches
+#define RP_HEX_FILE_GAP_BUFFER_SIZE		(64 * 1024)
+#define RP_HEX_FILE_MAX_IOV				1024		// IOV_MAX on Linux
+#define RP_HEX_FILE_FOLLOW_RATE_LIMIT	200			// ms between change events while following
+#define RP_HEX_FILE_MONITOR_RATE_LIMIT	800			// GFileMonitor default
+#define RP_HEX_FILE_MIN_HOLE			(64 * 1024)	// Smaller holes are read like data
+#define RP_HEX_FILE_MAX_HOLES			65536
+#define RP_HEX_FILE_COMPACT_MIN			(1024 * 1024)	// Dead add buffer bytes worth a compaction
+
+/* Journal records next to the mod_type ones */
+enum { journal_undo = 'u', journal_redo = 'r', journal_begin = '{', journal_end = '}' };
+
 enum
 {
 	DATA_CHANGED,
+	DISK_CHANGED,
+	DATA_APPENDED,
 	LAST_SIGNAL
 };
 
 static gint class_signals[LAST_SIGNAL] = { 0 };
 
-doc_loc *doc_loc_mem_new (guchar *mem, size_t l)
+static doc_loc doc_loc_mem (guchar *mem, guint64 l)
+{
+    doc_loc dl;
+
+    dl.location	= loc_mem;
+    dl.len		= l;
+    dl.memaddr	= mem;
+
+    return dl;
+}
+
+static doc_loc doc_loc_file (guint64 file_addr, guint64 l)
 {
-    doc_loc *dl 	= g_malloc0 (sizeof(doc_loc));
-    dl->location	= loc_mem;
-    dl->len			= l; 
-    dl->memaddr 	= mem;
+    doc_loc dl;
+
+    dl.location	= loc_file;
+    dl.len 		= l;
+    dl.fileaddr	= file_addr;
 
     return dl;
 }
 
-doc_loc *doc_loc_file_new (guint32 file_addr, size_t l)
+/* Part of the file that is a hole, reads as zeros without any I/O */
+static doc_loc doc_loc_zero (guint64 file_addr, guint64 l)
 {
-    doc_loc *dl		= g_malloc0 (sizeof(doc_loc));
-    dl->location	= loc_file;
-    dl->len 		= l;
-    dl->fileaddr	= file_addr;
+    doc_loc dl;
+
+    dl.location	= loc_zero;
+    dl.len 		= l;
+    dl.fileaddr	= file_addr;
 
     return dl;
 }
 
-doc_undo *doc_undo_new (enum mod_type u, guint32 a, guint32 l, guchar *p)
+/* p is not copied, it must point into the add buffer of the document */
+doc_undo *doc_undo_new (enum mod_type u, guint64 a, guint64 l, guchar *p)
 {
 	doc_undo *du = g_malloc0 (sizeof(doc_undo));
 
-	du->limit   = 0;
     du->utype   = u; 
 	du->len     = l; 
 	du->address = a;
-    
-	if (p != NULL)
-    {
-		du->ptr = g_malloc0 (MAX (du->limit, du->len));
-		memcpy (du->ptr, p, du->len);
-    }
-	else
-		du->ptr = NULL;
+	du->ptr     = p;
+	du->removed = g_array_new (FALSE, FALSE, sizeof (doc_loc));
 
     return du;
 }
 
+void doc_undo_free (doc_undo *du)
+{
+	g_array_free (du->removed, TRUE);
+	g_free (du);
+}
+
+/* Memory accounted to a record against the undo limit */
+static gsize doc_undo_size (doc_undo *du)
+{
+	return sizeof (doc_undo) + du->removed->len * sizeof (doc_loc) + (du->ptr ? du->len : 0);
+}
+
 static GObjectClass *parent_class = NULL;
 
 static void rp_hex_file_finalize    (GObject *object);
 static void rp_hex_file_dispose	    (GObject *object);
+static void rp_hex_file_watch       (RPHexFile *hex_file, GFile *file);
+static gint rp_hex_file_open_source (RPHexFile *hex_file);
+static void rp_hex_file_start_index (RPHexFile *hex_file);
 
 static void rp_hex_file_class_init (RPHexFileClass *klass)
 {
@@ -79,6 +139,8 @@ static void rp_hex_file_class_init (RPHexFileClass *klass)
     parent_class = g_type_class_peek_parent(klass);
     
     klass->data_changed     = NULL;
+    klass->disk_changed     = NULL;
+    klass->data_appended    = NULL;
     gobject_class->finalize = rp_hex_file_finalize;
 	gobject_class->dispose	= rp_hex_file_dispose;
 
@@ -93,6 +155,30 @@ static void rp_hex_file_class_init (RPHexFileClass *klass)
 									1,
 									G_TYPE_BOOLEAN);
 
+    class_signals[DISK_CHANGED]	= g_signal_new ("disk_changed",
+									G_TYPE_FROM_CLASS (gobject_class),
+					  				G_SIGNAL_RUN_LAST,
+					  				G_STRUCT_OFFSET (RPHexFileClass, disk_changed),
+					  				NULL,
+									NULL,
+									NULL,
+									G_TYPE_NONE,
+									2,
+									G_TYPE_UINT64,
+									G_TYPE_UINT64);
+
+    class_signals[DATA_APPENDED] = g_signal_new ("data_appended",
+									G_TYPE_FROM_CLASS (gobject_class),
+					  				G_SIGNAL_RUN_LAST,
+					  				G_STRUCT_OFFSET (RPHexFileClass, data_appended),
+					  				NULL,
+									NULL,
+									NULL,
+									G_TYPE_NONE,
+									2,
+									G_TYPE_UINT64,
+									G_TYPE_UINT64);
+
 	g_message ("HexFile: called Class Init");
 }
 
@@ -101,10 +187,39 @@ static void rp_hex_file_init (RPHexFile *hex_file)
 	hex_file->file_name		= NULL;
 	hex_file->file_size		= 0;
 	hex_file->data_stream	= NULL;
-	hex_file->loc			= NULL;
-    hex_file->undo			= NULL;
+	hex_file->cache			= NULL;
+	hex_file->mapped_file	= NULL;
+	hex_file->map_data		= NULL;
+	hex_file->loc			= rp_piece_tree_new ();
+	hex_file->add_buffer	= rp_add_buffer_new ();
+    hex_file->undo			= g_queue_new ();
+    hex_file->redo			= g_queue_new ();
+    hex_file->undo_bytes	= 0;
+    hex_file->add_dead		= 0;
+    hex_file->undo_limit	= RP_HEX_FILE_DEFAULT_UNDO_LIMIT;
+    hex_file->undo_group	= 0;
+    hex_file->user_action	= 0;
+    hex_file->can_coalesce	= FALSE;
+    hex_file->save_point	= NULL;
+    hex_file->save_point_lost = FALSE;
     hex_file->read_only     = TRUE;
     hex_file->is_modified   = FALSE;
+    hex_file->sync_mode     = RP_HEX_FILE_SYNC_DATA;
+    hex_file->saving        = FALSE;
+    hex_file->monitor       = NULL;
+    hex_file->disk_size     = 0;
+    hex_file->disk_mtime    = 0;
+    hex_file->disk_changed  = FALSE;
+    hex_file->follow        = FALSE;
+    hex_file->prefetch_pool = NULL;
+    hex_file->prefetch_context = NULL;
+    hex_file->prefetch_gen  = 0;
+    hex_file->prefetch_last = G_MAXUINT64;
+    hex_file->prefetch_requested = 0;
+    hex_file->sector_size   = 0;
+    hex_file->gz_index      = NULL;
+    hex_file->gz_cancellable = NULL;
+    g_mutex_init (&hex_file->stream_lock);
 
 	g_message ("HexFile: called Init");
 }
@@ -136,6 +251,7 @@ GType rp_hex_file_get_type (void)
 static void rp_hex_file_finalize (GObject *object)
 {
 	g_message ("HexFile: called Finalize");
+	g_mutex_clear (&RP_HEX_FILE (object)->stream_lock);
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -147,8 +263,51 @@ static void rp_hex_file_dispose (GObject *object)
 	g_return_if_fail (RP_IS_HEX_FILE (hex_file));
 
     /* free stuff */
+    if (hex_file->monitor != NULL)
+    {
+        g_file_monitor_cancel (hex_file->monitor);
+        g_signal_handlers_disconnect_by_data (hex_file->monitor, hex_file);
+        g_clear_object (&hex_file->monitor);
+    }
+
+    // Every queued read holds a reference, nothing is left to wait for
+    if (hex_file->prefetch_pool != NULL)
+    {
+        g_message ("HexFile: %" G_GUINT64_FORMAT " blocks prefetched", hex_file->prefetch_requested);
+        g_thread_pool_free (hex_file->prefetch_pool, TRUE, TRUE);
+        hex_file->prefetch_pool = NULL;
+    }
+
+    g_clear_pointer (&hex_file->prefetch_context, g_main_context_unref);
+
+    // The index build finds the document gone and stops
+    if (hex_file->gz_cancellable != NULL)
+        g_cancellable_cancel (hex_file->gz_cancellable);
+
+    g_clear_object (&hex_file->gz_cancellable);
+
+    // Closing throws the edits away, only a crash leaves a journal behind
+    if (hex_file->journal != NULL)
+        rp_journal_discard (hex_file->journal);
+
+    g_clear_pointer (&hex_file->journal, rp_journal_free);
+
 	g_free (hex_file->file_name);
-	g_list_free (hex_file->loc);
+	hex_file->file_name = NULL;
+	hex_file->map_data = NULL;
+	g_clear_pointer (&hex_file->mapped_file, g_mapped_file_unref);
+	g_clear_pointer (&hex_file->cache, rp_block_cache_free);
+	g_clear_pointer (&hex_file->gz_index, rp_gz_index_unref);
+	g_clear_object (&hex_file->data_stream);
+	g_clear_pointer (&hex_file->loc, rp_piece_tree_free);
+	g_clear_pointer (&hex_file->add_buffer, rp_add_buffer_unref);
+	if (hex_file->undo != NULL)
+		g_queue_free_full (hex_file->undo, (GDestroyNotify)doc_undo_free);
+
+	if (hex_file->redo != NULL)
+		g_queue_free_full (hex_file->redo, (GDestroyNotify)doc_undo_free);
+
+	hex_file->undo = hex_file->redo = NULL;
 
 	G_OBJECT_CLASS (parent_class)->dispose (object);	
 }
@@ -164,479 +323,2879 @@ RPHexFile *rp_hex_file_new ()
 	return hex_file;
 }
 
-RPHexFile *rp_hex_file_new_with_file (GFile *file, gboolean open_read_only, GError *error)
+static gssize rp_hex_file_read_stream_at (RPHexFile *hex_file, guint64 offset, guchar *buf, gsize len)
 {
-	RPHexFile	*hex_file = NULL;
-	GFileInfo	*hex_file_info = NULL;	
-    guint32     fsize = 0;
-    gboolean    bCanWrite;
-    g_autoptr(GFileInputStream)	input_stream = NULL;
-    error = NULL;
-	
-	hex_file_info = g_file_query_info (file, "*", G_FILE_QUERY_INFO_NONE, NULL, &error );
-	g_return_val_if_fail (hex_file_info != NULL, NULL);
-
-    fsize       = g_file_info_get_size (hex_file_info);
-    bCanWrite   = g_file_info_get_attribute_boolean (hex_file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE);
-
-    g_object_unref (hex_file_info);
-
-    if (fsize >= G_MAXUINT32)
-    {
-        error->domain   = G_FILE_ERROR;
-        error->code     = G_FILE_ERROR_FAILED;
-        error->message  = "File is too big.";
-        return NULL;
-    }
-
-	input_stream = g_file_read (file, NULL, &error);
-	g_return_val_if_fail (input_stream != NULL, NULL);
+    gsize       actual = 0;
+    gboolean    bRet;
 
-	hex_file = rp_hex_file_new ();
-	g_return_val_if_fail (hex_file != NULL, NULL);
+    // A background save reads from the same stream
+    g_mutex_lock (&hex_file->stream_lock);
 
-	hex_file->file_name     = g_file_get_parse_name (file);
-	hex_file->file_size     = fsize;
-	hex_file->real_file_size = hex_file->file_size;
-    hex_file->read_only     = !bCanWrite;
-    hex_file->data_stream   = g_data_input_stream_new (G_INPUT_STREAM (input_stream));
+    // The document may have switched to a mapping under a prefetch
+    bRet = hex_file->data_stream != NULL &&
+           g_seekable_seek (G_SEEKABLE (hex_file->data_stream), offset, G_SEEK_SET, NULL, NULL) &&
+           g_input_stream_read_all (G_INPUT_STREAM (hex_file->data_stream), buf, len, &actual, NULL, NULL);
 
-	hex_file->loc = g_list_append (hex_file->loc, doc_loc_file_new (0, hex_file->file_size));
-	
-	return hex_file;
-}
+    g_mutex_unlock (&hex_file->stream_lock);
 
-gboolean rp_hex_file_is_read_only (RPHexFile *hex_file)
-{
-    return hex_file->read_only;
+    return bRet ? (gssize)actual : -1;
 }
 
-gchar *rp_hex_file_get_file_name (RPHexFile *hex_file)
+/* Fill function of the block cache, reads from the GIO stream. Devices
+ * are read in whole logical sectors, cache blocks already are. gzip files
+ * are inflated from the closest checkpoint of their index.
+ */
+static gssize rp_hex_file_read_stream (gpointer user_data, guint64 offset, guchar *buf, gsize len)
 {
-	return hex_file->file_name;
-}
+    RPHexFile           *hex_file = user_data;
+    guint               sector = hex_file->sector_size;
+    g_autofree guchar   *bounce = NULL;
+    guint64             first;
+    gsize               span;
+    gssize              actual;
 
-guint32 rp_hex_file_get_data (RPHexFile *hex_file, guchar *buf, guint32 len, guint32 address)
-{
-	guint32 pos = 0;
-	guint32 tocopy;
-	GList	*locList;
-	GError	*error = NULL;
+    if (hex_file->gz_index != NULL)
+        return rp_gz_index_read (hex_file->gz_index, offset, buf, len);
 
-	g_assert (address >= 0);
+    if (sector == 0 || (offset % sector == 0 && len % sector == 0))
+        return rp_hex_file_read_stream_at (hex_file, offset, buf, len);
 
-	locList = g_list_first (hex_file->loc);
+    first   = offset - offset % sector;
+    span    = (offset + len - first + sector - 1) / sector * sector;
+    bounce  = g_malloc (span);
+    actual  = rp_hex_file_read_stream_at (hex_file, first, bounce, span);
 
-	for (guint i = 0; i < g_list_length (hex_file->loc); i++)
-	{
-		struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-		
-		if (address < pos + dl->len)
-            break;
+    if (actual < 0)
+        return -1;
 
-		pos += dl->len;
-		locList = g_list_next (locList);
-	}
+    actual = CLAMP (actual - (gssize)(offset - first), 0, (gssize)len);
+    memcpy (buf, bounce + (offset - first), actual);
 
-	guint32 left = len;
-	guint32 start = address - pos;
-	
-	for (left = len; left > 0 && locList != NULL; left -= tocopy, buf += tocopy)
-	{
-		struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-		tocopy = MIN (left, dl->len - start);
+    return actual;
+}
 
-		if (dl->location == loc_mem)
-			memcpy (buf, dl->memaddr + start, tocopy);
-		else
-		{
-        	g_assert (dl->location == loc_file);
+#ifdef __linux__
+/* Block devices report a size of 0 through GIO, ask the kernel instead.
+ * Character devices, pipes and sockets have no size to ask for, those
+ * aren't opened rather than shown as an empty document.
+ */
+static gboolean rp_hex_file_probe_device (const gchar *path, guint64 *size, guint *sector_size,
+                                          GError **error)
+{
+    struct stat st;
+    gint        fd;
+    gint        sector = 0;
+    gint        saved_errno;
 
-			g_seekable_seek ((GSeekable*)hex_file->data_stream, dl->fileaddr + start, G_SEEK_SET, NULL, &error);
-			
-			guint32 actual = g_input_stream_read (G_INPUT_STREAM(hex_file->data_stream), buf, tocopy, NULL, &error);
-			
-			if (actual != tocopy)
-			{
-				// something went wrong here
-                g_assert (0);
-				left -= actual;
-				break;
-			}
-		}
+    // A pipe without a writer would block the open
+    fd = g_open (path, O_RDONLY | O_NONBLOCK, 0);
 
-		start = 0;
-		pos += dl->len;
-		locList = g_list_next (locList);
+    if (fd < 0)
+    {
+        saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't open %s: %s", path, g_strerror (saved_errno));
+        return FALSE;
     }
 
-    // Return the actual number of bytes written to buf
-    return len - left;
-}
-
-void loc_split (RPHexFile *hex_file, guint32 address, guint32 pos, GList *locList)
-{  
-    struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-
-	g_assert (address > pos && address < pos + dl->len);
-	g_assert (dl->location == loc_file || dl->location == loc_mem);
-	
-	guint32 split = pos + dl->len - address;
-
-	GList *plNext = g_list_next (locList);
-    gint lPos = g_list_position (hex_file->loc, plNext);
-    
-	if (dl->location == loc_file)
+    if (fstat (fd, &st) == 0 && !S_ISBLK (st.st_mode))
     {
-		hex_file->loc = g_list_insert (hex_file->loc, doc_loc_file_new (dl->fileaddr + dl->len - split, split), lPos);
-        g_message ("Split: Add file rec: addr %i, len: %i", dl->fileaddr + dl->len - split, split);
+        close (fd);
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "Can't open %s: only regular files and block devices have a size", path);
+        return FALSE;
     }
+
+    if (ioctl (fd, BLKGETSIZE64, size) != 0 || ioctl (fd, BLKSSZGET, &sector) != 0)
+        saved_errno = errno;
     else
+        saved_errno = sector > 0 ? 0 : EINVAL;
+
+    close (fd);
+
+    if (saved_errno != 0)
     {
-		hex_file->loc = g_list_insert (hex_file->loc, doc_loc_mem_new (dl->memaddr + dl->len - split, split), lPos);
-        g_message ("Split: Add mem rec: addr: %hhn, len: %i, pos: %i", dl->memaddr + dl->len - split, split, lPos);
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't get the size of %s: %s", path, g_strerror (saved_errno));
+        return FALSE;
     }
 
-    dl->len -= split;
+    *sector_size = sector;
+
+    return TRUE;
 }
+#endif
 
-GList* loc_del (RPHexFile *hex_file, guint32 address, guint32 len, guint32 *pos, GList *locList)
+/* Attach the file contents as the base of the document. Local regular
+ * files are mapped, everything else is read through GIO. Whatever backend
+ * was attached before is dropped. A file that grew since fsize was taken
+ * is mapped as it is now.
+ */
+static gboolean rp_hex_file_open_backend (RPHexFile *hex_file, GFile *file, gboolean bRegular, 
+                                          guint64 fsize, GError **error)
 {
-    GList   *byebye;
-    guint32 deleted = 0;
+    g_autofree gchar *path = NULL;
+    g_autoptr(GFileInputStream)	input_stream = NULL;
+    GMappedFile *mapped_file = NULL;
 
-	struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-    
-	if (address != *pos)
+    path = g_file_get_path (file);
+
+    if (path != NULL && bRegular)
     {
-        loc_split (hex_file, address, *pos, locList);
-        *pos += dl->len;
-		locList = g_list_next (locList);
-        dl = ((struct _doc_loc*)(locList->data));
+        mapped_file = g_mapped_file_new (path, FALSE, NULL);
+
+        if (mapped_file != NULL && g_mapped_file_get_length (mapped_file) < fsize)
+            g_clear_pointer (&mapped_file, g_mapped_file_unref);
     }
 
-    while (locList != NULL && len >= deleted + dl->len)
-    {        
-        byebye = locList;
-        deleted += dl->len;
-		locList = g_list_next (locList);
+    if (mapped_file == NULL)
+    {
+	    input_stream = g_file_read (file, NULL, error);
 
-		hex_file->loc = g_list_delete_link (hex_file->loc, byebye);
+        if (input_stream == NULL)
+            return FALSE;
     }
 
-    if (locList != NULL && len > deleted)
-    {   
-        dl = ((struct _doc_loc*)(locList->data));
-		loc_split (hex_file, address + len, address + deleted, locList);
-        
-        byebye = locList;
-        deleted += dl->len;
-        locList = g_list_next (locList);
-        	
-        hex_file->loc = g_list_delete_link (hex_file->loc, byebye);
-    }
-    
-    g_assert (deleted == len);
+    // Prefetched blocks still on their way come from the old backend
+    g_atomic_int_inc (&hex_file->prefetch_gen);
 
-    return locList;
-}
+    g_mutex_lock (&hex_file->stream_lock);
+	hex_file->map_data = NULL;
+	g_clear_pointer (&hex_file->mapped_file, g_mapped_file_unref);
+	g_clear_object (&hex_file->data_stream);
+    g_mutex_unlock (&hex_file->stream_lock);
 
-GList* loc_add (RPHexFile *hex_file, struct _doc_undo *pu, guint32 *pos, GList *locList)
-{	
-	if (locList != NULL && locList->data != NULL && pu->address != *pos)
+    if (mapped_file != NULL)
     {
-        struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-        
-        loc_split (hex_file, pu->address, *pos, locList);
-        
-        *pos += dl->len;
-		locList = g_list_next (locList);
-    }
-	
-    if (locList == NULL || locList->data == NULL)
-    {
-        hex_file->loc = g_list_append (hex_file->loc, doc_loc_mem_new (pu->ptr, pu->len));
+        hex_file->mapped_file   = mapped_file;
+        hex_file->map_data      = (const guchar *)g_mapped_file_get_contents (mapped_file);
+        g_clear_pointer (&hex_file->cache, rp_block_cache_free);
+        g_message ("HexFile: mapped %s", path);
     }
     else
     {
-        gint lPos = g_list_position (hex_file->loc, locList);
-	    hex_file->loc = g_list_insert (hex_file->loc, doc_loc_mem_new (pu->ptr, pu->len), lPos);
+        g_mutex_lock (&hex_file->stream_lock);
+        hex_file->data_stream   = g_data_input_stream_new (G_INPUT_STREAM (input_stream));
+        g_mutex_unlock (&hex_file->stream_lock);
+
+        if (hex_file->cache != NULL)
+            rp_block_cache_clear (hex_file->cache);
+        else
+            hex_file->cache     = rp_block_cache_new (RP_HEX_FILE_DEFAULT_CACHE_SIZE,
+                                                      rp_hex_file_read_stream, hex_file);
     }
 
-    *pos += pu->len;
-    
-    return locList;
+    return TRUE;
 }
 
-void rp_hex_file_recreate_loc_list (RPHexFile *hex_file)
+/* Make the whole file the document. Holes of a sparse local file become
+ * zero pieces, so neither drawing nor saving reads them. Small holes and
+ * those past RP_HEX_FILE_MAX_HOLES are left to the filesystem.
+ */
+static void rp_hex_file_insert_file (RPHexFile *hex_file)
 {
-	guint32 pos = 0;
-	GList 	*undoList;
-	GList 	*locList;
-    GList   *tmp;
+    guint64 size = hex_file->file_size;
+    guint64 pos = 0;
+    guint64 holed = 0;
+    gint    fd = -1;
 
-	g_list_free (hex_file->loc);
-    hex_file->loc = NULL;
-
-	hex_file->loc = g_list_append (hex_file->loc, doc_loc_file_new (0, hex_file->real_file_size));
-
-    undoList = g_list_first (hex_file->undo);
-
-	for (guint i = 0; i < g_list_length (hex_file->undo); i++)
-	{
-		struct _doc_undo *du = ((struct _doc_undo*)(undoList->data));
+#ifdef SEEK_HOLE
+    // Devices have no holes, and lseek on them only spins the disk
+    if (hex_file->sector_size == 0)
+        fd = rp_hex_file_open_source (hex_file);
 
-        g_message ("Undo list entry %i: address: %i, len: %i, type: %i ", i, du->address, du->len, du->utype);
-		
-		pos = 0;
-        locList = g_list_first (hex_file->loc);
-		
-		for (guint il = 0; il < g_list_length (hex_file->loc); il++)
-		{
-			struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
+    for (guint64 scan = 0, holes = 0; fd >= 0 && scan < size && holes < RP_HEX_FILE_MAX_HOLES; )
+    {
+        off_t   data = lseek (fd, scan, SEEK_DATA);
+        off_t   hole;
 
-			if (du->address < pos + dl->len)
-				break;
+        // ENXIO: nothing but a hole up to the end of the file
+        if (data < 0 && errno != ENXIO)
+            break;
 
-			pos += dl->len;
-			locList = g_list_next(locList);	
-		}
+        data = (data < 0) ? size : MIN ((guint64)data, size);
 
-        switch (du->utype)
+        if (data - scan >= RP_HEX_FILE_MIN_HOLE)
         {
-            case mod_insert:
-                loc_add (hex_file, du, &pos, locList);
-                break;
-            case mod_replace:
-            case mod_repback:                
-                tmp = loc_del (hex_file, du->address, du->len, &pos, locList);
-                loc_add (hex_file, du, &pos, tmp);
-                break;
-            case mod_delforw:
-            case mod_delback:
-                loc_del (hex_file, du->address, du->len, &pos, locList);
-                break;
-            default:
-                g_assert (0);
+            doc_loc dl = doc_loc_file (pos, scan - pos);
+            doc_loc zl = doc_loc_zero (scan, data - scan);
+
+            rp_piece_tree_insert (hex_file->loc, pos, &dl);
+            rp_piece_tree_insert (hex_file->loc, scan, &zl);
+            pos     = data;
+            holed   += data - scan;
+            holes++;
         }
 
-		undoList = g_list_next (undoList);
+        if ((guint64)data >= size || (hole = lseek (fd, data, SEEK_HOLE)) < 0)
+            break;
+
+        scan = hole;
     }
 
-    // Debug only, check location list length against file length
-    pos = 0;
-    locList = g_list_first (hex_file->loc);
-	
-    for (guint il = 0; il < g_list_length (hex_file->loc); il++)
-	{
-		struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-		pos += dl->len;
-		locList = g_list_next (locList);	
-	}
-    
-    g_assert (pos == hex_file->file_size);
+    if (fd >= 0)
+        close (fd);
+
+    if (holed > 0)
+        g_message ("HexFile: %s has %" G_GUINT64_FORMAT " bytes in holes", hex_file->file_name, holed);
+#endif
+
+    doc_loc dl = doc_loc_file (pos, size - pos);
+    rp_piece_tree_insert (hex_file->loc, pos, &dl);
 }
 
-void rp_hex_file_change_data (RPHexFile *hex_file, enum mod_type utype, guint32 address, 
-							guint32 len, guchar *buf, guint num_done)
+/* Modification time in microseconds, 0 if the backend doesn't know it */
+static guint64 rp_hex_file_info_get_mtime (GFileInfo *info)
 {
-    GList *undoList;
-
-	g_assert (utype == mod_insert || utype == mod_replace ||
-    		utype == mod_delforw || utype == mod_delback || 
-			utype == mod_repback);
-    g_assert (address <= hex_file->file_size);
-    g_assert (len > 0);
+    return g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+           g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+}
 
-    undoList = g_list_last (hex_file->undo);
+/* Open a document, may block on slow mounts. Only the attributes needed
+ * are queried, "*" makes some backends fetch a lot more. gzip files are
+ * shown inflated unless RP_HEX_FILE_OPEN_RAW is given.
+ */
+static RPHexFile *rp_hex_file_open (GFile *file, RPHexFileOpenFlags flags, GCancellable *cancellable, 
+                                    GError **error)
+{
+	RPHexFile	*hex_file = NULL;
+	GFileInfo	*hex_file_info = NULL;	
+    guint64     fsize = 0;
+    gboolean    bCanWrite;
+    gboolean    bRegular;
+    g_autofree gchar *path = g_file_get_path (file);
 	
-	if ((undoList != NULL && (num_done % 2) == 1 && len == 1) || (undoList != NULL && num_done > 0))
-    {
-        struct _doc_undo *du = ((struct _doc_undo*)(undoList->data));
+	hex_file_info = g_file_query_info (file, RP_HEX_FILE_OPEN_ATTRIBUTES, G_FILE_QUERY_INFO_NONE, 
+                                       cancellable, error);
 
-		g_assert (utype == du->utype);
+    if (hex_file_info == NULL)
+        return NULL;
 
-		if (utype == mod_delforw)
-		{
-            g_assert (buf == NULL);
-            g_assert (du->address == address);
-            g_assert (address + len <= hex_file->file_size);
-            du->len += len;
-        }
-        else if (utype == mod_delback)
-        {
-            g_assert (buf == NULL);
-            g_assert (du->address == address + len);
-            du->address = address;
-            du->len += len;
-        }
-        else if (utype == mod_repback)
-        {
-            g_assert (buf != NULL);
-            g_assert (du->address == address + len);
-            memmove (du->ptr + len, du->ptr, du->len);
-            memcpy (du->ptr, buf, len);
-            du->address = address;
-            du->len += len;
-        }
-        else if (du->address + du->len == address)
+    fsize       = g_file_info_get_size (hex_file_info);
+    bCanWrite   = g_file_info_get_attribute_boolean (hex_file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE);
+    bRegular    = g_file_info_get_file_type (hex_file_info) == G_FILE_TYPE_REGULAR;
+
+	hex_file = rp_hex_file_new ();
+	g_return_val_if_fail (hex_file != NULL, NULL);
+
+#ifdef __linux__
+    if (g_file_info_get_file_type (hex_file_info) == G_FILE_TYPE_SPECIAL && path != NULL)
+    {
+        if (!rp_hex_file_probe_device (path, &fsize, &hex_file->sector_size, error))
         {
-            g_assert (buf != NULL);
-            memcpy (du->ptr + du->len, buf, len);
-            du->len += len;
+            g_object_unref (hex_file_info);
+            g_object_unref (hex_file);
+            return NULL;
         }
-        else
+
+        g_message ("HexFile: block device %s, %" G_GUINT64_FORMAT " bytes in %u byte sectors", 
+                   path, fsize, hex_file->sector_size);
+    }
+#endif
+
+    hex_file->disk_size     = fsize;
+    hex_file->disk_mtime    = rp_hex_file_info_get_mtime (hex_file_info);
+
+    g_object_unref (hex_file_info);
+
+    // Read only, what is already indexed shows up right away
+    if (path != NULL && bRegular && !(flags & RP_HEX_FILE_OPEN_RAW) && rp_gz_index_is_gzip (path))
+    {
+        hex_file->gz_index = rp_gz_index_new (path, error);
+
+        if (hex_file->gz_index == NULL)
         {
-            g_assert (du->address + du->len - 1 == address);
-            memcpy (du->ptr + du->len - 1, buf, len);
-            len -= 1;
-            du->len += len;
+            g_object_unref (hex_file);
+            return NULL;
         }
+
+        if (rp_gz_index_load (hex_file->gz_index))
+            g_message ("HexFile: using the saved index of %s", path);
+
+        fsize       = rp_gz_index_get_size (hex_file->gz_index);
+        bCanWrite   = FALSE;
+        hex_file->cache = rp_block_cache_new (RP_HEX_FILE_DEFAULT_CACHE_SIZE, rp_hex_file_read_stream, hex_file);
     }
-    else
+    else if (!rp_hex_file_open_backend (hex_file, file, bRegular, fsize, error))
     {
-        g_message ("Add a new elt to undo array");
-        if (utype == mod_insert || utype == mod_replace || utype == mod_repback)
-			hex_file->undo = g_list_append (hex_file->undo, doc_undo_new (utype, address, len, buf));
-        else
-			hex_file->undo = g_list_append (hex_file->undo, doc_undo_new (utype, address, len, NULL));
+        g_object_unref (hex_file);
+        return NULL;
     }
 
-    if (utype == mod_delforw || utype == mod_delback)
-        hex_file->file_size -= len;
-    else if (utype == mod_insert)
-        hex_file->file_size += len;
-    else if (utype == mod_replace && address + len > hex_file->file_size)
-        hex_file->file_size = address + len;
-    else
-        g_assert (utype == mod_replace);
+	hex_file->file_name     = g_file_get_parse_name (file);
+	hex_file->file_size     = fsize;
+	hex_file->real_file_size = hex_file->file_size;
+    hex_file->read_only     = !bCanWrite || (flags & RP_HEX_FILE_OPEN_READ_ONLY);
 
-    g_message ("-- Start recreate loc list");
-    rp_hex_file_recreate_loc_list (hex_file);
-    g_message ("-- End recreate loc list");
+    if (path != NULL && !hex_file->read_only)
+        hex_file->journal = rp_journal_new (path);
 
-    hex_file->is_modified = TRUE;
-    g_signal_emit_by_name (G_OBJECT(hex_file), "data_changed", hex_file->is_modified);
+    rp_hex_file_insert_file (hex_file);
+
+    // The view starts drawing at the top, fetch that while we are still off
+    // the main thread
+    if (hex_file->cache != NULL && fsize > 0)
+    {
+        guchar first;
+
+        rp_block_cache_read (hex_file->cache, 0, &first, 1);
+    }
+	
+	return hex_file;
 }
 
-gboolean rp_hex_file_get_is_modified (RPHexFile *hex_file)
+RPHexFile *rp_hex_file_new_with_file (GFile *file, RPHexFileOpenFlags flags, GError **error)
 {
-    return hex_file->is_modified;
+    RPHexFile *hex_file = rp_hex_file_open (file, flags, NULL, error);
+
+    if (hex_file != NULL)
+    {
+        rp_hex_file_watch (hex_file, file);
+        rp_hex_file_start_index (hex_file);
+    }
+
+    return hex_file;
 }
 
-guint32	rp_hex_file_get_size (RPHexFile *hex_file)
+typedef struct
 {
-	return hex_file->file_size;
+    GFile               *file;
+    RPHexFileOpenFlags  flags;
+} RPOpenData;
+
+static void rp_open_data_free (RPOpenData *data)
+{
+    g_object_unref (data->file);
+    g_free (data);
 }
 
-gboolean rp_hex_file_only_overtype_changes (RPHexFile *hex_file)
+static void rp_hex_file_open_thread (GTask *task, gpointer source_object, gpointer task_data, 
+                                     GCancellable *cancellable)
 {
-    guint32 pos = 0;
-    GList	*locList;
+    RPOpenData  *data = task_data;
+    GError      *error = NULL;
+    RPHexFile   *hex_file;
 
-    locList = g_list_first (hex_file->loc);
+    hex_file = rp_hex_file_open (data->file, data->flags, cancellable, &error);
 
-    for (guint i = 0; i < g_list_length (hex_file->loc); i++)
-	{
-		struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-		
-		if (dl->location == loc_file && dl->fileaddr != pos)
-            return FALSE;
+    if (hex_file != NULL)
+        g_task_return_pointer (task, hex_file, g_object_unref);
+    else
+        g_task_return_error (task, error);
+}
 
-		pos += dl->len;
-		locList = g_list_next (locList);
-	}
+/* Open a document on a worker thread, so slow mounts don't block the
+ * main loop. The first block of the file is read before callback runs.
+ */
+void rp_hex_file_new_async (GFile *file, RPHexFileOpenFlags flags, GCancellable *cancellable,
+                            GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask       *task;
+    RPOpenData  *data;
 
-    // Make sure file length has not changed
-    if (hex_file->file_size != hex_file->real_file_size)
-        return FALSE;
+    g_return_if_fail (G_IS_FILE (file));
 
-    return TRUE;
+    // Register the type here, rp_hex_file_get_type is not thread safe
+    g_type_ensure (RP_TYPE_HEX_FILE);
+
+    data = g_new (RPOpenData, 1);
+    data->file  = g_object_ref (file);
+    data->flags = flags;
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, rp_hex_file_new_async);
+    g_task_set_task_data (task, data, (GDestroyNotify)rp_open_data_free);
+    g_task_run_in_thread (task, rp_hex_file_open_thread);
+    g_object_unref (task);
 }
 
-gboolean rp_hex_file_write_in_place (RPHexFile *hex_file)
+RPHexFile *rp_hex_file_new_finish (GAsyncResult *result, GError **error)
 {
-    guint32 pos = 0;
-    GList   *locList;
-    gint    retW = 0;
+    RPHexFile *hex_file;
 
-    FILE *fp = fopen (hex_file->file_name, "r+b");
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
 
-    if (!fp)
-        return FALSE;
+    hex_file = g_task_propagate_pointer (G_TASK (result), error);
 
-    locList = g_list_first (hex_file->loc);
-        
-    for (guint i = 0; i < g_list_length (hex_file->loc); i++)
+    // The monitor reports to the thread it was created on, so not in the worker
+    if (hex_file != NULL)
     {
-        struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-        
-        if (dl->location == loc_mem)
-        {
-            if (fseek (fp, pos, SEEK_SET) == 0)
-                retW = fwrite (dl->memaddr, 1, dl->len, fp);
-            
-            g_return_val_if_fail (retW == dl->len, FALSE);
-        }
-        else
-            g_return_val_if_fail (dl->fileaddr == pos, FALSE);
+        RPOpenData *data = g_task_get_task_data (G_TASK (result));
 
-        pos+= dl->len;
-        locList = g_list_next (locList);
-        retW = 0;
+        rp_hex_file_watch (hex_file, data->file);
+        rp_hex_file_start_index (hex_file);
     }
 
-    if (fclose (fp) != 0)
-        return FALSE;
-
-    g_list_free (hex_file->undo);
-    hex_file->undo = NULL;
-    
-    rp_hex_file_recreate_loc_list (hex_file);
-
-    return (pos == hex_file->file_size);
+    return hex_file;
 }
 
-gboolean rp_hex_file_write_data (RPHexFile *hex_file, guchar *file_name, guint32 start, guint32 end)
+gboolean rp_hex_file_is_read_only (RPHexFile *hex_file)
 {
-    const guint copy_buffer_len = 16384;
-    guint32     address = 0;
-    
-    FILE *fp = fopen (file_name, "w+b");
+    return hex_file->read_only;
+}
 
-    if (!fp)
-        return FALSE;
-    
-    guchar  *buffer = g_try_malloc0 (copy_buffer_len);
-    guint   bytesRead;
+gchar *rp_hex_file_get_file_name (RPHexFile *hex_file)
+{
+	return hex_file->file_name;
+}
+
+/* Copy document bytes described by loc. File pieces come from mapped_file
+ * if there is one, else from the block cache, or straight from the stream
+ * when cache is NULL (off the main thread).
+ */
+static gsize rp_hex_file_read_pieces (RPHexFile *hex_file, RPPieceTree *loc, GMappedFile *mapped_file,
+                                      RPBlockCache *cache, guchar *buf, gsize len, guint64 address)
+{
+	guint64 start;
+	gsize	tocopy;
+	gsize	left;
+
+	for (left = len; left > 0; left -= tocopy, buf += tocopy, address += tocopy)
+	{
+		const doc_loc *dl = rp_piece_tree_lookup (loc, address, &start);
+
+		if (dl == NULL)
+			break;
+
+		start	= address - start;
+		tocopy	= MIN (left, dl->len - start);
+
+		if (dl->location == loc_mem)
+			memcpy (buf, dl->memaddr + start, tocopy);
+		else if (dl->location == loc_zero)
+			memset (buf, 0, tocopy);
+		else if (mapped_file != NULL)
+		{
+        	g_assert (dl->location == loc_file);
+
+			// The file may have been truncated by someone else, whatever
+			// is gone reads as zeros
+			guint64 src		= dl->fileaddr + start;
+			gsize	map_len	= g_mapped_file_get_length (mapped_file);
+			gsize	avail	= (src < map_len) ? MIN (tocopy, map_len - src) : 0;
+
+			memcpy (buf, g_mapped_file_get_contents (mapped_file) + src, avail);
+			memset (buf + avail, 0, tocopy - avail);
+		}
+		else
+		{
+        	g_assert (dl->location == loc_file);
+
+			gssize actual;
+			
+			if (cache != NULL)
+				actual = rp_block_cache_read (cache, dl->fileaddr + start, buf, tocopy);
+			else
+				actual = MAX (rp_hex_file_read_stream (hex_file, dl->fileaddr + start, buf, tocopy), 0);
+			
+			if ((gsize)actual != tocopy)
+				memset (buf + actual, 0, tocopy - actual);
+		}
+    }
+
+    // Return the actual number of bytes written to buf
+    return len - left;
+}
+
+gsize rp_hex_file_get_data (RPHexFile *hex_file, guchar *buf, gsize len, guint64 address)
+{
+	return rp_hex_file_read_pieces (hex_file, hex_file->loc, hex_file->mapped_file, hex_file->cache,
+	                                buf, len, address);
+}
+
+struct _RPHexSnapshot
+{
+    gint        ref_count;
+    RPHexFile   *hex_file;      // Streams and the gzip index are read through it
+    RPPieceTree *loc;
+    RPAddBuffer *add_buffer;    // Keeps the typed bytes alive past a save
+    GMappedFile *mapped_file;   // The mapping the file pieces refer to
+};
+
+/* Takes O(1) time and memory: the piece tree is shared until the document
+ * changes, and then only the changed path is copied. File pieces of a
+ * mapped file keep reading the file that was mapped, even once a save
+ * replaced it. Bytes rewritten in place by a save, or pieces of a stream,
+ * read as the file is now.
+ */
+RPHexSnapshot *rp_hex_file_snapshot (RPHexFile *hex_file)
+{
+    RPHexSnapshot *snapshot = g_new0 (RPHexSnapshot, 1);
+
+    snapshot->ref_count     = 1;
+    snapshot->hex_file      = g_object_ref (hex_file);
+    snapshot->loc           = rp_piece_tree_copy (hex_file->loc);
+    snapshot->add_buffer    = rp_add_buffer_ref (hex_file->add_buffer);
+
+    // The add buffer bytes it sees must not be patched by a second nibble
+    hex_file->newest_shared = TRUE;
+
+    if (hex_file->mapped_file != NULL)
+        snapshot->mapped_file = g_mapped_file_ref (hex_file->mapped_file);
+
+    return snapshot;
+}
+
+RPHexSnapshot *rp_hex_snapshot_ref (RPHexSnapshot *snapshot)
+{
+    g_atomic_int_inc (&snapshot->ref_count);
+
+    return snapshot;
+}
+
+/* The snapshot holds a reference on its document, drop the last one on
+ * the main thread.
+ */
+void rp_hex_snapshot_unref (RPHexSnapshot *snapshot)
+{
+    if (snapshot == NULL || !g_atomic_int_dec_and_test (&snapshot->ref_count))
+        return;
+
+    rp_piece_tree_free (snapshot->loc);
+    rp_add_buffer_unref (snapshot->add_buffer);
+    g_clear_pointer (&snapshot->mapped_file, g_mapped_file_unref);
+    g_object_unref (snapshot->hex_file);
+    g_free (snapshot);
+}
+
+guint64 rp_hex_snapshot_get_size (RPHexSnapshot *snapshot)
+{
+    return rp_piece_tree_get_size (snapshot->loc);
+}
+
+/* Like rp_hex_file_get_data but safe from any thread, file pieces of a
+ * stream bypass the block cache.
+ */
+gsize rp_hex_snapshot_get_data (RPHexSnapshot *snapshot, guchar *buf, gsize len, guint64 address)
+{
+    return rp_hex_file_read_pieces (snapshot->hex_file, snapshot->loc, snapshot->mapped_file, NULL,
+                                    buf, len, address);
+}
+
+/* The piece holding address, for readers that scan a snapshot without
+ * copying it. [*start, *start + *len) receives the part of the document
+ * it covers and *hole whether it reads as zeros. Returns its first byte
+ * for typed bytes and pieces of a mapped file, else NULL.
+ */
+const guchar *rp_hex_snapshot_peek (RPHexSnapshot *snapshot, guint64 address, guint64 *start,
+                                    guint64 *len, gboolean *hole)
+{
+    const doc_loc *dl = rp_piece_tree_lookup (snapshot->loc, address, start);
+
+    if (dl == NULL)
+        return NULL;
+
+    *len    = dl->len;
+    *hole   = (dl->location == loc_zero);
+
+    if (dl->location == loc_mem)
+        return dl->memaddr;
+
+    // Whatever a truncation took away has to be read as zeros
+    if (dl->location == loc_file && snapshot->mapped_file != NULL &&
+        dl->fileaddr + dl->len <= g_mapped_file_get_length (snapshot->mapped_file))
+        return (const guchar *)g_mapped_file_get_contents (snapshot->mapped_file) + dl->fileaddr;
+
+    return NULL;
+}
+
+/* Two snapshot pieces hold the same bytes without reading them if they
+ * come from the same place. Holes are zero wherever they are.
+ */
+static gboolean rp_hex_snapshot_same_source (RPHexSnapshot *a, const doc_loc *da, guint64 ofs_a,
+                                             RPHexSnapshot *b, const doc_loc *db, guint64 ofs_b)
+{
+    if (da->location != db->location)
+        return FALSE;
+
+    switch (da->location)
+    {
+    case loc_zero:
+        return TRUE;
+
+    case loc_mem:
+        return da->memaddr + ofs_a == db->memaddr + ofs_b;
+
+    default:
+        return a->hex_file == b->hex_file && a->mapped_file == b->mapped_file &&
+               da->fileaddr + ofs_a == db->fileaddr + ofs_b;
+    }
+}
+
+/* Finds the first offset at or after 'from' where the two snapshots differ,
+ * FALSE if they are equal from there on. Runs both took from the same
+ * place are skipped without reading them, so comparing two versions of a
+ * huge file only reads what was edited in between.
+ */
+gboolean rp_hex_snapshot_next_difference (RPHexSnapshot *a, RPHexSnapshot *b, guint64 from, 
+                                          guint64 *address)
+{
+    guint64             end = MIN (rp_hex_snapshot_get_size (a), rp_hex_snapshot_get_size (b));
+    g_autofree guchar   *abuf = NULL;
+    g_autofree guchar   *bbuf = NULL;
+
+    while (from < end)
+    {
+        guint64         sa, sb, run;
+        const doc_loc   *da = rp_piece_tree_lookup (a->loc, from, &sa);
+        const doc_loc   *db = rp_piece_tree_lookup (b->loc, from, &sb);
+
+        run = MIN (MIN (sa + da->len, sb + db->len), end) - from;
+
+        if (!rp_hex_snapshot_same_source (a, da, from - sa, b, db, from - sb))
+        {
+            if (abuf == NULL)
+            {
+                abuf = g_malloc (RP_BLOCK_CACHE_BLOCK_SIZE);
+                bbuf = g_malloc (RP_BLOCK_CACHE_BLOCK_SIZE);
+            }
+
+            for (guint64 done = 0, chunk; done < run; done += chunk)
+            {
+                chunk = MIN (run - done, RP_BLOCK_CACHE_BLOCK_SIZE);
+
+                rp_hex_snapshot_get_data (a, abuf, chunk, from + done);
+                rp_hex_snapshot_get_data (b, bbuf, chunk, from + done);
+
+                for (gsize i = 0; i < chunk; i++)
+                {
+                    if (abuf[i] != bbuf[i])
+                    {
+                        *address = from + done + i;
+                        return TRUE;
+                    }
+                }
+            }
+        }
+
+        from += run;
+    }
+
+    // One is longer, the rest of it differs
+    if (from < MAX (rp_hex_snapshot_get_size (a), rp_hex_snapshot_get_size (b)))
+    {
+        *address = from;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Apply a single modification directly to the current piece tree. mem
+ * holds the new bytes inside the add buffer. The pieces it takes out of
+ * the document are added to du->removed, in front if the record grows
+ * backwards.
+ */
+static void rp_hex_file_apply_change (RPHexFile *hex_file, doc_undo *du, enum mod_type utype, 
+									guint64 address, guint64 len, guchar *mem)
+{
+    guint64 size = rp_piece_tree_get_size (hex_file->loc);
+    GArray  *removed = g_array_new (FALSE, FALSE, sizeof (doc_loc));
+    doc_loc dl;
+
+    if (utype == mod_delforw || utype == mod_delback)
+        rp_piece_tree_delete (hex_file->loc, address, len, removed);
+    else
+    {
+        if (utype == mod_replace || utype == mod_repback)
+            rp_piece_tree_delete (hex_file->loc, address, MIN (len, size - address), removed);
+
+        dl = doc_loc_mem (mem, len);
+        rp_piece_tree_insert (hex_file->loc, address, &dl);
+    }
+
+    if (utype == mod_delback || utype == mod_repback)
+        g_array_prepend_vals (du->removed, removed->data, removed->len);
+    else
+        g_array_append_vals (du->removed, removed->data, removed->len);
+
+    g_array_free (removed, TRUE);
+}
+
+/* Take a modification back out of the piece tree */
+static void rp_hex_file_revert_change (RPHexFile *hex_file, doc_undo *du)
+{
+    guint64 pos = du->address;
+
+    if (du->ptr != NULL)
+        rp_piece_tree_delete (hex_file->loc, du->address, du->len, NULL);
+
+    for (guint i = 0; i < du->removed->len; i++)
+    {
+        const doc_loc *dl = &g_array_index (du->removed, doc_loc, i);
+
+        rp_piece_tree_insert (hex_file->loc, pos, dl);
+        pos += dl->len;
+    }
+}
+
+/* Put an undone modification back into the piece tree */
+static void rp_hex_file_reapply_change (RPHexFile *hex_file, doc_undo *du)
+{
+    guint64 removed_len = 0;
+    doc_loc dl;
+
+    for (guint i = 0; i < du->removed->len; i++)
+        removed_len += g_array_index (du->removed, doc_loc, i).len;
+
+    rp_piece_tree_delete (hex_file->loc, du->address, removed_len, NULL);
+
+    if (du->ptr != NULL)
+    {
+        dl = doc_loc_mem (du->ptr, du->len);
+        rp_piece_tree_insert (hex_file->loc, du->address, &dl);
+    }
+}
+
+static void rp_hex_file_changed (RPHexFile *hex_file)
+{
+    hex_file->file_size     = rp_piece_tree_get_size (hex_file->loc);
+    hex_file->is_modified   = hex_file->save_point_lost || 
+                              g_queue_peek_tail (hex_file->undo) != hex_file->save_point;
+
+    // A replay reports once, at the end
+    if (!hex_file->replaying)
+        g_signal_emit_by_name (G_OBJECT(hex_file), "data_changed", hex_file->is_modified);
+}
+
+static void rp_hex_file_clear_redo (RPHexFile *hex_file)
+{
+    doc_undo *du;
+
+    while ((du = g_queue_pop_tail (hex_file->redo)) != NULL)
+    {
+        if (du == hex_file->save_point)
+            hex_file->save_point_lost = TRUE;
+
+        hex_file->undo_bytes -= doc_undo_size (du);
+        hex_file->add_dead += du->ptr ? du->len : 0;
+        doc_undo_free (du);
+    }
+}
+
+typedef struct
+{
+    const guchar	*start;
+    const guchar	*end;
+    guchar			*copy;		// Where the span went in the new buffer
+} RPAddSpan;
+
+static void rp_add_spans_add (GArray *spans, const guchar *mem, guint64 len)
+{
+    RPAddSpan span = { mem, mem + len, NULL };
+
+    if (mem != NULL && len > 0)
+        g_array_append_val (spans, span);
+}
+
+static gint rp_add_spans_compare (gconstpointer a, gconstpointer b)
+{
+    const guchar *sa = ((const RPAddSpan *)a)->start;
+    const guchar *sb = ((const RPAddSpan *)b)->start;
+
+    return (sa < sb) ? -1 : (sa > sb);
+}
+
+/* Where mem, which lies in one of the merged spans, went */
+static guchar *rp_add_spans_map (GArray *spans, const guchar *mem)
+{
+    guint lo = 0;
+    guint hi = spans->len;
+
+    while (hi - lo > 1)
+    {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index (spans, RPAddSpan, mid).start <= mem)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return g_array_index (spans, RPAddSpan, lo).copy + (mem - g_array_index (spans, RPAddSpan, lo).start);
+}
+
+static void rp_add_spans_map_locs (GArray *spans, GArray *locs)
+{
+    for (guint i = 0; i < locs->len; i++)
+    {
+        doc_loc *dl = &g_array_index (locs, doc_loc, i);
+
+        if (dl->location == loc_mem)
+            dl->memaddr = rp_add_spans_map (spans, dl->memaddr);
+    }
+}
+
+/* Move the typed bytes still referred to into a fresh add buffer and drop
+ * the old one, snapshots keep reading it through their own reference.
+ * Overlapping and touching slices are copied as one, so pieces and records
+ * that shared bytes still do and the newest record can keep growing. The
+ * pieces are taken out of the tree and put back, which leaves the nodes
+ * snapshots share untouched.
+ */
+static void rp_hex_file_compact_add_buffer (RPHexFile *hex_file)
+{
+    g_autoptr(GArray)	pieces = g_array_new (FALSE, FALSE, sizeof (doc_loc));
+    g_autoptr(GArray)	spans = g_array_new (FALSE, FALSE, sizeof (RPAddSpan));
+    GQueue				*queues[] = { hex_file->undo, hex_file->redo };
+    RPAddBuffer			*add_buffer = rp_add_buffer_new ();
+    gsize				old_size = rp_add_buffer_get_size (hex_file->add_buffer);
+    guint64				pos = 0;
+    guint				merged = 0;
+
+    rp_piece_tree_delete (hex_file->loc, 0, rp_piece_tree_get_size (hex_file->loc), pieces);
+
+    for (guint i = 0; i < pieces->len; i++)
+    {
+        doc_loc *dl = &g_array_index (pieces, doc_loc, i);
+
+        if (dl->location == loc_mem)
+            rp_add_spans_add (spans, dl->memaddr, dl->len);
+    }
+
+    for (guint q = 0; q < G_N_ELEMENTS (queues); q++)
+    {
+        for (GList *link = queues[q]->head; link != NULL; link = link->next)
+        {
+            doc_undo *du = link->data;
+
+            rp_add_spans_add (spans, du->ptr, du->len);
+
+            for (guint i = 0; i < du->removed->len; i++)
+            {
+                doc_loc *dl = &g_array_index (du->removed, doc_loc, i);
+
+                if (dl->location == loc_mem)
+                    rp_add_spans_add (spans, dl->memaddr, dl->len);
+            }
+        }
+    }
+
+    g_array_sort (spans, rp_add_spans_compare);
+
+    for (guint i = 0; i < spans->len; i++)
+    {
+        RPAddSpan *span = &g_array_index (spans, RPAddSpan, i);
+        RPAddSpan *last = &g_array_index (spans, RPAddSpan, MAX (merged, 1) - 1);
+
+        if (merged > 0 && span->start <= last->end)
+            last->end = MAX (last->end, span->end);
+        else
+            g_array_index (spans, RPAddSpan, merged++) = *span;
+    }
+
+    g_array_set_size (spans, merged);
+
+    for (guint i = 0; i < spans->len; i++)
+    {
+        RPAddSpan *span = &g_array_index (spans, RPAddSpan, i);
+
+        span->copy = rp_add_buffer_append (add_buffer, span->start, span->end - span->start);
+    }
+
+    rp_add_spans_map_locs (spans, pieces);
+
+    for (guint i = 0; i < pieces->len; i++)
+    {
+        rp_piece_tree_insert (hex_file->loc, pos, &g_array_index (pieces, doc_loc, i));
+        pos += g_array_index (pieces, doc_loc, i).len;
+    }
+
+    for (guint q = 0; q < G_N_ELEMENTS (queues); q++)
+    {
+        for (GList *link = queues[q]->head; link != NULL; link = link->next)
+        {
+            doc_undo *du = link->data;
+
+            if (du->ptr != NULL && du->len > 0)
+                du->ptr = rp_add_spans_map (spans, du->ptr);
+
+            rp_add_spans_map_locs (spans, du->removed);
+        }
+    }
+
+    g_message ("HexFile: add buffer compacted from %" G_GSIZE_FORMAT " to %" G_GSIZE_FORMAT " bytes",
+               old_size, rp_add_buffer_get_size (add_buffer));
+
+    rp_add_buffer_unref (hex_file->add_buffer);
+    hex_file->add_buffer	= add_buffer;
+    hex_file->add_dead		= 0;
+}
+
+/* Fold the oldest groups into the base state until the history fits into
+ * undo_limit again. The newest group is always kept. Once the records
+ * dropped held about half the add buffer it is compacted, so the memory
+ * an editing session takes stays bounded without saving.
+ */
+static void rp_hex_file_trim_undo (RPHexFile *hex_file)
+{
+    doc_undo    *newest = g_queue_peek_tail (hex_file->undo);
+    doc_undo    *du;
+    guint       group;
+
+    while (hex_file->undo_bytes > hex_file->undo_limit)
+    {
+        du = g_queue_peek_head (hex_file->undo);
+
+        if (du == NULL || du->group == newest->group)
+            break;
+
+        for (group = du->group; du != NULL && du->group == group; du = g_queue_peek_head (hex_file->undo))
+        {
+            g_queue_pop_head (hex_file->undo);
+
+            // The saved state can't be reached any more once older records go
+            if (hex_file->save_point == NULL)
+                hex_file->save_point_lost = TRUE;
+            else if (hex_file->save_point == du)
+                hex_file->save_point = NULL;
+
+            hex_file->undo_bytes -= doc_undo_size (du);
+            hex_file->add_dead += du->ptr ? du->len : 0;
+            doc_undo_free (du);
+        }
+    }
+
+    // A background save is reading the pieces
+    if (!hex_file->saving && hex_file->add_dead >= RP_HEX_FILE_COMPACT_MIN &&
+        hex_file->add_dead >= rp_add_buffer_get_size (hex_file->add_buffer) / 2)
+        rp_hex_file_compact_add_buffer (hex_file);
+}
+
+static void rp_hex_file_clear_undo (RPHexFile *hex_file)
+{
+    g_queue_clear_full (hex_file->undo, (GDestroyNotify)doc_undo_free);
+    g_queue_clear_full (hex_file->redo, (GDestroyNotify)doc_undo_free);
+
+    hex_file->undo_bytes        = 0;
+    hex_file->can_coalesce      = FALSE;
+    hex_file->save_point        = NULL;
+    hex_file->save_point_lost   = FALSE;
+}
+
+static void rp_hex_file_journal (RPHexFile *hex_file, gchar op, guint64 address, guint64 len, guint count,
+                                 const guchar *buf)
+{
+    if (hex_file->journal != NULL && !hex_file->replaying)
+        rp_journal_record (hex_file->journal, op, address, len, count, buf);
+}
+
+void rp_hex_file_change_data (RPHexFile *hex_file, enum mod_type utype, guint64 address, 
+							guint64 len, guchar *buf, guint num_done)
+{
+    doc_undo    *du = NULL;
+    guchar      *mem = NULL;        // New bytes in the add buffer
+    gboolean    overwrite = FALSE;
+
+    g_return_if_fail (!hex_file->saving);
+
+	g_assert (utype == mod_insert || utype == mod_replace ||
+    		utype == mod_delforw || utype == mod_delback || 
+			utype == mod_repback);
+    g_assert (address <= hex_file->file_size);
+    g_assert (len > 0);
+
+    rp_hex_file_journal (hex_file, utype, address, len, num_done, buf);
+
+    // Keystrokes extend the newest record unless undo/redo or a save came between
+    if (num_done > 0 && hex_file->can_coalesce)
+        du = g_queue_peek_tail (hex_file->undo);
+	
+    if (du != NULL)
+    {
+		g_assert (utype == du->utype);
+
+        hex_file->undo_bytes -= doc_undo_size (du);
+
+		if (utype == mod_delforw)
+		{
+            g_assert (buf == NULL);
+            g_assert (du->address == address);
+            g_assert (address + len <= hex_file->file_size);
+            du->len += len;
+        }
+        else if (utype == mod_delback)
+        {
+            g_assert (buf == NULL);
+            g_assert (du->address == address + len);
+            du->address = address;
+            du->len += len;
+        }
+        else if (utype == mod_repback)
+        {
+            g_assert (buf != NULL);
+            g_assert (du->address == address + len);
+            // New bytes go in front, so the record needs a fresh slice
+            mem = rp_add_buffer_append (hex_file->add_buffer, NULL, len + du->len);
+            memcpy (mem, buf, len);
+            memcpy (mem + len, du->ptr, du->len);
+            du->ptr = mem;
+            hex_file->add_dead += du->len;
+            du->address = address;
+            du->len += len;
+        }
+        else if (du->address + du->len == address)
+        {
+            g_assert (buf != NULL);
+
+            // Usually the record is the newest slice and simply grows
+            if (!rp_add_buffer_extend (hex_file->add_buffer, du->ptr + du->len, buf, len))
+            {
+                mem = rp_add_buffer_append (hex_file->add_buffer, NULL, du->len + len);
+                memcpy (mem, du->ptr, du->len);
+                memcpy (mem + du->len, buf, len);
+                du->ptr = mem;
+                hex_file->add_dead += du->len;
+            }
+
+            mem = du->ptr + du->len;
+            du->len += len;
+        }
+        else
+        {
+            guint64 start;
+
+            // The second nibble completes the byte the first one appended,
+            // that byte is referenced by no other piece or record
+            g_assert (du->address + du->len - 1 == address);
+            g_assert (rp_piece_tree_lookup (hex_file->loc, address, &start)->memaddr + (address - start) == 
+                      du->ptr + du->len - 1);
+
+            // unless a snapshot was taken in between, then the record moves
+            // to a copy and the snapshot keeps the bytes it has
+            if (hex_file->newest_shared)
+            {
+                doc_loc piece;
+
+                mem = rp_add_buffer_append (hex_file->add_buffer, du->ptr, du->len);
+                piece = doc_loc_mem (mem, du->len);
+                rp_piece_tree_delete (hex_file->loc, du->address, du->len, NULL);
+                rp_piece_tree_insert (hex_file->loc, du->address, &piece);
+                hex_file->add_dead += du->len;
+                du->ptr = mem;
+            }
+
+            memcpy (du->ptr + du->len - 1, buf, len);
+            len -= 1;
+            du->len += len;
+            overwrite = TRUE;
+        }
+    }
+    else
+    {
+        rp_hex_file_clear_redo (hex_file);
+
+        if (utype == mod_insert || utype == mod_replace || utype == mod_repback)
+            mem = rp_add_buffer_append (hex_file->add_buffer, buf, len);
+
+        du = doc_undo_new (utype, address, len, mem);
+
+        // Outside of a user action every record is a group of its own
+        if (hex_file->user_action == 0)
+            hex_file->undo_group++;
+
+        du->group = hex_file->undo_group;
+        g_queue_push_tail (hex_file->undo, du);
+    }
+
+    // The second nibble of a byte was patched into the add buffer already
+    if (!overwrite)
+        rp_hex_file_apply_change (hex_file, du, utype, address, len, mem);
+
+    hex_file->undo_bytes += doc_undo_size (du);
+    hex_file->can_coalesce = TRUE;
+    hex_file->newest_shared = FALSE;
+    rp_hex_file_trim_undo (hex_file);
+
+    rp_hex_file_changed (hex_file);
+}
+
+/* Modifications between begin and end are undone in a single step, calls
+ * may be nested.
+ */
+void rp_hex_file_begin_user_action (RPHexFile *hex_file)
+{
+    rp_hex_file_journal (hex_file, journal_begin, 0, 0, 0, NULL);
+
+    if (hex_file->user_action++ == 0)
+        hex_file->undo_group++;
+}
+
+void rp_hex_file_end_user_action (RPHexFile *hex_file)
+{
+    g_return_if_fail (hex_file->user_action > 0);
+
+    rp_hex_file_journal (hex_file, journal_end, 0, 0, 0, NULL);
+    hex_file->user_action--;
+}
+
+gboolean rp_hex_file_can_undo (RPHexFile *hex_file)
+{
+    return !hex_file->saving && !g_queue_is_empty (hex_file->undo);
+}
+
+gboolean rp_hex_file_can_redo (RPHexFile *hex_file)
+{
+    return !hex_file->saving && !g_queue_is_empty (hex_file->redo);
+}
+
+/* Undo the newest group of modifications. address receives the start of
+ * the first modification of the group.
+ */
+gboolean rp_hex_file_undo (RPHexFile *hex_file, guint64 *address)
+{
+    doc_undo    *du = g_queue_peek_tail (hex_file->undo);
+    guint       group;
+
+    if (du == NULL || hex_file->saving)
+        return FALSE;
+
+    rp_hex_file_journal (hex_file, journal_undo, 0, 0, 0, NULL);
+
+    for (group = du->group; du != NULL && du->group == group; du = g_queue_peek_tail (hex_file->undo))
+    {
+        g_queue_pop_tail (hex_file->undo);
+        rp_hex_file_revert_change (hex_file, du);
+        g_queue_push_tail (hex_file->redo, du);
+
+        if (address)
+            *address = du->address;
+    }
+
+    hex_file->can_coalesce = FALSE;
+    rp_hex_file_changed (hex_file);
+
+    return TRUE;
+}
+
+/* Redo the group undone last. address receives the start of the last
+ * modification of the group.
+ */
+gboolean rp_hex_file_redo (RPHexFile *hex_file, guint64 *address)
+{
+    doc_undo    *du = g_queue_peek_tail (hex_file->redo);
+    guint       group;
+
+    if (du == NULL || hex_file->saving)
+        return FALSE;
+
+    rp_hex_file_journal (hex_file, journal_redo, 0, 0, 0, NULL);
+
+    for (group = du->group; du != NULL && du->group == group; du = g_queue_peek_tail (hex_file->redo))
+    {
+        g_queue_pop_tail (hex_file->redo);
+        rp_hex_file_reapply_change (hex_file, du);
+        g_queue_push_tail (hex_file->undo, du);
+
+        if (address)
+            *address = du->address;
+    }
+
+    hex_file->can_coalesce = FALSE;
+    rp_hex_file_changed (hex_file);
+
+    return TRUE;
+}
+
+/* How hard an in-place save pushes the data to the disk */
+void rp_hex_file_set_sync_mode (RPHexFile *hex_file, RPHexFileSync sync_mode)
+{
+    hex_file->sync_mode = sync_mode;
+}
+
+/* Bytes of undo history to keep, see doc_undo_size */
+void rp_hex_file_set_undo_limit (RPHexFile *hex_file, gsize limit)
+{
+    hex_file->undo_limit = limit;
+    rp_hex_file_trim_undo (hex_file);
+}
+
+gboolean rp_hex_file_get_is_modified (RPHexFile *hex_file)
+{
+    return hex_file->is_modified;
+}
+
+guint64	rp_hex_file_get_size (RPHexFile *hex_file)
+{
+	return hex_file->file_size;
+}
+
+/* Memory budget for blocks read through GIO, mapped files don't use it */
+void rp_hex_file_set_cache_size (RPHexFile *hex_file, gsize size)
+{
+    if (hex_file->cache != NULL)
+        rp_block_cache_set_budget (hex_file->cache, size);
+}
+
+void rp_hex_file_get_cache_stats (RPHexFile *hex_file, guint64 *hits, guint64 *misses)
+{
+    if (hits)
+        *hits = 0;
+
+    if (misses)
+        *misses = 0;
+
+    if (hex_file->cache != NULL)
+        rp_block_cache_get_stats (hex_file->cache, hits, misses);
+}
+
+typedef struct
+{
+    RPHexFile   *hex_file;
+    guint64     offset;
+    gint        gen;            // prefetch_gen when the read was queued
+    guchar      *data;
+    gssize      len;
+} RPPrefetch;
+
+/* Back on the main thread, hand the block to the cache unless it was
+ * cancelled or the file changed meanwhile.
+ */
+static gboolean rp_hex_file_prefetch_done (gpointer user_data)
+{
+    RPPrefetch  *pf = user_data;
+    RPHexFile   *hex_file = pf->hex_file;
+
+    if (pf->len > 0 && hex_file->cache != NULL && pf->gen == g_atomic_int_get (&hex_file->prefetch_gen))
+        rp_block_cache_insert (hex_file->cache, pf->offset, pf->data, pf->len);
+
+    g_free (pf->data);
+    g_free (pf);
+    g_object_unref (hex_file);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_hex_file_prefetch_thread (gpointer data, gpointer user_data)
+{
+    RPPrefetch  *pf = data;
+    RPHexFile   *hex_file = pf->hex_file;
+
+    // Skip reads the user scrolled away from
+    if (pf->gen == g_atomic_int_get (&hex_file->prefetch_gen))
+    {
+        pf->data    = g_malloc (RP_BLOCK_CACHE_BLOCK_SIZE);
+        pf->len     = rp_hex_file_read_stream (hex_file, pf->offset, pf->data, RP_BLOCK_CACHE_BLOCK_SIZE);
+    }
+
+    // Even a skipped read goes back, the last reference must not be dropped here
+    g_main_context_invoke_full (hex_file->prefetch_context, G_PRIORITY_DEFAULT, rp_hex_file_prefetch_done,
+                                pf, NULL);
+}
+
+static void rp_hex_file_prefetch_file (RPHexFile *hex_file, guint64 from, guint64 to)
+{
+    static gsize page_size = 0;
+
+    if (hex_file->map_data != NULL)
+    {
+        gsize map_len = g_mapped_file_get_length (hex_file->mapped_file);
+
+        if (page_size == 0)
+            page_size = sysconf (_SC_PAGESIZE);
+
+        to = MIN (to, map_len);
+
+        if (from >= to)
+            return;
+
+        // Starts read-ahead in the kernel, the page faults later find the data
+        from -= from % page_size;
+        posix_madvise ((gpointer)(hex_file->map_data + from), to - from, POSIX_MADV_WILLNEED);
+        hex_file->prefetch_requested++;
+        return;
+    }
+
+    if (hex_file->cache == NULL)
+        return;
+
+    for (guint64 block = from - from % RP_BLOCK_CACHE_BLOCK_SIZE; block < to; block += RP_BLOCK_CACHE_BLOCK_SIZE)
+    {
+        RPPrefetch *pf;
+
+        if (block == hex_file->prefetch_last || rp_block_cache_contains (hex_file->cache, block))
+            continue;
+
+        // A single thread keeps the reads in the order they were asked for
+        if (hex_file->prefetch_pool == NULL)
+        {
+            hex_file->prefetch_context  = g_main_context_ref_thread_default ();
+            hex_file->prefetch_pool     = g_thread_pool_new (rp_hex_file_prefetch_thread, NULL, 1, FALSE, NULL);
+        }
+
+        pf = g_new0 (RPPrefetch, 1);
+        pf->hex_file    = g_object_ref (hex_file);
+        pf->offset      = block;
+        pf->gen         = g_atomic_int_get (&hex_file->prefetch_gen);
+
+        g_thread_pool_push (hex_file->prefetch_pool, pf, NULL);
+
+        hex_file->prefetch_last = block;
+        hex_file->prefetch_requested++;
+    }
+}
+
+/* The document range [address, address + len) is likely to be drawn
+ * soon. Mapped files are advised to the kernel, blocks missing from the
+ * cache are read on a worker thread and added when done.
+ */
+void rp_hex_file_prefetch (RPHexFile *hex_file, guint64 address, guint64 len)
+{
+    const doc_loc	*dl;
+    guint64			start;
+    guint64			end = address + len;
+
+    for (; address < end && (dl = rp_piece_tree_lookup (hex_file->loc, address, &start)) != NULL; 
+         address = start + dl->len)
+    {
+        if (dl->location != loc_file)
+            continue;
+
+        rp_hex_file_prefetch_file (hex_file, dl->fileaddr + (address - start), 
+                                   dl->fileaddr + MIN (end - start, dl->len));
+    }
+}
+
+/* Length of the hole starting at address, 0 if address holds data. Scans
+ * step over holes with this instead of reading zeros.
+ */
+guint64 rp_hex_file_get_hole (RPHexFile *hex_file, guint64 address)
+{
+    const doc_loc	*dl;
+    guint64			start;
+    guint64			pos = address;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, &start)) != NULL && dl->location == loc_zero; 
+         pos = start + dl->len);
+
+    return pos - address;
+}
+
+/* Start of the next data extent behind the one address is in, past the
+ * hole in between. FALSE if only holes follow.
+ */
+gboolean rp_hex_file_next_data (RPHexFile *hex_file, guint64 address, guint64 *data_start)
+{
+    const doc_loc	*dl;
+    guint64			pos = address;
+    gboolean		bHole = FALSE;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, &pos)) != NULL; pos += dl->len)
+    {
+        if (dl->location == loc_zero)
+            bHole = TRUE;
+        else if (bHole)
+        {
+            *data_start = pos;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Start of the closest data extent before address. FALSE if there is
+ * only a hole in front of it.
+ */
+gboolean rp_hex_file_prev_data (RPHexFile *hex_file, guint64 address, guint64 *data_start)
+{
+    const doc_loc	*dl;
+    guint64			pos = address;
+    guint64			start;
+
+    for (; pos > 0 && (dl = rp_piece_tree_lookup (hex_file->loc, pos - 1, &start)) != NULL; pos = start)
+    {
+        const doc_loc *prev;
+
+        if (dl->location == loc_zero)
+            continue;
+
+        prev = (start > 0) ? rp_piece_tree_lookup (hex_file->loc, start - 1, NULL) : NULL;
+
+        if (prev == NULL || prev->location == loc_zero)
+        {
+            *data_start = start;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Drop prefetch reads that haven't started yet */
+void rp_hex_file_cancel_prefetch (RPHexFile *hex_file)
+{
+    g_atomic_int_inc (&hex_file->prefetch_gen);
+    hex_file->prefetch_last = G_MAXUINT64;
+}
+
+/* requested counts blocks queued or ranges advised to the kernel, used and
+ * wasted how many prefetched blocks were read or evicted unread. The last
+ * two are only known for files read through the block cache.
+ */
+void rp_hex_file_get_prefetch_stats (RPHexFile *hex_file, guint64 *requested, guint64 *used, guint64 *wasted)
+{
+    if (requested)
+        *requested = hex_file->prefetch_requested;
+
+    if (used)
+        *used = 0;
+
+    if (wasted)
+        *wasted = 0;
+
+    if (hex_file->cache != NULL)
+        rp_block_cache_get_prefetch_stats (hex_file->cache, NULL, used, wasted);
+}
+
+/* The file holds the document now, start over from a single piece */
+static void rp_hex_file_reset_pieces (RPHexFile *hex_file)
+{
+    rp_hex_file_clear_undo (hex_file);
+    rp_piece_tree_clear (hex_file->loc);
+    rp_hex_file_insert_file (hex_file);
+
+    hex_file->real_file_size    = hex_file->file_size;
+    hex_file->is_modified       = FALSE;
+
+    // The file has what the journal held, a new one goes with the new file
+    if (hex_file->journal != NULL)
+    {
+        g_autoptr(GFile)    file = g_file_parse_name (hex_file->file_name);
+        g_autofree gchar    *path = g_file_get_path (file);
+
+        rp_journal_discard (hex_file->journal);
+        rp_journal_free (hex_file->journal);
+        hex_file->journal = rp_journal_new (path);
+    }
+
+    // Nothing in the document refers to the typed bytes any more, snapshots
+    // still reading them hold a reference of their own
+    rp_add_buffer_unref (hex_file->add_buffer);
+    hex_file->add_buffer    = rp_add_buffer_new ();
+    hex_file->add_dead      = 0;
+}
+
+/* Highest file offset the document still refers to */
+static guint64 rp_hex_file_get_file_extent (RPHexFile *hex_file)
+{
+    const doc_loc	*dl;
+    guint64			pos = 0;
+    guint64			extent = 0;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, NULL)) != NULL; pos += dl->len)
+    {
+        if (dl->location != loc_mem)
+            extent = MAX (extent, dl->fileaddr + dl->len);
+    }
+
+    return extent;
+}
+
+/* Span of the document showing file bytes [start, end), FALSE if none of
+ * them is part of the document.
+ */
+static gboolean rp_hex_file_file_to_doc_range (RPHexFile *hex_file, guint64 start, guint64 end,
+                                               guint64 *doc_start, guint64 *doc_end)
+{
+    const doc_loc	*dl;
+    guint64			pos = 0;
+
+    *doc_start	= G_MAXUINT64;
+    *doc_end	= 0;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, NULL)) != NULL; pos += dl->len)
+    {
+        if (dl->location == loc_mem || dl->fileaddr >= end || dl->fileaddr + dl->len <= start)
+            continue;
+
+        *doc_start	= MIN (*doc_start, pos + MAX (start, dl->fileaddr) - dl->fileaddr);
+        *doc_end	= MAX (*doc_end, pos + MIN (end, dl->fileaddr + dl->len) - dl->fileaddr);
+    }
+
+    return *doc_end > *doc_start;
+}
+
+static gboolean rp_hex_file_query_disk (RPHexFile *hex_file, GFile *file, guint64 *size, guint64 *mtime)
+{
+    g_autoptr(GFileInfo) info = NULL;
+
+    info = g_file_query_info (file, RP_HEX_FILE_DISK_ATTRIBUTES, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    if (info == NULL)
+        return FALSE;
+
+    *size	= g_file_info_get_size (info);
+    *mtime	= rp_hex_file_info_get_mtime (info);
+
+    return TRUE;
+}
+
+/* Add the bytes appended to the file since we last looked to the end of
+ * the document. Only the block that held the old end of file is read
+ * again, the base piece simply grows if nobody edited the end.
+ */
+static void rp_hex_file_append_disk (RPHexFile *hex_file, GFile *file, guint64 size, guint64 mtime)
+{
+    g_autoptr(GError)	error = NULL;
+    guint64				old_size = hex_file->disk_size;
+    guint64				doc_size = hex_file->file_size;
+    doc_loc				dl;
+
+    if (hex_file->cache != NULL)
+    {
+        g_atomic_int_inc (&hex_file->prefetch_gen);
+        rp_block_cache_invalidate (hex_file->cache, old_size, 1);
+    }
+
+    // Mapping again is cheap, no page is touched until it is drawn
+    if (hex_file->mapped_file != NULL && !rp_hex_file_open_backend (hex_file, file, TRUE, size, &error))
+    {
+        g_message ("HexFile: can't reopen %s: %s", hex_file->file_name, error->message);
+        return;
+    }
+
+    hex_file->disk_size			= size;
+    hex_file->disk_mtime		= mtime;
+    hex_file->real_file_size	+= size - old_size;
+
+    dl = doc_loc_file (old_size, size - old_size);
+    rp_piece_tree_insert (hex_file->loc, doc_size, &dl);
+    hex_file->file_size = rp_piece_tree_get_size (hex_file->loc);
+
+    g_signal_emit (hex_file, class_signals[DATA_APPENDED], 0, doc_size, size - old_size);
+}
+
+/* Someone else wrote to the file. Nothing is read here, a file that grew
+ * is taken as appended to and any other change as a change of the whole
+ * file. Cached blocks in that range are dropped and read again when they
+ * are next needed. An unmodified document picks up a new length right
+ * away, with unsaved edits the pieces stay as they are and the user is
+ * warned on the next save. The changed bytes are reported through
+ * "disk_changed".
+ */
+static void rp_hex_file_check_disk (RPHexFile *hex_file)
+{
+    g_autoptr(GFile)	file = g_file_parse_name (hex_file->file_name);
+    g_autoptr(GError)	error = NULL;
+    guint64				size, mtime;
+    guint64				start, end;
+    guint64				first, last;
+
+    if (!rp_hex_file_query_disk (hex_file, file, &size, &mtime))
+    {
+        // Deleted or moved away, mapping and stream still show the old contents
+        hex_file->disk_changed = hex_file->is_modified;
+        return;
+    }
+
+    if (size == hex_file->disk_size && mtime == hex_file->disk_mtime)
+        return;
+
+    // Following a growing file, what was there before isn't looked at again
+    if (hex_file->follow && size > hex_file->disk_size)
+    {
+        rp_hex_file_append_disk (hex_file, file, size, mtime);
+        return;
+    }
+
+    g_message ("HexFile: %s changed on disk, %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT " bytes",
+               hex_file->file_name, hex_file->disk_size, size);
+
+    start	= size > hex_file->disk_size ? hex_file->disk_size : 0;
+    end		= MAX (size, hex_file->disk_size);
+
+    // Comparing the cached blocks with the file could read gigabytes on
+    // the main thread, blocks that aren't cached are read fresh anyway
+    if (hex_file->cache != NULL)
+    {
+        g_atomic_int_inc (&hex_file->prefetch_gen);
+        rp_block_cache_invalidate (hex_file->cache, start, end - start);
+    }
+
+    // Pages past the end of a truncated file fault when touched, and new
+    // ones aren't mapped yet
+    if (hex_file->mapped_file != NULL && size != hex_file->disk_size &&
+        !rp_hex_file_open_backend (hex_file, file, TRUE, size, &error))
+    {
+        g_message ("HexFile: can't reopen %s: %s", hex_file->file_name, error->message);
+    }
+
+    hex_file->disk_size		= size;
+    hex_file->disk_mtime	= mtime;
+
+    if (!hex_file->is_modified && size != hex_file->file_size)
+    {
+        hex_file->file_size = size;
+        rp_hex_file_reset_pieces (hex_file);
+        rp_hex_file_changed (hex_file);
+        return;
+    }
+
+    hex_file->disk_changed = hex_file->is_modified;
+
+    if (rp_hex_file_file_to_doc_range (hex_file, start, end, &first, &last))
+        g_signal_emit (hex_file, class_signals[DISK_CHANGED], 0, first, last - first);
+}
+
+static void rp_hex_file_monitor_changed (GFileMonitor *monitor, GFile *file, GFile *other_file,
+                                         GFileMonitorEvent event_type, RPHexFile *hex_file)
+{
+    if (event_type != G_FILE_MONITOR_EVENT_CHANGED && 
+        event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event_type != G_FILE_MONITOR_EVENT_CREATED &&
+        event_type != G_FILE_MONITOR_EVENT_DELETED)
+        return;
+
+    // Our own writes, rp_hex_file_save_commit looks at the file afterwards
+    if (hex_file->saving)
+        return;
+
+    rp_hex_file_check_disk (hex_file);
+}
+
+/* Must run on the main thread, the monitor reports to the thread default
+ * context of the thread that created it.
+ */
+static void rp_hex_file_watch (RPHexFile *hex_file, GFile *file)
+{
+    // Device nodes don't report writes, and GIO can't tell their size.
+    // A compressed file is shown as it was when the index was built.
+    if (hex_file->sector_size > 0 || hex_file->gz_index != NULL)
+        return;
+
+    hex_file->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+
+    if (hex_file->monitor != NULL)
+        g_signal_connect (hex_file->monitor, "changed", G_CALLBACK (rp_hex_file_monitor_changed), hex_file);
+}
+
+/* Keep adding what other programs append to the file to the end of the
+ * document, like tail -f. Earlier contents are assumed not to change.
+ */
+void rp_hex_file_set_follow (RPHexFile *hex_file, gboolean follow)
+{
+    hex_file->follow = follow;
+
+    if (hex_file->monitor != NULL)
+        g_file_monitor_set_rate_limit (hex_file->monitor, follow ? RP_HEX_FILE_FOLLOW_RATE_LIMIT :
+                                                                   RP_HEX_FILE_MONITOR_RATE_LIMIT);
+
+    // Catch up with what was written before
+    if (follow && hex_file->monitor != NULL && !hex_file->saving)
+        rp_hex_file_check_disk (hex_file);
+}
+
+typedef struct
+{
+    GWeakRef        hex_file;       // Closing the document doesn't wait for the build
+    RPGzIndex       *index;
+    GMainContext    *context;
+} RPIndexJob;
+
+typedef struct
+{
+    RPHexFile       *hex_file;
+    guint64         size;
+} RPIndexGrew;
+
+static void rp_index_job_free (RPIndexJob *job)
+{
+    g_weak_ref_clear (&job->hex_file);
+    rp_gz_index_unref (job->index);
+    g_main_context_unref (job->context);
+    g_free (job);
+}
+
+/* More of a compressed file was indexed, it is read only so the document
+ * simply grows at the end
+ */
+static gboolean rp_hex_file_index_grew (gpointer user_data)
+{
+    RPIndexGrew *grew = user_data;
+    RPHexFile   *hex_file = grew->hex_file;
+    guint64     old_size = hex_file->real_file_size;
+    guint64     doc_size = hex_file->file_size;
+    doc_loc     dl;
+
+    if (grew->size > old_size && hex_file->loc != NULL)
+    {
+        dl = doc_loc_file (old_size, grew->size - old_size);
+        rp_piece_tree_insert (hex_file->loc, doc_size, &dl);
+
+        hex_file->real_file_size    = grew->size;
+        hex_file->file_size         = rp_piece_tree_get_size (hex_file->loc);
+
+        g_signal_emit (hex_file, class_signals[DATA_APPENDED], 0, doc_size, grew->size - old_size);
+    }
+
+    g_object_unref (hex_file);
+    g_free (grew);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_hex_file_index_progress (guint64 size, gpointer user_data)
+{
+    RPIndexJob  *job = user_data;
+    RPIndexGrew *grew;
+    RPHexFile   *hex_file = g_weak_ref_get (&job->hex_file);
+
+    if (hex_file == NULL)
+        return;
+
+    // The reference is dropped on the main thread, where dispose must run
+    grew = g_new (RPIndexGrew, 1);
+    grew->hex_file  = hex_file;
+    grew->size      = size;
+
+    g_main_context_invoke_full (job->context, G_PRIORITY_DEFAULT_IDLE, rp_hex_file_index_grew, grew, NULL);
+}
+
+static void rp_hex_file_index_thread (GTask *task, gpointer source_object, gpointer task_data, 
+                                      GCancellable *cancellable)
+{
+    RPIndexJob          *job = task_data;
+    g_autoptr(GError)   error = NULL;
+
+    if (!rp_gz_index_build (job->index, cancellable, rp_hex_file_index_progress, job, &error))
+    {
+        g_message ("HexFile: indexing stopped: %s", error->message);
+        return;
+    }
+
+    if (!rp_gz_index_save (job->index, &error))
+        g_message ("HexFile: can't keep the index: %s", error->message);
+}
+
+/* Inflate a compressed file on a worker thread, once, to find where reads
+ * can start. Must run on the main thread, the document grows there while
+ * the index is built.
+ */
+static void rp_hex_file_start_index (RPHexFile *hex_file)
+{
+    RPIndexJob  *job;
+    GTask       *task;
+
+    if (hex_file->gz_index == NULL || rp_gz_index_is_complete (hex_file->gz_index))
+        return;
+
+    job = g_new (RPIndexJob, 1);
+    g_weak_ref_init (&job->hex_file, hex_file);
+    job->index      = rp_gz_index_ref (hex_file->gz_index);
+    job->context    = g_main_context_ref_thread_default ();
+
+    hex_file->gz_cancellable = g_cancellable_new ();
+
+    task = g_task_new (NULL, hex_file->gz_cancellable, NULL, NULL);
+    g_task_set_source_tag (task, rp_hex_file_start_index);
+    g_task_set_task_data (task, job, (GDestroyNotify)rp_index_job_free);
+    g_task_run_in_thread (task, rp_hex_file_index_thread);
+    g_object_unref (task);
+}
+
+/* Shown inflated and read only */
+gboolean rp_hex_file_is_compressed (RPHexFile *hex_file)
+{
+    return hex_file->gz_index != NULL;
+}
+
+/* Unsaved modifications of this file were left behind by a session that
+ * didn't end normally.
+ */
+gboolean rp_hex_file_has_journal (RPHexFile *hex_file)
+{
+    return hex_file->journal != NULL && rp_journal_exists (hex_file->journal);
+}
+
+typedef struct
+{
+    RPHexFile   *hex_file;
+    guint       count;
+} RPReplay;
+
+/* Checks a record against the document before applying it, a journal that
+ * doesn't fit stops the replay instead of tripping an assertion.
+ */
+static gboolean rp_hex_file_replay_record (gchar op, guint64 address, guint64 len, guint count, 
+                                           const guchar *data, gpointer user_data)
+{
+    RPReplay    *replay = user_data;
+    RPHexFile   *hex_file = replay->hex_file;
+
+    switch (op)
+    {
+    case journal_undo:
+        return rp_hex_file_undo (hex_file, NULL);
+
+    case journal_redo:
+        return rp_hex_file_redo (hex_file, NULL);
+
+    case journal_begin:
+        rp_hex_file_begin_user_action (hex_file);
+        return TRUE;
+
+    case journal_end:
+        if (hex_file->user_action == 0)
+            return FALSE;
+
+        rp_hex_file_end_user_action (hex_file);
+        return TRUE;
+
+    case mod_insert:
+    case mod_replace:
+    case mod_repback:
+        if (data == NULL || len == 0 || address > hex_file->file_size)
+            return FALSE;
+        break;
+
+    case mod_delforw:
+    case mod_delback:
+        if (data != NULL || len == 0 || address + len > hex_file->file_size)
+            return FALSE;
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    // Keystrokes after the first extend the newest record, it must be of their kind
+    if (count > 0 && hex_file->can_coalesce && !g_queue_is_empty (hex_file->undo) &&
+        ((doc_undo *)g_queue_peek_tail (hex_file->undo))->utype != op)
+        return FALSE;
+
+    rp_hex_file_change_data (hex_file, op, address, len, (guchar *)data, count);
+    replay->count++;
+
+    return TRUE;
+}
+
+/* Puts the modifications of the journal back into the freshly opened
+ * document, undo history included. Records are applied straight to the
+ * piece tree with a single change signal at the end, so even hundreds of
+ * thousands of them take well under a second. count receives the number
+ * of modifications restored, also when the journal breaks off early.
+ */
+gboolean rp_hex_file_replay_journal (RPHexFile *hex_file, guint *count, GError **error)
+{
+    RPReplay    replay = { hex_file, 0 };
+    gsize       undo_limit = hex_file->undo_limit;
+    gboolean    bRet;
+
+    g_return_val_if_fail (hex_file->journal != NULL && !hex_file->saving, FALSE);
+
+    // An undo in the journal has to find the record it undid at the time,
+    // nothing is trimmed until the end
+    hex_file->undo_limit    = G_MAXSIZE;
+    hex_file->replaying     = TRUE;
+
+    bRet = rp_journal_replay (hex_file->journal, rp_hex_file_replay_record, &replay, error);
+
+    hex_file->replaying     = FALSE;
+    hex_file->user_action   = 0;
+    rp_hex_file_set_undo_limit (hex_file, undo_limit);
+    rp_hex_file_changed (hex_file);
+
+    if (count)
+        *count = replay.count;
+
+    return bRet;
+}
+
+/* The user doesn't want the journal back */
+void rp_hex_file_discard_journal (RPHexFile *hex_file)
+{
+    if (hex_file->journal != NULL)
+        rp_journal_discard (hex_file->journal);
+}
+
+/* The file was changed by someone else while the document has unsaved
+ * edits. Saving now overwrites those changes.
+ */
+gboolean rp_hex_file_get_disk_changed (RPHexFile *hex_file)
+{
+    return hex_file->disk_changed;
+}
+
+gboolean rp_hex_file_only_overtype_changes (RPHexFile *hex_file)
+{
+    const doc_loc	*dl;
+    guint64			pos = 0;
+
+    // Make sure file length has not changed
+    if (hex_file->file_size != hex_file->real_file_size)
+        return FALSE;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, NULL)) != NULL; pos += dl->len)
+	{
+		if (dl->location != loc_mem && dl->fileaddr != pos)
+            return FALSE;
+	}
+
+    return TRUE;
+}
+
+/* One save of a document. The file is written by rp_hex_file_save_run,
+ * which rp_hex_file_save_async runs on a worker thread while the document
+ * is busy. rp_hex_file_save_commit updates the document afterwards and
+ * always runs on the main thread.
+ */
+typedef struct
+{
+    RPHexFile           *hex_file;
+    gboolean            in_place;       // Patch the file instead of replacing it
+    gchar               *path;
+    GCancellable        *cancellable;
+    RPHexFileProgress   progress;
+    gpointer            progress_data;
+    GMainContext        *context;       // Where progress is reported
+    guint64             done;
+    guint64             total;
+    gint                percent;        // Last reported
+} RPSaveJob;
+
+typedef struct
+{
+    RPHexFile           *hex_file;
+    RPHexFileProgress   progress;
+    gpointer            progress_data;
+    guint64             done;
+    guint64             total;
+} RPSaveProgress;
+
+static gboolean rp_save_progress_report (gpointer data)
+{
+    RPSaveProgress *report = data;
+
+    report->progress (report->hex_file, report->done, report->total, report->progress_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_save_progress_free (gpointer data)
+{
+    RPSaveProgress *report = data;
+
+    g_object_unref (report->hex_file);
+    g_free (report);
+}
+
+/* Account for len more bytes written, returns FALSE once the save was
+ * cancelled. Progress goes to the main thread whenever the percentage
+ * changes.
+ */
+static gboolean rp_save_job_advance (RPSaveJob *job, guint64 len, GError **error)
+{
+    gint percent;
+
+    if (job == NULL)
+        return TRUE;
+
+    if (g_cancellable_set_error_if_cancelled (job->cancellable, error))
+        return FALSE;
+
+    job->done   += len;
+    percent     = (job->total > 0) ? (gint)(job->done * 100 / job->total) : 100;
+
+    if (job->progress != NULL && percent != job->percent)
+    {
+        RPSaveProgress *report = g_new (RPSaveProgress, 1);
+
+        report->hex_file        = g_object_ref (job->hex_file);
+        report->progress        = job->progress;
+        report->progress_data   = job->progress_data;
+        report->done            = job->done;
+        report->total           = job->total;
+        job->percent            = percent;
+
+        g_main_context_invoke_full (job->context, G_PRIORITY_DEFAULT, rp_save_progress_report,
+                                    report, rp_save_progress_free);
+    }
+
+    return TRUE;
+}
+
+static void rp_save_job_free (RPSaveJob *job)
+{
+    g_object_unref (job->hex_file);
+    g_clear_object (&job->cancellable);
+    g_clear_pointer (&job->context, g_main_context_unref);
+    g_free (job->path);
+    g_free (job);
+}
+
+/* Where a save writes to. Unchanged file pieces are copied by the kernel
+ * from src_fd when the filesystem allows it, everything else is written
+ * from user space at explicit offsets.
+ */
+typedef struct
+{
+    gint        fd;
+    gint        src_fd;         // Original file, -1 if it has no local path
+    gboolean    can_clone;      // Cleared once FICLONERANGE is refused
+    gboolean    can_copy;       // Cleared once copy_file_range is refused
+    guint64     block_size;     // Clone granularity of the target filesystem
+    guchar      *buffer;        // Bounce buffer for data read through GIO
+    RPSaveJob   *job;           // Progress and cancellation, may be NULL
+} RPSaveTarget;
+
+static void rp_save_target_init (RPSaveTarget *target, gint fd, gint src_fd, RPSaveJob *job)
+{
+    struct stat st;
+
+    target->fd          = fd;
+    target->src_fd      = src_fd;
+    target->can_clone   = src_fd >= 0;
+    target->can_copy    = src_fd >= 0;
+    target->block_size  = (fstat (fd, &st) == 0 && st.st_blksize > 0) ? st.st_blksize : 4096;
+    target->buffer      = NULL;
+    target->job         = job;
+}
+
+static void rp_save_target_clear (RPSaveTarget *target)
+{
+    g_clear_pointer (&target->buffer, g_free);
+}
+
+/* Local file the loc_file pieces point into, opened for kernel side copies */
+static gint rp_hex_file_open_source (RPHexFile *hex_file)
+{
+    g_autoptr(GFile)    file = g_file_parse_name (hex_file->file_name);
+    g_autofree gchar    *path = g_file_get_path (file);
+
+    // The document of a compressed file is not in the file as it is
+    if (hex_file->gz_index != NULL)
+        return -1;
+
+    return (path != NULL) ? g_open (path, O_RDONLY, 0) : -1;
+}
+
+static gboolean rp_hex_file_write_all (gint fd, const guchar *data, gsize len, guint64 dst, GError **error)
+{
+    while (len > 0)
+    {
+        gssize written = pwrite (fd, data, MIN (len, G_MAXSSIZE), dst);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            gint saved_errno = errno;
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                         "Error writing file: %s", g_strerror (saved_errno));
+            return FALSE;
+        }
+
+        data    += written;
+        len     -= written;
+        dst     += written;
+    }
+
+    return TRUE;
+}
+
+/* Copy len bytes of the original file through user space */
+static gboolean rp_hex_file_write_file_data (RPHexFile *hex_file, RPSaveTarget *target, guint64 src, 
+                                             guint64 dst, guint64 len, GError **error)
+{
+    // Mapped data goes out in large slices, to keep progress and cancel going
+    for (guint64 done = 0, chunk; hex_file->map_data != NULL && done < len; done += chunk)
+    {
+        chunk = MIN (len - done, RP_HEX_FILE_COPY_CHUNK_SIZE);
+
+        if (!rp_hex_file_write_all (target->fd, hex_file->map_data + src + done, chunk, dst + done, error) ||
+            !rp_save_job_advance (target->job, chunk, error))
+            return FALSE;
+    }
+
+    if (hex_file->map_data != NULL)
+        return TRUE;
+
+    if (target->buffer == NULL)
+        target->buffer = g_malloc (RP_HEX_FILE_COPY_BUFFER_SIZE);
+
+    for (guint64 done = 0; done < len; )
+    {
+        gssize actual = rp_hex_file_read_stream (hex_file, src + done, target->buffer,
+                                                 MIN (len - done, RP_HEX_FILE_COPY_BUFFER_SIZE));
+
+        if (actual <= 0)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Error reading %s", hex_file->file_name);
+            return FALSE;
+        }
+
+        if (!rp_hex_file_write_all (target->fd, target->buffer, actual, dst + done, error) ||
+            !rp_save_job_advance (target->job, actual, error))
+            return FALSE;
+
+        done += actual;
+    }
+
+    return TRUE;
+}
+
+/* Copy len bytes of the original file, in the kernel where possible */
+static gboolean rp_hex_file_copy_file_data (RPHexFile *hex_file, RPSaveTarget *target, guint64 src, 
+                                            guint64 dst, guint64 len, GError **error)
+{
+#ifdef __linux__
+    guint64 bs = target->block_size;
+
+    // A reflink shares the extents instead of copying, but only whole blocks
+    // at the same position within a block can be shared
+    if (target->can_clone && src % bs == dst % bs)
+    {
+        guint64 head = (bs - src % bs) % bs;
+        guint64 body = (len > head) ? (len - head) / bs * bs : 0;
+
+        if (body > 0)
+        {
+            struct file_clone_range fcr;
+
+            fcr.src_fd      = target->src_fd;
+            fcr.src_offset  = src + head;
+            fcr.src_length  = body;
+            fcr.dest_offset = dst + head;
+
+            if (ioctl (target->fd, FICLONERANGE, &fcr) == 0)
+            {
+                return rp_save_job_advance (target->job, body, error) &&
+                       rp_hex_file_copy_file_data (hex_file, target, src, dst, head, error) &&
+                       rp_hex_file_copy_file_data (hex_file, target, src + head + body, dst + head + body,
+                                                   len - head - body, error);
+            }
+
+            g_message ("HexFile: no reflinks here (%s), copying", g_strerror (errno));
+            target->can_clone = FALSE;
+        }
+    }
+
+    // Copied inside the kernel, filesystems may still share extents
+    while (target->can_copy && len > 0)
+    {
+        loff_t  off_in  = src;
+        loff_t  off_out = dst;
+        gssize  copied  = copy_file_range (target->src_fd, &off_in, target->fd, &off_out, 
+                                           MIN (len, RP_HEX_FILE_COPY_CHUNK_SIZE), 0);
+
+        if (copied < 0 && errno == EINTR)
+            continue;
+
+        if (copied <= 0)
+        {
+            g_message ("HexFile: copy_file_range failed (%s), copying through memory", 
+                       (copied < 0) ? g_strerror (errno) : "short copy");
+            target->can_copy = FALSE;
+            break;
+        }
+
+        src += copied;
+        dst += copied;
+        len -= copied;
+
+        if (!rp_save_job_advance (target->job, copied, error))
+            return FALSE;
+    }
+#endif
+
+    return rp_hex_file_write_file_data (hex_file, target, src, dst, len, error);
+}
+
+/* Write the document range [start, end) to the start of the target piece
+ * by piece. Memory pieces and mapped file data are written straight from
+ * where they are, only data read through GIO passes a fixed size buffer.
+ * The block cache is bypassed so a save doesn't evict what the view is
+ * showing.
+ */
+static gboolean rp_hex_file_write_range (RPHexFile *hex_file, RPSaveTarget *target, guint64 start, 
+                                         guint64 end, GError **error)
+{
+    const doc_loc   *dl;
+    guint64         piece_start;
+    guint64         address;
+    guint64         offset;
+    guint64         len;
+    gboolean        bHoles = FALSE;
+
+    for (address = start; address < end; address += len)
+    {
+        dl = rp_piece_tree_lookup (hex_file->loc, address, &piece_start);
+
+        if (dl == NULL)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                         "Range ends behind the end of the document");
+            return FALSE;
+        }
+
+        offset  = address - piece_start;
+        len     = MIN (end - address, dl->len - offset);
+
+        if (dl->location == loc_mem)
+        {
+            if (!rp_hex_file_write_all (target->fd, dl->memaddr + offset, len, address - start, error) ||
+                !rp_save_job_advance (target->job, len, error))
+                return FALSE;
+        }
+        else if (dl->location == loc_zero)
+        {
+            // The target is new, whatever isn't written stays a hole
+            bHoles = TRUE;
+
+            if (!rp_save_job_advance (target->job, len, error))
+                return FALSE;
+        }
+        else if (!rp_hex_file_copy_file_data (hex_file, target, dl->fileaddr + offset, 
+                                              address - start, len, error))
+            return FALSE;
+    }
+
+    // A hole at the end needs the length set
+    if (bHoles && ftruncate (target->fd, end - start) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Error writing file: %s", g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Write the document range [start, end) to a new file */
+gboolean rp_hex_file_write_data (RPHexFile *hex_file, const gchar *file_name, guint64 start, guint64 end,
+                                 GError **error)
+{
+    RPSaveTarget    target;
+    gboolean        bRet;
+    gint            fd = g_open (file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-    for (address = start; address < end; address += bytesRead)
+    if (fd < 0)
     {
-        bytesRead = rp_hex_file_get_data (hex_file, buffer, MIN (end - address, copy_buffer_len), address);
-        g_assert (bytesRead > 0);
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't create %s: %s", file_name, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    rp_save_target_init (&target, fd, rp_hex_file_open_source (hex_file), NULL);
+    bRet = rp_hex_file_write_range (hex_file, &target, start, end, error);
+    rp_save_target_clear (&target);
+
+    if (target.src_fd >= 0)
+        close (target.src_fd);
 
-        fwrite (buffer, 1, bytesRead, fp);
+    if (!bRet)
+    {
+        close (fd);
+        return FALSE;
     }
-    
-    g_assert (address == end);
-    
-    g_free (buffer);
-    buffer = NULL;
 
-    if (fclose (fp) != 0)
+    return g_close (fd, error);
+}
+
+/* Patched ranges of an in-place save collected for a single pwritev */
+typedef struct
+{
+    gint            fd;
+    struct iovec    iov[RP_HEX_FILE_MAX_IOV];
+    gint            count;
+    gint            max_count;      // Two less on devices, for the sector ends
+    guint64         offset;         // File offset of iov[0]
+    guint64         len;
+    guchar          *gap;           // Unchanged bytes read to bridge a gap
+    gsize           gap_used;
+    guint           calls;
+    guint           sector_size;    // Devices only, writes cover whole sectors
+    guchar          *head;          // Old bytes of the first and last sector
+    guchar          *tail;
+} RPWriteRun;
+
+static void rp_write_run_add (RPWriteRun *run, const guchar *data, guint64 pos, gsize len)
+{
+    if (run->count == 0)
+    {
+        run->offset = pos;
+        run->len    = 0;
+    }
+
+    g_assert (run->offset + run->len == pos);
+
+    run->iov[run->count].iov_base   = (void *)data;
+    run->iov[run->count].iov_len    = len;
+    run->count++;
+    run->len += len;
+}
+
+static gboolean rp_write_run_pread (RPWriteRun *run, guchar *buf, gsize len, guint64 offset, GError **error)
+{
+    gssize actual;
+
+    while ((actual = pread (run->fd, buf, len, offset)) < 0 && errno == EINTR);
+
+    if (actual != (gssize)len)
+    {
+        gint saved_errno = (actual < 0) ? errno : EIO;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Error reading %" G_GSIZE_FORMAT " bytes at offset %" G_GUINT64_FORMAT ": %s", 
+                     len, offset, g_strerror (saved_errno));
         return FALSE;
-    
+    }
+
     return TRUE;
 }
 
-void dump_loc_list (RPHexFile *hex_file)
+/* Read-modify-write: extend the run to sector boundaries with the bytes
+ * currently on the device
+ */
+static gboolean rp_write_run_align (RPWriteRun *run, GError **error)
+{
+    guint64 head	= run->offset % run->sector_size;
+    guint64 end		= run->offset + run->len;
+    guint64 tail	= (run->sector_size - end % run->sector_size) % run->sector_size;
+
+    if (head > 0)
+    {
+        if (!rp_write_run_pread (run, run->head, head, run->offset - head, error))
+            return FALSE;
+
+        memmove (run->iov + 1, run->iov, run->count * sizeof (struct iovec));
+        run->iov[0].iov_base    = run->head;
+        run->iov[0].iov_len     = head;
+        run->count++;
+        run->offset -= head;
+        run->len    += head;
+    }
+
+    if (tail > 0)
+    {
+        if (!rp_write_run_pread (run, run->tail, tail, end, error))
+            return FALSE;
+
+        run->iov[run->count].iov_base   = run->tail;
+        run->iov[run->count].iov_len    = tail;
+        run->count++;
+        run->len    += tail;
+    }
+
+    return TRUE;
+}
+
+/* Write the collected run, short writes continue where they stopped */
+static gboolean rp_write_run_flush (RPWriteRun *run, GError **error)
+{
+    struct iovec    *iov;
+    gint            count;
+    guint64         offset;
+
+    if (run->sector_size > 0 && !rp_write_run_align (run, error))
+        return FALSE;
+
+    iov     = run->iov;
+    count   = run->count;
+    offset  = run->offset;
+
+    while (count > 0)
+    {
+        gssize written = pwritev (run->fd, iov, count, offset);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+
+        if (written <= 0)
+        {
+            gint saved_errno = (written < 0) ? errno : EIO;
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                         "Error writing %" G_GUINT64_FORMAT " bytes at offset %" G_GUINT64_FORMAT ": %s", 
+                         run->offset + run->len - offset, offset, g_strerror (saved_errno));
+            return FALSE;
+        }
+
+        run->calls++;
+        offset += written;
+
+        while (count > 0 && (gsize)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base   = (guchar *)iov->iov_base + written;
+            iov->iov_len    -= written;
+        }
+    }
+
+    run->count      = 0;
+    run->gap_used   = 0;
+
+    return TRUE;
+}
+
+/* Put the unchanged bytes [pos, pos + len) into the run, returns FALSE if
+ * there is no room for them
+ */
+static gboolean rp_hex_file_bridge_gap (RPHexFile *hex_file, RPWriteRun *run, guint64 pos, gsize len)
+{
+    if (run->count + 1 >= run->max_count)
+        return FALSE;
+
+    if (hex_file->map_data != NULL)
+    {
+        rp_write_run_add (run, hex_file->map_data + pos, pos, len);
+        return TRUE;
+    }
+
+    if (run->gap_used + len > RP_HEX_FILE_GAP_BUFFER_SIZE)
+        return FALSE;
+
+    if (run->gap == NULL)
+        run->gap = g_malloc (RP_HEX_FILE_GAP_BUFFER_SIZE);
+
+    // Not through the block cache, that belongs to the main thread
+    if (rp_hex_file_read_stream (hex_file, pos, run->gap + run->gap_used, len) != (gssize)len)
+        return FALSE;
+
+    rp_write_run_add (run, run->gap + run->gap_used, pos, len);
+    run->gap_used += len;
+
+    return TRUE;
+}
+
+static gboolean rp_hex_file_sync (gint fd, RPHexFileSync sync_mode, GError **error)
+{
+    gint ret = 0;
+
+    if (sync_mode == RP_HEX_FILE_SYNC_DATA)
+        ret = fdatasync (fd);
+    else if (sync_mode == RP_HEX_FILE_SYNC_FULL)
+        ret = fsync (fd);
+
+    if (ret != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Error syncing file: %s", g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Patch an overtyped document into the file. Neighbouring patches, and
+ * patches separated by no more than RP_HEX_FILE_GAP_BRIDGE unchanged bytes,
+ * are joined and written with one pwritev each. On failure the file may be
+ * partially patched, the document stays modified so the save can be
+ * repeated.
+ */
+static gboolean rp_hex_file_patch_file (RPSaveJob *job, GError **error)
+{
+    RPHexFile           *hex_file = job->hex_file;
+    const doc_loc       *dl;
+    const doc_loc       *next;
+    guint64             pos = 0;
+    RPWriteRun          run;
+    gboolean            bRet = FALSE;
+
+    // Sectors are completed with what is on the device, that needs reading
+    run.fd          = g_open (job->path, hex_file->sector_size > 0 ? O_RDWR : O_WRONLY, 0);
+    run.count       = 0;
+    run.max_count   = hex_file->sector_size > 0 ? RP_HEX_FILE_MAX_IOV - 2 : RP_HEX_FILE_MAX_IOV;
+    run.gap         = NULL;
+    run.gap_used    = 0;
+    run.calls       = 0;
+    run.sector_size = hex_file->sector_size;
+    run.head        = run.sector_size > 0 ? g_malloc (run.sector_size) : NULL;
+    run.tail        = run.sector_size > 0 ? g_malloc (run.sector_size) : NULL;
+
+    if (run.fd < 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't open %s: %s", job->path, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, NULL)) != NULL; pos += dl->len)
+    {
+        if (!rp_save_job_advance (job, dl->len, error))
+            goto out;
+
+        if (dl->location == loc_mem)
+        {
+            if (run.count == run.max_count && !rp_write_run_flush (&run, error))
+                goto out;
+
+            rp_write_run_add (&run, dl->memaddr, pos, dl->len);
+            continue;
+        }
+
+        if (dl->fileaddr != pos)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                         "The document can't be saved in place");
+            goto out;
+        }
+
+        if (run.count == 0)
+            continue;
+
+        // Rewriting a short gap is cheaper than another system call
+        next = rp_piece_tree_lookup (hex_file->loc, pos + dl->len, NULL);
+
+        if (next != NULL && next->location == loc_mem && dl->len <= RP_HEX_FILE_GAP_BRIDGE &&
+            rp_hex_file_bridge_gap (hex_file, &run, pos, dl->len))
+            continue;
+
+        if (!rp_write_run_flush (&run, error))
+            goto out;
+    }
+
+    if (run.count > 0 && !rp_write_run_flush (&run, error))
+        goto out;
+
+    if (!rp_hex_file_sync (run.fd, hex_file->sync_mode, error))
+        goto out;
+
+    bRet = TRUE;
+
+out:
+    g_message ("HexFile: in place save used %u writes", run.calls);
+
+    g_free (run.gap);
+    g_free (run.head);
+    g_free (run.tail);
+
+    if (close (run.fd) != 0 && bRet)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Error closing %s: %s", job->path, g_strerror (saved_errno));
+        bRet = FALSE;
+    }
+
+    return bRet;
+}
+
+/* Stream the whole document into a temporary file next to the original,
+ * sync it and rename it over the original. The original stays intact until
+ * the new version is complete.
+ */
+static gboolean rp_hex_file_replace_file (RPSaveJob *job, GError **error)
 {
-    GList *locList = g_list_first (hex_file->loc);
+    RPHexFile           *hex_file = job->hex_file;
+    g_autofree gchar    *dir_name = NULL;
+    g_autofree gchar    *base_name = NULL;
+    g_autofree gchar    *tmp_name = NULL;
+    struct stat         st;
+    RPSaveTarget        target;
+    gboolean            bRet;
+    gint                fd;
+    gint                dir_fd;
+
+    if (g_stat (job->path, &st) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't stat %s: %s", job->path, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    dir_name    = g_path_get_dirname (job->path);
+    base_name   = g_path_get_basename (job->path);
+    tmp_name    = g_strdup_printf ("%s/.%s.XXXXXX", dir_name, base_name);
+
+    fd = g_mkstemp_full (tmp_name, O_RDWR, st.st_mode & 07777);
+
+    if (fd < 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't create a temporary file in %s: %s", dir_name, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    // Keep owner and permissions of the original, ownership only works as root
+    if (fchown (fd, st.st_uid, st.st_gid) != 0)
+        g_message ("HexFile: could not keep the owner of %s", job->path);
+    fchmod (fd, st.st_mode & 07777);
+
+    rp_save_target_init (&target, fd, g_open (job->path, O_RDONLY, 0), job);
+    bRet = rp_hex_file_write_range (hex_file, &target, 0, hex_file->file_size, error);
+    rp_save_target_clear (&target);
+
+    if (target.src_fd >= 0)
+        close (target.src_fd);
+
+    if (!bRet)
+        goto failed;
+
+    if (fsync (fd) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Error syncing %s: %s", tmp_name, g_strerror (saved_errno));
+        goto failed;
+    }
+
+    if (!g_close (fd, error))
+    {
+        fd = -1;
+        goto failed;
+    }
+    fd = -1;
+
+    // Last chance to back out, the original is still untouched
+    if (g_cancellable_set_error_if_cancelled (job->cancellable, error))
+        goto failed;
+
+    if (g_rename (tmp_name, job->path) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't replace %s: %s", job->path, g_strerror (saved_errno));
+        goto failed;
+    }
+
+    // Make the rename itself durable
+    dir_fd = g_open (dir_name, O_RDONLY, 0);
+
+    if (dir_fd >= 0)
+    {
+        fsync (dir_fd);
+        close (dir_fd);
+    }
+
+    return TRUE;
+
+failed:
+    if (fd >= 0)
+        close (fd);
+
+    g_unlink (tmp_name);
+
+    return FALSE;
+}
+
+static RPSaveJob *rp_save_job_new (RPHexFile *hex_file, gboolean in_place, GError **error)
+{
+    g_autoptr(GFile)    file = NULL;
+    g_autofree gchar    *path = NULL;
+    RPSaveJob           *job;
+
+    file = g_file_parse_name (hex_file->file_name);
+    path = g_file_get_path (file);
+
+    if (path == NULL)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, 
+                     in_place ? "Only local files can be saved" :
+                                "Only local files can be saved with inserted or deleted bytes");
+        return NULL;
+    }
+
+    // A device can't grow or shrink, nor be replaced by a temporary file
+    if (hex_file->sector_size > 0 && !in_place)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, 
+                     "Block devices can only be saved with overtyped bytes");
+        return NULL;
+    }
+
+    // Someone truncated the file, what is left of the document can't be written
+    if (rp_hex_file_get_file_extent (hex_file) > hex_file->disk_size)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, 
+                     "The file was truncated by another program, parts of the document are lost");
+        return NULL;
+    }
+
+    job = g_new0 (RPSaveJob, 1);
+
+    job->hex_file   = g_object_ref (hex_file);
+    job->in_place   = in_place;
+    job->total      = hex_file->file_size;
+    job->percent    = -1;
+
+    // Replace the target of a symbolic link, not the link itself
+    gchar *real_path = in_place ? NULL : realpath (path, NULL);
+
+    if (real_path != NULL)
+    {
+        job->path = g_strdup (real_path);
+        free (real_path);
+    }
+    else
+        job->path = g_steal_pointer (&path);
+
+    return job;
+}
+
+static gboolean rp_hex_file_save_run (RPSaveJob *job, GError **error)
+{
+    return job->in_place ? rp_hex_file_patch_file (job, error) : rp_hex_file_replace_file (job, error);
+}
+
+/* The file holds the document now, or not if bSaved is FALSE */
+static gboolean rp_hex_file_save_commit (RPSaveJob *job, gboolean bSaved, GError **error)
+{
+    RPHexFile           *hex_file = job->hex_file;
+    g_autoptr(GFile)    file = g_file_parse_name (hex_file->file_name);
+    guint64             size;
+
+    // Blocks read before may hold the old bytes, even after a partial write
+    if (job->in_place && hex_file->cache != NULL)
+    {
+        g_atomic_int_inc (&hex_file->prefetch_gen);
+        rp_block_cache_clear (hex_file->cache);
+    }
+
+    // Remember what we wrote, so the monitor doesn't take it for someone else.
+    // Anything appended meanwhile is still new to us.
+    if (rp_hex_file_query_disk (hex_file, file, &size, &hex_file->disk_mtime) && bSaved)
+    {
+        hex_file->disk_size     = hex_file->file_size;
+        hex_file->disk_changed  = FALSE;
+    }
+
+    if (!bSaved)
+        return FALSE;
+
+    // The old mapping still shows the replaced file, switch over to the new one
+    if (!job->in_place)
+    {
+        g_autoptr(GFile) target = g_file_new_for_path (job->path);
+
+        if (!rp_hex_file_open_backend (hex_file, target, TRUE, hex_file->file_size, error))
+            return FALSE;
+    }
+
+    rp_hex_file_reset_pieces (hex_file);
+
+    return TRUE;
+}
+
+static gboolean rp_hex_file_save_job (RPHexFile *hex_file, gboolean in_place, GError **error)
+{
+    RPSaveJob   *job;
+    gboolean    bRet;
+
+    g_return_val_if_fail (!hex_file->saving, FALSE);
+
+    job = rp_save_job_new (hex_file, in_place, error);
+
+    if (job == NULL)
+        return FALSE;
+
+    bRet = rp_hex_file_save_run (job, error);
+    bRet = rp_hex_file_save_commit (job, bRet, error);
+
+    rp_save_job_free (job);
+
+    return bRet;
+}
+
+/* Save a document that only has overtyped bytes by patching the file */
+gboolean rp_hex_file_write_in_place (RPHexFile *hex_file, GError **error)
+{
+    return rp_hex_file_save_job (hex_file, TRUE, error);
+}
+
+/* Save a document whose length or layout changed through a temporary file.
+ * Afterwards the new file becomes the base of the document.
+ */
+gboolean rp_hex_file_write_replace (RPHexFile *hex_file, GError **error)
+{
+    return rp_hex_file_save_job (hex_file, FALSE, error);
+}
 
-    for (guint il = 0; il < g_list_length (hex_file->loc); il++)
+static void rp_hex_file_save_thread (GTask *task, gpointer source_object, gpointer task_data, 
+                                     GCancellable *cancellable)
+{
+    GError *error = NULL;
+
+    if (rp_hex_file_save_run (task_data, &error))
+        g_task_return_boolean (task, TRUE);
+    else
+        g_task_return_error (task, error);
+}
+
+/* Save the document on a worker thread, patching the file in place when
+ * only bytes were overtyped. The document is busy until
+ * rp_hex_file_save_finish is called, it must not be changed before.
+ * progress is called on the calling thread's main context.
+ */
+void rp_hex_file_save_async (RPHexFile *hex_file, GCancellable *cancellable, 
+                             RPHexFileProgress progress, gpointer progress_data,
+                             GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask       *task;
+    RPSaveJob   *job;
+    GError      *error = NULL;
+
+    g_return_if_fail (RP_IS_HEX_FILE (hex_file));
+    g_return_if_fail (!hex_file->saving);
+
+    task = g_task_new (hex_file, cancellable, callback, user_data);
+    g_task_set_source_tag (task, rp_hex_file_save_async);
+
+    job = rp_save_job_new (hex_file, rp_hex_file_only_overtype_changes (hex_file), &error);
+
+    if (job == NULL)
     {
-        struct _doc_loc *dl = ((struct _doc_loc*)(locList->data));
-        g_message ("Dump Loc List %i: Location: %s, Len: %i, File addr: %i", il, (dl->location == 102) ? "File" : "Mem", dl->len, dl->fileaddr);
-        locList = locList->next;
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
     }
-}
\ No newline at end of file
+
+    job->cancellable    = cancellable ? g_object_ref (cancellable) : NULL;
+    job->progress       = progress;
+    job->progress_data  = progress_data;
+    job->context        = g_main_context_ref_thread_default ();
+
+    hex_file->saving = TRUE;
+
+    g_task_set_task_data (task, job, (GDestroyNotify)rp_save_job_free);
+    g_task_run_in_thread (task, rp_hex_file_save_thread);
+    g_object_unref (task);
+}
+
+gboolean rp_hex_file_save_finish (RPHexFile *hex_file, GAsyncResult *result, GError **error)
+{
+    RPSaveJob   *job;
+    gboolean    bRet;
+
+    g_return_val_if_fail (g_task_is_valid (result, hex_file), FALSE);
+
+    job     = g_task_get_task_data (G_TASK (result));
+    bRet    = g_task_propagate_boolean (G_TASK (result), error);
+
+    // Failed before the worker started
+    if (job == NULL)
+        return FALSE;
+
+    hex_file->saving = FALSE;
+
+    return rp_hex_file_save_commit (job, bRet, error);
+}
+
+/* A save is running, the document must not be changed */
+gboolean rp_hex_file_is_busy (RPHexFile *hex_file)
+{
+    return hex_file->saving;
+}
+
+void dump_loc_list (RPHexFile *hex_file)
+{
+    const doc_loc	*dl;
+    guint64			pos = 0;
+    guint			il = 0;
+
+    for (; (dl = rp_piece_tree_lookup (hex_file->loc, pos, NULL)) != NULL; pos += dl->len, il++)
+        g_message ("Dump Loc List %u: Location: %s, Len: %" G_GUINT64_FORMAT ", File addr: %" G_GUINT64_FORMAT, il, (dl->location == loc_file) ? "File" : (dl->location == loc_zero) ? "Hole" : "Mem", dl->len, dl->fileaddr);
+}
@@ -23,6 +23,11 @@
 #include <stdio.h>
 #include <glib-object.h>
 #include <gtk/gtk.h>
+#include "rppiecetree.h"
+#include "rpblockcache.h"
+#include "rpaddbuffer.h"
+#include "rpgzindex.h"
+#include "rpjournal.h"
 
 G_BEGIN_DECLS
 
@@ -43,53 +48,93 @@ enum mod_type
     mod_repback = '<',          // Replace back (BS in overtype mode)
 };
 
-enum { loc_unknown = 'u', loc_file = 'f', loc_mem = 'm' };
-
-typedef struct _doc_loc doc_loc;
+typedef enum
+{
+    RP_HEX_FILE_SYNC_NONE,      // Leave writing back to the page cache
+    RP_HEX_FILE_SYNC_DATA,      // fdatasync, the data and the size
+    RP_HEX_FILE_SYNC_FULL       // fsync, all metadata as well
+} RPHexFileSync;
 
-struct _doc_loc
+typedef enum
 {
-    gchar	location;  // File or memory?
-    guint32	len;
-    union
-    {
-        guint32 fileaddr; 	// File location (if loc_file)
-        guchar 	*memaddr;	// Ptr to data (if loc_mem)
-    };
-};
+    RP_HEX_FILE_OPEN_NONE       = 0,
+    RP_HEX_FILE_OPEN_READ_ONLY  = 1 << 0,   // Never written to, no journal
+    RP_HEX_FILE_OPEN_RAW        = 1 << 1    // gzip files show their compressed bytes
+} RPHexFileOpenFlags;
 
-//const int doc_undo_limit = 5;
+#define RP_HEX_FILE_DEFAULT_CACHE_SIZE	(16 * 1024 * 1024)
+#define RP_HEX_FILE_DEFAULT_UNDO_LIMIT	(64 * 1024 * 1024)
 
 typedef struct _doc_undo doc_undo;
 
 struct _doc_undo
 {
-    int limit;
     enum mod_type utype;        // Type of modification made to file
-    guint32 len;                // Length of mod
-    guint32 address;            // Address in file of start of mod
-    guchar *ptr;                // NULL if utype is del else new data
+    guint64 len;                // Length of mod
+    guint64 address;            // Address in file of start of mod
+    guchar *ptr;                // NULL if utype is del else new data (in add_buffer)
+    guint group;                // Records of one group are undone together
+    GArray *removed;            // doc_loc pieces taken out of the document
 };
 
-doc_loc *doc_loc_mem_new (guchar *mem, size_t l);
-doc_loc *doc_loc_file_new (guint32 file_addr, size_t l);
-
-doc_undo *doc_undo_new (enum mod_type u, guint32 a, guint32 l, guchar *p);
+doc_undo *doc_undo_new (enum mod_type u, guint64 a, guint64 l, guchar *p);
+void      doc_undo_free (doc_undo *du);
 
 typedef struct _RPHexFile		RPHexFile;
 typedef struct _RPHexFileClass	RPHexFileClass;
 
+/* Read-only view of a document as it was when the snapshot was taken.
+ * Shares the piece tree, the typed bytes and the file mapping with the
+ * document instead of copying them, and can be read from any thread
+ * while the document is edited.
+ */
+typedef struct _RPHexSnapshot	RPHexSnapshot;
+
+typedef void (*RPHexFileProgress) (RPHexFile *hex_file, guint64 done, guint64 total, gpointer user_data);
+
 struct _RPHexFile
 {
     GObject 			object;
 	gchar 				*file_name;
-	guint32 			file_size;
-    guint32             real_file_size;
+	guint64 			file_size;
+    guint64             real_file_size;
     gboolean            read_only;
     gboolean            is_modified;
-	GDataInputStream	*data_stream;
-    GList               *loc;
-    GList               *undo;
+	GDataInputStream	*data_stream;   // Fallback if the file can't be mapped
+    RPBlockCache        *cache;         // Blocks read through data_stream
+    GMappedFile         *mapped_file;   // Read only mapping of local regular files
+    const guchar        *map_data;
+    RPPieceTree         *loc;
+    GQueue              *undo;          // Applied modifications, oldest first
+    GQueue              *redo;          // Undone modifications, last undone at the tail
+    gsize               undo_bytes;     // Memory held by both queues
+    gsize               undo_limit;
+    guint               undo_group;     // Group of the newest record
+    gint                user_action;    // Nesting depth of begin_user_action
+    gboolean            can_coalesce;   // The next keystroke may extend the newest record
+    gboolean            newest_shared;  // A snapshot was taken since the newest keystroke
+    doc_undo            *save_point;    // Newest record when the file was last saved
+    gboolean            save_point_lost;
+    RPAddBuffer         *add_buffer;    // Data referenced by loc_mem pieces and undo
+    gsize               add_dead;       // Add buffer bytes dropped records held, at most
+    RPHexFileSync       sync_mode;      // Durability of in-place saves
+    gboolean            saving;         // A background save reads the pieces
+    GMutex              stream_lock;    // Serializes reads from data_stream
+    GFileMonitor        *monitor;
+    guint64             disk_size;      // Size and modification time the file
+    guint64             disk_mtime;     // had when we last looked
+    gboolean            disk_changed;   // Changed by someone else under unsaved edits
+    gboolean            follow;         // Append what is added to the file
+    GThreadPool         *prefetch_pool; // Reads blocks ahead for the cache
+    GMainContext        *prefetch_context;
+    gint                prefetch_gen;   // Bumped to drop queued reads
+    guint64             prefetch_last;  // Block queued last
+    guint64             prefetch_requested;
+    guint               sector_size;    // Logical sector size of a block device, else 0
+    RPGzIndex           *gz_index;      // gzip files are read inflated, through this
+    GCancellable        *gz_cancellable;
+    RPJournal           *journal;       // Unsaved modifications, for crash recovery
+    gboolean            replaying;      // Modifications come from the journal
 };
 
 struct _RPHexFileClass
@@ -97,21 +142,66 @@ struct _RPHexFileClass
 	GObjectClass	parent_class;
 
     void (*data_changed)	(RPHexFile *);
+    void (*disk_changed)	(RPHexFile *, guint64, guint64);
+    void (*data_appended)	(RPHexFile *, guint64, guint64);
 };
 
 GType   	rp_hex_file_get_type (void);
 
 RPHexFile 	*rp_hex_file_new (void);
-RPHexFile 	*rp_hex_file_new_with_file (GFile *file, gboolean open_read_only, GError *error);
+RPHexFile 	*rp_hex_file_new_with_file (GFile *file, RPHexFileOpenFlags flags, GError **error);
+void        rp_hex_file_new_async (GFile *file, RPHexFileOpenFlags flags, GCancellable *cancellable,
+                                   GAsyncReadyCallback callback, gpointer user_data);
+RPHexFile   *rp_hex_file_new_finish (GAsyncResult *result, GError **error);
 gchar 		*rp_hex_file_get_file_name (RPHexFile *hex_file);
 gboolean    rp_hex_file_is_read_only (RPHexFile *hex_file);
-guint32     rp_hex_file_get_data (RPHexFile *hex_file, guchar *buf, guint32 len, guint32 address);
-void        rp_hex_file_change_data (RPHexFile *hex_file, enum mod_type utype, guint32 address, 
-							        guint32 len, guchar *buf, guint num_done);
+gsize       rp_hex_file_get_data (RPHexFile *hex_file, guchar *buf, gsize len, guint64 address);
+void        rp_hex_file_change_data (RPHexFile *hex_file, enum mod_type utype, guint64 address, 
+							        guint64 len, guchar *buf, guint num_done);
+void        rp_hex_file_begin_user_action (RPHexFile *hex_file);
+void        rp_hex_file_end_user_action (RPHexFile *hex_file);
+gboolean    rp_hex_file_can_undo (RPHexFile *hex_file);
+gboolean    rp_hex_file_can_redo (RPHexFile *hex_file);
+gboolean    rp_hex_file_undo (RPHexFile *hex_file, guint64 *address);
+gboolean    rp_hex_file_redo (RPHexFile *hex_file, guint64 *address);
+void        rp_hex_file_set_undo_limit (RPHexFile *hex_file, gsize limit);
+void        rp_hex_file_set_sync_mode (RPHexFile *hex_file, RPHexFileSync sync_mode);
 gboolean    rp_hex_file_get_is_modified (RPHexFile *hex_file);
-guint32		rp_hex_file_get_size (RPHexFile *hex_file);
+guint64		rp_hex_file_get_size (RPHexFile *hex_file);
+void        rp_hex_file_set_cache_size (RPHexFile *hex_file, gsize size);
+void        rp_hex_file_get_cache_stats (RPHexFile *hex_file, guint64 *hits, guint64 *misses);
+void        rp_hex_file_prefetch (RPHexFile *hex_file, guint64 address, guint64 len);
+void        rp_hex_file_cancel_prefetch (RPHexFile *hex_file);
+void        rp_hex_file_get_prefetch_stats (RPHexFile *hex_file, guint64 *requested, guint64 *used, 
+                                            guint64 *wasted);
+guint64     rp_hex_file_get_hole (RPHexFile *hex_file, guint64 address);
+gboolean    rp_hex_file_next_data (RPHexFile *hex_file, guint64 address, guint64 *data_start);
+gboolean    rp_hex_file_prev_data (RPHexFile *hex_file, guint64 address, guint64 *data_start);
 gboolean    rp_hex_file_only_overtype_changes (RPHexFile *hex_file);
-gboolean    rp_hex_file_write_in_place (RPHexFile *hex_file);
+gboolean    rp_hex_file_write_in_place (RPHexFile *hex_file, GError **error);
+gboolean    rp_hex_file_write_replace (RPHexFile *hex_file, GError **error);
+void        rp_hex_file_save_async (RPHexFile *hex_file, GCancellable *cancellable, 
+                                    RPHexFileProgress progress, gpointer progress_data,
+                                    GAsyncReadyCallback callback, gpointer user_data);
+gboolean    rp_hex_file_save_finish (RPHexFile *hex_file, GAsyncResult *result, GError **error);
+gboolean    rp_hex_file_is_busy (RPHexFile *hex_file);
+gboolean    rp_hex_file_get_disk_changed (RPHexFile *hex_file);
+gboolean    rp_hex_file_is_compressed (RPHexFile *hex_file);
+void        rp_hex_file_set_follow (RPHexFile *hex_file, gboolean follow);
+gboolean    rp_hex_file_has_journal (RPHexFile *hex_file);
+gboolean    rp_hex_file_replay_journal (RPHexFile *hex_file, guint *count, GError **error);
+void        rp_hex_file_discard_journal (RPHexFile *hex_file);
+gboolean    rp_hex_file_write_data (RPHexFile *hex_file, const gchar *file_name, guint64 start, 
+                                    guint64 end, GError **error);
+RPHexSnapshot *rp_hex_file_snapshot (RPHexFile *hex_file);
+RPHexSnapshot *rp_hex_snapshot_ref (RPHexSnapshot *snapshot);
+void        rp_hex_snapshot_unref (RPHexSnapshot *snapshot);
+guint64     rp_hex_snapshot_get_size (RPHexSnapshot *snapshot);
+gsize       rp_hex_snapshot_get_data (RPHexSnapshot *snapshot, guchar *buf, gsize len, guint64 address);
+const guchar *rp_hex_snapshot_peek (RPHexSnapshot *snapshot, guint64 address, guint64 *start, 
+                                    guint64 *len, gboolean *hole);
+gboolean    rp_hex_snapshot_next_difference (RPHexSnapshot *a, RPHexSnapshot *b, guint64 from, 
+                                             guint64 *address);
 void        dump_loc_list (RPHexFile *hex_file);
 
 G_END_DECLS
@@ -55,6 +55,8 @@ enum
 	EDIT_PASTE,
 	EDIT_DELETE,
 	EDIT_SELECT_ALL,
+	EDIT_UNDO,
+	EDIT_REDO,
 	LAST_SIGNAL
 };
 
@@ -62,10 +64,10 @@ typedef struct _dataSelection dataSelection;
 
 struct _dataSelection
 {
-	glong startSel;
-	glong endSel;
-	glong clipboard_startSel;
-	glong clipboard_endSel;
+	gint64 startSel;
+	gint64 endSel;
+	gint64 clipboard_startSel;
+	gint64 clipboard_endSel;
 };
 
 static const GtkTargetEntry clip_targets[] = {
@@ -95,22 +97,22 @@ struct _RPHexViewPrivate
 	gint	iAddressWidth;
 	gint	iCharHeight, iPrintCharHeight;
 	gint	iCharWidth, iPrintCharWidth;
-	guint32	iRows, iPrintRows;
-	guint32	iTopRow, iPrintTopRow;  
+	guint64	iRows, iPrintRows;
+	guint64	iTopRow, iPrintTopRow;  
 	gint	iVisibleRows, iPrintVisibleRows;
-	guint32	iLastRow, iPrintLastRow;
+	guint64	iLastRow, iPrintLastRow;
 	gint	iCols;
 	gint	iLeftCol;
 	gint	iVisibleCols;
 	gint	iBytesPerLine, iPrintBytesPerLine;
 	gint	iMaxVisibleBytes, iPrintMaxVisibleBytes;
-	guint32 iStartByte, iPrintStartByte;
-	guint32	iEndByte, iPrintEndByte;
-	guint32	iFileSize;
+	guint64 iStartByte, iPrintStartByte;
+	guint64	iEndByte, iPrintEndByte;
+	guint64	iFileSize;
 	guint	iPrintPages;
 
 	gint			cursorArea;
-	guint32			iBytePos;
+	guint64			iBytePos;
 	gboolean		bBytePosIsNibble;
 	gboolean		bSelecting;
 	gboolean		bLButttonDown;
@@ -124,6 +126,9 @@ struct _RPHexViewPrivate
 	gboolean	bDrawAddresses;
 	gboolean	bAutoBytesPerRow;
 	gboolean	bDrawCharacters;
+	gboolean	bFollow;		// Stay at the end while the file grows
+	guint		iPrefetchViewports;	// Screens read ahead while scrolling
+	gint64		iScrollVelocity;	// Rows per scroll step, negative going up
 
 	RPHexFile 	*hex_file;
 	gboolean	bIsOvertype;
@@ -178,11 +183,11 @@ static gboolean rp_hex_view_key_press_callback (GtkWidget *widget, GdkEventKey *
 static gboolean rp_hex_view_key_release_callback (GtkWidget *widget, GdkEventKey *event);
 gboolean rp_hex_view_has_selection (GtkWidget *widget);
 static void rp_hex_view_remove_selection (GtkWidget *widget);
-static void rp_hex_view_set_selection (GtkWidget *widget, glong selStartPos, glong selEndPos);
-static void rp_hex_view_set_cursor (GtkWidget *widget, guint32 newPos);
+static void rp_hex_view_set_selection (GtkWidget *widget, gint64 selStartPos, gint64 selEndPos);
+static void rp_hex_view_set_cursor (GtkWidget *widget, guint64 newPos);
 static void rp_hex_view_update_cursor_area (RPHexViewPrivate *priv, gdouble posX, gdouble posY);
-static void rp_hex_view_scroll_byte_into_view (RPHexViewPrivate *priv, guint32 curPos);
-static guint32 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv, 
+static void rp_hex_view_scroll_byte_into_view (RPHexViewPrivate *priv, guint64 curPos);
+static guint64 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv, 
 											gdouble posX, gdouble posY, gboolean bSnap);
 static gboolean rp_hex_view_context_menu (GtkWidget *widget);
 static void rp_hex_view_context_menu_show (GtkWidget *widget, GdkEventButton *event);
@@ -192,11 +197,18 @@ static void rp_hex_view_context_menu_copy (GSimpleAction *action, GVariant *para
 static void rp_hex_view_context_menu_paste (GSimpleAction *action, GVariant *parameter, gpointer data);
 static void rp_hex_view_context_menu_delete (GSimpleAction *action, GVariant *parameter, gpointer data);
 static void rp_hex_view_context_menu_select_all (GSimpleAction *action, GVariant *parameter, gpointer data);
+static void rp_hex_view_context_menu_undo (GSimpleAction *action, GVariant *parameter, gpointer data);
+static void rp_hex_view_context_menu_redo (GSimpleAction *action, GVariant *parameter, gpointer data);
 static void rp_hex_view_edit_cut (RPHexView *hex_view);
 static void rp_hex_view_edit_copy (RPHexView *hex_view);
 static void rp_hex_view_edit_paste (RPHexView *hex_view);
 static void rp_hex_view_edit_delete (RPHexView *hex_view);
 static void rp_hex_view_edit_select_all (RPHexView *hex_view);
+static void rp_hex_view_edit_undo (RPHexView *hex_view);
+static void rp_hex_view_edit_redo (RPHexView *hex_view);
+static void rp_hex_view_data_changed (RPHexFile *hex_file, gboolean bModified, RPHexView *hex_view);
+static void rp_hex_view_disk_changed (RPHexFile *hex_file, guint64 start, guint64 len, RPHexView *hex_view);
+static void rp_hex_view_data_appended (RPHexFile *hex_file, guint64 start, guint64 len, RPHexView *hex_view);
 
 G_DEFINE_TYPE_WITH_CODE (RPHexView, rp_hex_view, GTK_TYPE_WIDGET, G_ADD_PRIVATE (RPHexView)
                          G_IMPLEMENT_INTERFACE (GTK_TYPE_SCROLLABLE, NULL))
@@ -207,7 +219,9 @@ static GActionEntry context_menu_entries[] = {
 	{ "copy", rp_hex_view_context_menu_copy, NULL, NULL, NULL },
 	{ "paste", rp_hex_view_context_menu_paste, NULL, NULL, NULL },
 	{ "delete", rp_hex_view_context_menu_delete, NULL, NULL, NULL },
-	{ "select-all", rp_hex_view_context_menu_select_all, NULL, NULL, NULL }
+	{ "select-all", rp_hex_view_context_menu_select_all, NULL, NULL, NULL },
+	{ "undo", rp_hex_view_context_menu_undo, NULL, NULL, NULL },
+	{ "redo", rp_hex_view_context_menu_redo, NULL, NULL, NULL }
 };
 
 static void rp_hex_view_class_init (RPHexViewClass *klass)
@@ -224,6 +238,8 @@ static void rp_hex_view_class_init (RPHexViewClass *klass)
 	klass->edit_paste					= rp_hex_view_edit_paste;
 	klass->edit_delete					= rp_hex_view_edit_delete;
 	klass->edit_select_all				= rp_hex_view_edit_select_all;
+	klass->edit_undo					= rp_hex_view_edit_undo;
+	klass->edit_redo					= rp_hex_view_edit_redo;
 
 	gobject_class->set_property 		= rp_hex_view_set_property;
 	gobject_class->get_property 		= rp_hex_view_get_property;
@@ -313,6 +329,26 @@ static void rp_hex_view_class_init (RPHexViewClass *klass)
 										G_TYPE_NONE,
 										0);
 
+	class_signals[EDIT_UNDO] = g_signal_new ("edit_undo",
+										G_TYPE_FROM_CLASS (widget_class),
+					  					G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+					  					G_STRUCT_OFFSET (RPHexViewClass, edit_undo),
+					  					NULL,
+										NULL,
+										NULL,
+										G_TYPE_NONE,
+										0);
+
+	class_signals[EDIT_REDO] = g_signal_new ("edit_redo",
+										G_TYPE_FROM_CLASS (widget_class),
+					  					G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+					  					G_STRUCT_OFFSET (RPHexViewClass, edit_redo),
+					  					NULL,
+										NULL,
+										NULL,
+										G_TYPE_NONE,
+										0);
+
 	
 	gtk_widget_class_set_accessible_role (widget_class, ATK_ROLE_TEXT);
 
@@ -322,6 +358,9 @@ static void rp_hex_view_class_init (RPHexViewClass *klass)
 	gtk_binding_entry_add_signal (binding_set, GDK_KEY_c, GDK_CONTROL_MASK, "edit_copy", 0);
 	gtk_binding_entry_add_signal (binding_set, GDK_KEY_v, GDK_CONTROL_MASK, "edit_paste", 0);
 	gtk_binding_entry_add_signal (binding_set, GDK_KEY_a, GDK_CONTROL_MASK, "edit_select_all", 0);
+	gtk_binding_entry_add_signal (binding_set, GDK_KEY_z, GDK_CONTROL_MASK, "edit_undo", 0);
+	gtk_binding_entry_add_signal (binding_set, GDK_KEY_y, GDK_CONTROL_MASK, "edit_redo", 0);
+	gtk_binding_entry_add_signal (binding_set, GDK_KEY_z, GDK_CONTROL_MASK | GDK_SHIFT_MASK, "edit_redo", 0);
 	
 	/* GtkScrollable interface */
 	g_object_class_override_property (gobject_class, PROP_HADJUSTMENT,    "hadjustment");
@@ -402,6 +441,9 @@ static void rp_hex_view_init (RPHexView *hex_view)
 	priv->bDrawAddresses	= TRUE;
 	priv->bAutoBytesPerRow	= TRUE;
 	priv->bDrawCharacters	= TRUE;	
+	priv->bFollow			= FALSE;
+	priv->iPrefetchViewports = RP_HEX_VIEW_DEFAULT_PREFETCH;
+	priv->iScrollVelocity	= 0;
 
 	priv->hex_file			= NULL;
 	priv->bIsOvertype		= TRUE;
@@ -435,6 +477,15 @@ GtkWidget* rp_hex_view_new_with_file (RPHexFile *hex_file)
 	priv->hex_file = hex_file;
 	priv->iFileSize = rp_hex_file_get_size (priv->hex_file);
 
+	g_signal_connect (G_OBJECT(hex_file), "data_changed",
+                     G_CALLBACK(rp_hex_view_data_changed), hex_view);
+
+	g_signal_connect (G_OBJECT(hex_file), "disk_changed",
+                     G_CALLBACK(rp_hex_view_disk_changed), hex_view);
+
+	g_signal_connect (G_OBJECT(hex_file), "data_appended",
+                     G_CALLBACK(rp_hex_view_data_appended), hex_view);
+
 	return widget;
 }
 
@@ -506,6 +557,9 @@ static void rp_hex_view_dispose (GObject *object)
 		priv->selection = NULL;
 	}
 
+	if (priv->hex_file)
+		g_signal_handlers_disconnect_by_data (priv->hex_file, hex_view);
+
 	priv->hex_file = NULL;
 }
 
@@ -659,8 +713,22 @@ static void rp_hex_view_size_allocate (GtkWidget *widget, GtkAllocation *allocat
   	}
 }
 
+/* Number of hex digits needed for the highest address, at least 8 */
+static gint rp_hex_view_address_width (guint64 iFileSize)
+{
+	guint64	iLastByte	= (iFileSize == 0) ? 0 : iFileSize - 1;
+	gint	iWidth		= 8;
+
+	while (iWidth < 16 && (iLastByte >> (iWidth * 4)) != 0)
+		iWidth++;
+
+	return iWidth;
+}
+
 static void rp_hex_view_update_layout (RPHexViewPrivate *priv)
 {
+	priv->iAddressWidth		= rp_hex_view_address_width (priv->iFileSize);
+
 	priv->rectClient.x		= 0;
 	priv->rectClient.y		= 0;
 	priv->rectClient.width	= gdk_window_get_width(priv->hex_window);
@@ -723,7 +791,7 @@ static void rp_hex_view_update_layout (RPHexViewPrivate *priv)
 
 	priv->iRows	= priv->iFileSize / priv->iBytesPerLine;
 		
-	if (priv->iRows % priv->iBytesPerLine != 0)
+	if (priv->iFileSize % priv->iBytesPerLine != 0)
     	priv->iRows++;
 	
 	priv->iCols = priv->iBytesPerLine * 3;
@@ -802,7 +870,7 @@ static void rp_hex_view_update_layout_print (RPHexViewPrivate *priv, GtkPrintCon
 	priv->iPrintMaxVisibleBytes	= priv->iPrintBytesPerLine * iMaxHexVBytes;
 	priv->iPrintRows			= priv->iFileSize / priv->iPrintBytesPerLine;
 		
-	if (priv->iPrintRows % priv->iPrintBytesPerLine != 0)
+	if (priv->iFileSize % priv->iPrintBytesPerLine != 0)
     	priv->iPrintRows++;
 
 	priv->iPrintPages = priv->iPrintRows / iMaxHexVBytes;
@@ -819,10 +887,10 @@ static void rp_hex_view_update_byte_visibility (RPHexViewPrivate *priv)
 	if (priv->iFileSize == 0)
     	return;
 
-    guint32 vadjPos = (guint32)gtk_adjustment_get_value (priv->vadjustment);
+    guint64 vadjPos = (guint64)gtk_adjustment_get_value (priv->vadjustment);
 
 	priv->iStartByte = (vadjPos + 1) * priv->iBytesPerLine - priv->iBytesPerLine;
-	priv->iEndByte = (guint32)MIN (priv->iFileSize - 1, 
+	priv->iEndByte = (guint64)MIN (priv->iFileSize - 1, 
 									priv->iStartByte + 
 									priv->iMaxVisibleBytes - 1);
 }
@@ -835,7 +903,7 @@ static void rp_hex_view_update_byte_visibility_print (RPHexViewPrivate *priv)
 	priv->iPrintStartByte = (priv->iPrintTopRow + 1) * 
 							priv->iPrintBytesPerLine - 
 							priv->iPrintBytesPerLine;
-	priv->iPrintEndByte	= (guint32)MIN (priv->iFileSize - 1, 
+	priv->iPrintEndByte	= (guint64)MIN (priv->iFileSize - 1, 
 							priv->iPrintStartByte + 
 							priv->iPrintMaxVisibleBytes - 1);
 }
@@ -871,7 +939,7 @@ static gboolean rp_hex_view_draw (GtkWidget *widget, cairo_t *cr)
 
 static void rp_hex_view_draw_address_lines (RPHexViewPrivate *priv, cairo_t *cr)
 {
-	gchar sAddrLine[9];
+	gchar sAddrLine[17];
 
 	// paint addresses background
 	cairo_set_source_rgb (cr, priv->cAddressBg.red, priv->cAddressBg.green, priv->cAddressBg.blue);
@@ -887,7 +955,8 @@ static void rp_hex_view_draw_address_lines (RPHexViewPrivate *priv, cairo_t *cr)
 
 	for (gint i = 0; i < priv->iLastRow; i++)
 	{
-    	g_snprintf (sAddrLine, sizeof(sAddrLine), "%08X", (priv->iTopRow + i) * priv->iBytesPerLine);
+    	g_snprintf (sAddrLine, sizeof(sAddrLine), "%0*" G_GINT64_MODIFIER "X", priv->iAddressWidth, 
+					(priv->iTopRow + i) * priv->iBytesPerLine);
 		cairo_move_to (cr, priv->rectAddresses.x + priv->iCharWidth / 2, i * priv->iCharHeight);
   		pango_layout_set_text (priv->pLayout, sAddrLine, priv->iAddressWidth);
     	pango_cairo_show_layout (cr, priv->pLayout);
@@ -896,7 +965,7 @@ static void rp_hex_view_draw_address_lines (RPHexViewPrivate *priv, cairo_t *cr)
 
 static void rp_hex_view_draw_address_lines_print (RPHexViewPrivate *priv, cairo_t *cr)
 {
-	gchar sAddrLine[9];
+	gchar sAddrLine[17];
 
 	// paint addresses background
 	cairo_set_source_rgb (cr, priv->cAddressBg.red, priv->cAddressBg.green, priv->cAddressBg.blue);
@@ -912,7 +981,8 @@ static void rp_hex_view_draw_address_lines_print (RPHexViewPrivate *priv, cairo_
 
 	for (gint i = 0; i < priv->iPrintLastRow; i++)
 	{
-    	g_snprintf (sAddrLine, sizeof(sAddrLine), "%08X", (priv->iPrintTopRow + i) * priv->iPrintBytesPerLine);
+    	g_snprintf (sAddrLine, sizeof(sAddrLine), "%0*" G_GINT64_MODIFIER "X", priv->iAddressWidth, 
+					(priv->iPrintTopRow + i) * priv->iPrintBytesPerLine);
 		cairo_move_to (cr, priv->rectPrintAddresses.x + priv->iPrintCharWidth / 2, i * priv->iPrintCharHeight);
   		pango_layout_set_text (priv->pPrintLayout, sAddrLine, priv->iAddressWidth);
     	pango_cairo_show_layout (cr, priv->pPrintLayout);
@@ -924,9 +994,9 @@ static void rp_hex_view_draw_hex_lines (RPHexViewPrivate *priv, cairo_t *cr)
 	guchar 	hByte[3];
 	guchar 	aByte[2] = "\0\0";
 	gint 	row, column;
-	guint32 tmpEndByte = MIN ((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1, priv->iEndByte);
-	guint32 bytesToRead = tmpEndByte - priv->iStartByte + 1;
-	guint32 bytesRead = 0;
+	guint64 tmpEndByte = MIN ((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1, priv->iEndByte);
+	gsize	bytesToRead = tmpEndByte - priv->iStartByte + 1;
+	gsize	bytesRead = 0;
 	guchar  *buffer = g_try_malloc0 (bytesToRead);
 
 	g_assert (buffer != NULL);
@@ -947,7 +1017,7 @@ static void rp_hex_view_draw_hex_lines (RPHexViewPrivate *priv, cairo_t *cr)
 
 	g_return_if_fail (bytesRead == bytesToRead);
 
-	for (guint32 i = priv->iStartByte; i <= tmpEndByte; i++)
+	for (guint64 i = priv->iStartByte; i <= tmpEndByte; i++)
 	{
 		row		= i / priv->iBytesPerLine - priv->iTopRow;
 		column	= (i - priv->iTopRow * priv->iBytesPerLine) - row * priv->iBytesPerLine;
@@ -975,9 +1045,9 @@ static void rp_hex_view_draw_hex_lines_print (RPHexViewPrivate *priv, cairo_t *c
 	guchar 	hByte[3];
 	guchar 	aByte[2] = "\0\0";
 	gint 	row, column;
-	guint32 tmpEndByte = MIN ((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1, priv->iPrintEndByte);
-	guint32 bytesToRead = tmpEndByte - priv->iPrintStartByte;
-	guint32 bytesRead = 0;
+	guint64 tmpEndByte = MIN ((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1, priv->iPrintEndByte);
+	gsize	bytesToRead = tmpEndByte - priv->iPrintStartByte;
+	gsize	bytesRead = 0;
 	guchar  *buffer = g_try_malloc0 (bytesToRead);
 
 	g_assert (buffer != NULL);
@@ -998,7 +1068,7 @@ static void rp_hex_view_draw_hex_lines_print (RPHexViewPrivate *priv, cairo_t *c
 
 	g_return_if_fail (bytesRead == bytesToRead);
 
-	for (guint32 i = priv->iPrintStartByte; i <= tmpEndByte; i++)
+	for (guint64 i = priv->iPrintStartByte; i <= tmpEndByte; i++)
 	{
 		row		= i / priv->iPrintBytesPerLine - priv->iPrintTopRow;
 		column	= (i - priv->iPrintTopRow * priv->iPrintBytesPerLine) - row * priv->iPrintBytesPerLine;
@@ -1026,24 +1096,31 @@ static void rp_hex_view_draw_selection (RPHexViewPrivate *priv, cairo_t *cr)
 	if (priv->selection->startSel < 0 || priv->selection->endSel < 0)
 		return;
 
-	guint32 selStart	= MIN (priv->selection->startSel, G_MAXUINT32);
-	guint32 selEnd		= MIN (priv->selection->endSel, G_MAXUINT32);
+	guint64 selStart	= priv->selection->startSel;
+	guint64 selEnd		= priv->selection->endSel;
 
 	if (selStart > selEnd)
 	{
 		selStart	= selEnd;
-		selEnd		= MIN (priv->selection->startSel, G_MAXUINT32);
+		selEnd		= priv->selection->startSel;
 	}
 
+	gint64 first_row	= (gint64)(selStart / priv->iBytesPerLine) - (gint64)priv->iTopRow;
+	gint64 last_row		= (gint64)(selEnd / priv->iBytesPerLine) - (gint64)priv->iTopRow;
+
+	// Nothing of the selection is on screen
+	if (last_row < 0 || first_row > priv->iVisibleRows)
+		return;
+
 	gdk_cairo_set_source_rgba (cr, &priv->cAddressFg);
 	cairo_set_operator (cr, CAIRO_OPERATOR_DARKEN);
 
 	gint max_column 	= priv->iBytesPerLine * 3 - 1;
 	gint max_column_ch	= priv->iBytesPerLine;
-	gint start_row		= selStart / priv->iBytesPerLine - priv->iTopRow;
-	gint start_column	= (selStart - priv->iTopRow * priv->iBytesPerLine) - start_row * priv->iBytesPerLine;
-	gint end_row		= selEnd / priv->iBytesPerLine - priv->iTopRow;
-	gint end_column		= (selEnd - priv->iTopRow * priv->iBytesPerLine) - (end_row * priv->iBytesPerLine);
+	gint start_row		= (gint)MAX (first_row, 0);
+	gint start_column	= (first_row < 0) ? 0 : (gint)(selStart % priv->iBytesPerLine);
+	gint end_row		= (gint)MIN (last_row, priv->iVisibleRows);
+	gint end_column		= (last_row > priv->iVisibleRows) ? priv->iBytesPerLine - 1 : (gint)(selEnd % priv->iBytesPerLine);
 
 	for (gint i = start_row; i <= end_row; i++)
 	{
@@ -1076,8 +1153,12 @@ static void rp_hex_view_draw_cursor (RPHexViewPrivate *priv, cairo_t *cr)
 	gchar 	hByte[3];
 	guchar 	aByte[2] = "\0\0";
 	guchar 	sByte[1] = "\0";
-	gint 	start_row		= priv->iBytePos / priv->iBytesPerLine - priv->iTopRow;
-	gint 	start_column	= (priv->iBytePos - priv->iTopRow * priv->iBytesPerLine) - start_row * priv->iBytesPerLine;
+	gint64	cursor_row		= (gint64)(priv->iBytePos / priv->iBytesPerLine) - (gint64)priv->iTopRow;
+	gint 	start_row		= (gint)cursor_row;
+	gint 	start_column	= (gint)(priv->iBytePos % priv->iBytesPerLine);
+
+	if (cursor_row < 0 || cursor_row > priv->iVisibleRows)
+		return;
 
 	rp_hex_file_get_data (priv->hex_file, sByte, 1, priv->iBytePos);
 
@@ -1289,6 +1370,44 @@ static void rp_hex_view_set_vadjustment_values (RPHexView *hex_view)
 								priv->iVisibleRows);
 }
 
+/* Read ahead where the user is scrolling to, so the next screens don't
+ * wait for the disk in rp_hex_view_draw. The next few viewports are
+ * extrapolated from the recent scroll speed, at least a screenful apart.
+ */
+static void rp_hex_view_prefetch (RPHexViewPrivate *priv, gint64 iNewTop, gint64 iDelta)
+{
+	guint64	iStep;
+	gint64	iRow;
+
+	if (priv->hex_file == NULL || iDelta == 0 || priv->iPrefetchViewports == 0)
+		return;
+
+	// Smooth out uneven steps, start over when the direction changes
+	if ((iDelta > 0) == (priv->iScrollVelocity > 0))
+		priv->iScrollVelocity = (priv->iScrollVelocity + iDelta) / 2;
+	else
+		priv->iScrollVelocity = iDelta;
+
+	iStep = MAX ((guint64)ABS (priv->iScrollVelocity), (guint64)MAX (priv->iVisibleRows, 1));
+
+	rp_hex_file_cancel_prefetch (priv->hex_file);
+
+	for (guint i = 1; i <= priv->iPrefetchViewports; i++)
+	{
+		iRow = iNewTop + (iDelta > 0 ? 1 : -1) * (gint64)(i * iStep);
+
+		if (iRow < 0)
+			iRow = 0;
+		else if ((guint64)iRow >= priv->iRows)
+			break;
+
+		rp_hex_file_prefetch (priv->hex_file, (guint64)iRow * priv->iBytesPerLine, priv->iMaxVisibleBytes);
+
+		if (iRow == 0)
+			break;
+	}
+}
+
 static void rp_hex_view_scroll_value_changed (GtkAdjustment *adjustment, RPHexView *hex_view)
 {
 	RPHexViewPrivate *priv;
@@ -1297,19 +1416,20 @@ static void rp_hex_view_scroll_value_changed (GtkAdjustment *adjustment, RPHexVi
 
 	priv = hex_view->priv;
   
-	gint iMoveDiff = 0;
-	gint iNewValue = (gint)gtk_adjustment_get_value(adjustment);
+	gint64 iMoveDiff = 0;
+	gint64 iNewValue = (gint64)gtk_adjustment_get_value(adjustment);
 
 	if (adjustment == priv->vadjustment)
 	{
-    	iMoveDiff = (priv->iTopRow - iNewValue) * priv->iCharHeight;
+		rp_hex_view_prefetch (priv, iNewValue, iNewValue - (gint64)priv->iTopRow);
+    	iMoveDiff = ((gint64)priv->iTopRow - iNewValue) * priv->iCharHeight;
     	priv->iTopRow = iNewValue;
   	}
 
 	if (adjustment == priv->hadjustment)
 	{
 		iMoveDiff = (priv->iLeftCol - iNewValue) * priv->iCharWidth;
-    	priv->iLeftCol = iNewValue;
+    	priv->iLeftCol = (gint)iNewValue;
 	}
 
 	rp_hex_view_update_layout(priv);
@@ -1319,7 +1439,7 @@ static gboolean rp_hex_view_button_callback (GtkWidget *widget, GdkEventButton *
 {
 	RPHexView			*hex_view;
 	RPHexViewPrivate	*priv;
-	guint32 			curPos = 0;
+	guint64 			curPos = 0;
 
 	hex_view = RP_HEX_VIEW (widget);
 	priv = hex_view->priv;
@@ -1364,7 +1484,7 @@ static gboolean rp_hex_view_motion_callback	(GtkWidget *widget, GdkEventMotion *
 {
 	RPHexView			*hex_view;
 	RPHexViewPrivate	*priv;
-	guint32 			curPos = 0;
+	guint64 			curPos = 0;
 
 	hex_view = RP_HEX_VIEW (widget);
 	priv = hex_view->priv;
@@ -1373,8 +1493,8 @@ static gboolean rp_hex_view_motion_callback	(GtkWidget *widget, GdkEventMotion *
 
 	if (priv->bLButttonDown)
 	{
-		glong selStart	= priv->selection->startSel;
-		glong selEnd	= priv->selection->endSel;
+		gint64 selStart	= priv->selection->startSel;
+		gint64 selEnd	= priv->selection->endSel;
 
 		priv->bSelecting = TRUE;
 		curPos = rp_hex_view_bytepos_from_point (priv, event->x, event->y, TRUE);
@@ -1396,7 +1516,7 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 	RPHexView			*hex_view;
 	RPHexViewPrivate	*priv;
 	gboolean 			ret = FALSE;
-	guint32 			clampFileSize;
+	gint64 				clampFileSize;
 
 	hex_view = RP_HEX_VIEW (widget);
 	priv = hex_view->priv;
@@ -1417,27 +1537,33 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 		switch(event->keyval)
 		{
 			case GDK_KEY_Up:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos - priv->iBytesPerLine, 0, clampFileSize));
+				rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos - priv->iBytesPerLine, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Down:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos + priv->iBytesPerLine, 0, clampFileSize));
+				rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos + priv->iBytesPerLine, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Left:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos - 1, 0, clampFileSize));
+				rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos - 1, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Right:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos + 1, 0, clampFileSize));
+				rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos + 1, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Page_Up:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos - priv->iVisibleRows * priv->iBytesPerLine, 0, clampFileSize));
+				if (event->state & GDK_CONTROL_MASK)
+					rp_hex_view_goto_data (widget, FALSE);
+				else
+					rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos - priv->iVisibleRows * priv->iBytesPerLine, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Page_Down:
-				rp_hex_view_set_cursor(widget, CLAMP ((glong)priv->iBytePos + (glong)priv->iVisibleRows * priv->iBytesPerLine, 0, clampFileSize));
+				if (event->state & GDK_CONTROL_MASK)
+					rp_hex_view_goto_data (widget, TRUE);
+				else
+					rp_hex_view_set_cursor(widget, CLAMP ((gint64)priv->iBytePos + (gint64)priv->iVisibleRows * priv->iBytesPerLine, 0, clampFileSize));
 				ret = TRUE;
 				break;
 			case GDK_KEY_Tab:
@@ -1464,6 +1590,13 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 					return TRUE;
 				}
 
+				if (rp_hex_file_is_busy (priv->hex_file))
+				{
+					g_message("Editing not allowed while saving.");
+					gdk_display_beep (gdk_display_get_default());
+					return TRUE;
+				}
+
 				if (priv->bIsOvertype && priv->selection->startSel != priv->selection->endSel)
 				{
 					g_message("Deleting not allowed in Overtype mode.");
@@ -1478,6 +1611,9 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 					return TRUE;
 				}
 
+				// Typing over a selection is undone in one step
+				rp_hex_file_begin_user_action (priv->hex_file);
+
 				if (rp_hex_view_has_selection (widget))
         		{
             		rp_hex_file_change_data (priv->hex_file,
@@ -1485,6 +1621,7 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 											priv->selection->startSel,
 											priv->selection->endSel - priv->selection->startSel,
 											NULL, 0);
+					priv->num_entered = 0;
         		}
 
 				if (priv->cursorArea == AREA_TEXT)
@@ -1496,7 +1633,7 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 											&cc, 
 											priv->num_entered);
 					
-					rp_hex_view_set_cursor (widget, CLAMP ((glong)priv->iBytePos + 1, 0, clampFileSize));
+					rp_hex_view_set_cursor (widget, CLAMP ((gint64)priv->iBytePos + 1, 0, clampFileSize));
 					priv->num_entered += 2;
 					ret = TRUE;
 				}
@@ -1536,11 +1673,13 @@ static gboolean rp_hex_view_key_press_callback(GtkWidget *widget, GdkEventKey *e
 											priv->num_entered);
 
 						priv->num_entered++;
-						rp_hex_view_set_cursor (widget, CLAMP ((glong)priv->iBytePos + 1, 0, clampFileSize));
+						rp_hex_view_set_cursor (widget, CLAMP ((gint64)priv->iBytePos + 1, 0, clampFileSize));
 					}
 
 					ret = TRUE;
 				}
+
+				rp_hex_file_end_user_action (priv->hex_file);
 		}
 	}
 
@@ -1598,7 +1737,7 @@ static void rp_hex_view_remove_selection (GtkWidget *widget)
 	}
 }
 
-static void rp_hex_view_set_selection (GtkWidget *widget, glong selStartPos, glong selEndPos)
+static void rp_hex_view_set_selection (GtkWidget *widget, gint64 selStartPos, gint64 selEndPos)
 {
 	RPHexView			*hex_view;
 	RPHexViewPrivate	*priv;
@@ -1612,19 +1751,19 @@ static void rp_hex_view_set_selection (GtkWidget *widget, glong selStartPos, glo
 
 	if (selStartPos == -1) selStartPos = selEndPos;
 
-	guint32 selStart	= CLAMP((glong)selStartPos, 0, (priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1);
-	guint32 selEnd		= CLAMP((glong)selEndPos, 0, (priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1);
+	guint64 selStart	= CLAMP(selStartPos, 0, (gint64)((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1));
+	guint64 selEnd		= CLAMP(selEndPos, 0, (gint64)((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1));
 
 	priv->iBytePos				= selEnd;
 	priv->selection->startSel 	= selStart;
 	priv->selection->endSel		= selEnd;
 }
 
-static void rp_hex_view_set_cursor (GtkWidget *widget, guint32 newPos)
+static void rp_hex_view_set_cursor (GtkWidget *widget, guint64 newPos)
 {
 	RPHexView			*hex_view;
 	RPHexViewPrivate	*priv;
-	guint32				oldBytePos;
+	guint64				oldBytePos;
 
 	hex_view = RP_HEX_VIEW (widget);
 	priv = hex_view->priv;
@@ -1676,27 +1815,26 @@ static void rp_hex_view_update_cursor_area (RPHexViewPrivate *priv, gdouble posX
 	}
 }
 
-static void rp_hex_view_scroll_byte_into_view (RPHexViewPrivate *priv, guint32 curPos)
+static void rp_hex_view_scroll_byte_into_view (RPHexViewPrivate *priv, guint64 curPos)
 {
-	gint	sel_row = curPos / priv->iBytesPerLine - priv->iTopRow + 1;
-	gdouble value	= gtk_adjustment_get_value (priv->vadjustment);
+	guint64	cur_row = curPos / priv->iBytesPerLine;
 
-	if (sel_row > priv->iVisibleRows)
+	if (cur_row + 1 > priv->iTopRow + priv->iVisibleRows)
 	{
-		gtk_adjustment_set_value (priv->vadjustment, value + sel_row - priv->iVisibleRows);
+		gtk_adjustment_set_value (priv->vadjustment, (gdouble)(cur_row + 1 - priv->iVisibleRows));
 	}
 
 	if (curPos < priv->iStartByte)
 	{
-		gtk_adjustment_set_value (priv->vadjustment, value - 1);
+		gtk_adjustment_set_value (priv->vadjustment, (gdouble)cur_row);
 	}
 }
 
-static guint32 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv, 
+static guint64 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv, 
 												gdouble posX, gdouble posY, gboolean bSnap)
 {
 	gint xPos, yPos = 0;
-	glong newPos 	= 0;
+	gint64 newPos 	= 0;
 
 	rp_hex_view_update_cursor_area (priv, posX, posY);
 
@@ -1711,9 +1849,9 @@ static guint32 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv,
 		
 		if (posY < 0) yPos -= 1;
 
-		newPos = CLAMP ((glong)priv->iStartByte + priv->iBytesPerLine * yPos + xPos,
+		newPos = CLAMP ((gint64)priv->iStartByte + priv->iBytesPerLine * yPos + xPos,
 						0,
-						(priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1);
+						(gint64)((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1));
 	}
 
 	if (priv->cursorArea == AREA_TEXT)
@@ -1723,9 +1861,9 @@ static guint32 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv,
 
 		if (posY < 0) yPos -= 1;
 
-		newPos = CLAMP ((glong)priv->iStartByte + priv->iBytesPerLine * yPos + xPos,
+		newPos = CLAMP ((gint64)priv->iStartByte + priv->iBytesPerLine * yPos + xPos,
 						0,
-						(priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1);
+						(gint64)((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1));
 	}
 
 	if (priv->cursorArea == AREA_ADDRESS)
@@ -1734,9 +1872,9 @@ static guint32 rp_hex_view_bytepos_from_point (RPHexViewPrivate *priv,
 
 		if (posY < 0) yPos -= 1;
 
-		newPos = CLAMP ((glong)priv->iStartByte + priv->iBytesPerLine * yPos,
+		newPos = CLAMP ((gint64)priv->iStartByte + priv->iBytesPerLine * yPos,
 						0,
-						(priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1);
+						(gint64)((priv->iFileSize == 0) ? priv->iFileSize : priv->iFileSize - 1));
 	}
 	
 	if (bSnap)
@@ -1785,6 +1923,14 @@ static void rp_hex_view_context_menu_update_actions (RPHexView *hex_view)
 	GAction	*action_select_all = g_action_map_lookup_action (G_ACTION_MAP (priv->action_group_context_menu), 
 														context_menu_entries[4].name);
 	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_select_all), TRUE);
+
+	GAction	*action_undo = g_action_map_lookup_action (G_ACTION_MAP (priv->action_group_context_menu), 
+														context_menu_entries[5].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_undo), rp_hex_file_can_undo (priv->hex_file));
+
+	GAction	*action_redo = g_action_map_lookup_action (G_ACTION_MAP (priv->action_group_context_menu), 
+														context_menu_entries[6].name);
+	g_simple_action_set_enabled (G_SIMPLE_ACTION (action_redo), rp_hex_file_can_redo (priv->hex_file));
 }
 
 static void rp_hex_view_context_menu_show (GtkWidget *widget, GdkEventButton *event)
@@ -1934,6 +2080,30 @@ static void rp_hex_view_context_menu_select_all (GSimpleAction *action, GVariant
 	rp_hex_view_edit_select_all (hex_view);
 }
 
+static void rp_hex_view_context_menu_undo (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	g_message ("Widget: called Context menu - undo");
+	RPHexView *hex_view;
+
+	hex_view  = RP_HEX_VIEW (data);
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	rp_hex_view_edit_undo (hex_view);
+}
+
+static void rp_hex_view_context_menu_redo (GSimpleAction *action, GVariant *parameter, gpointer data)
+{
+	g_message ("Widget: called Context menu - redo");
+	RPHexView *hex_view;
+
+	hex_view  = RP_HEX_VIEW (data);
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	rp_hex_view_edit_redo (hex_view);
+}
+
 static void rp_hex_view_clipboard_set_data (GtkClipboard *clipboard, GtkSelectionData *data, 
 											guint info, gpointer user_data)
 {
@@ -1941,8 +2111,8 @@ static void rp_hex_view_clipboard_set_data (GtkClipboard *clipboard, GtkSelectio
 	RPHexViewPrivate	*priv;
 	RPHexView 			*hex_view = RP_HEX_VIEW (user_data);
 	guint8 				iByte;
-	gint				iLen;
-	guint32 			bytesRead = 0;
+	gint64				iLen;
+	gsize 				bytesRead = 0;
 	gpointer			clipdata;
 
 	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
@@ -1950,9 +2120,14 @@ static void rp_hex_view_clipboard_set_data (GtkClipboard *clipboard, GtkSelectio
 	priv = hex_view->priv;
 
 	iLen 		= priv->selection->clipboard_endSel - priv->selection->clipboard_startSel + 1;
+
+	// GtkSelectionData can't hold more than G_MAXINT bytes
+	if (iLen <= 0 || iLen > G_MAXINT)
+		return;
+
 	clipdata	= g_try_malloc0 (iLen);
 	
-	if (clipdata == NULL || iLen <= 0 )
+	if (clipdata == NULL)
 		return;
 
 	bytesRead = rp_hex_file_get_data (priv->hex_file, clipdata, iLen, priv->selection->clipboard_startSel);
@@ -2083,6 +2258,135 @@ static void rp_hex_view_edit_select_all (RPHexView *hex_view)
 	gtk_widget_queue_draw (GTK_WIDGET (hex_view));
 }
 
+static void rp_hex_view_edit_undo (RPHexView *hex_view)
+{
+	g_message ("Widget: called edit - undo");
+	RPHexViewPrivate	*priv;
+	guint64				address = 0;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv = hex_view->priv;
+
+	if (priv->hex_file == NULL || !rp_hex_file_undo (priv->hex_file, &address))
+	{
+		gdk_display_beep (gdk_display_get_default());
+		return;
+	}
+
+	// Move to the place that changed
+	priv->bSelecting	= FALSE;
+	priv->num_entered	= priv->num_del = priv->num_bs = 0;
+	rp_hex_view_set_cursor (GTK_WIDGET (hex_view), address);
+}
+
+static void rp_hex_view_edit_redo (RPHexView *hex_view)
+{
+	g_message ("Widget: called edit - redo");
+	RPHexViewPrivate	*priv;
+	guint64				address = 0;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv = hex_view->priv;
+
+	if (priv->hex_file == NULL || !rp_hex_file_redo (priv->hex_file, &address))
+	{
+		gdk_display_beep (gdk_display_get_default());
+		return;
+	}
+
+	priv->bSelecting	= FALSE;
+	priv->num_entered	= priv->num_del = priv->num_bs = 0;
+	rp_hex_view_set_cursor (GTK_WIDGET (hex_view), address);
+}
+
+/* The document was modified, by us or through undo/redo */
+static void rp_hex_view_data_changed (RPHexFile *hex_file, gboolean bModified, RPHexView *hex_view)
+{
+	RPHexViewPrivate	*priv;
+	GtkWidget			*widget;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv	= hex_view->priv;
+	widget	= GTK_WIDGET (hex_view);
+
+	priv->iFileSize	= rp_hex_file_get_size (hex_file);
+	priv->iBytePos	= (priv->iFileSize == 0) ? 0 : MIN (priv->iBytePos, priv->iFileSize - 1);
+
+	if (rp_hex_view_has_selection (widget) &&
+		MAX (priv->selection->startSel, priv->selection->endSel) >= (gint64)priv->iFileSize)
+		rp_hex_view_remove_selection (widget);
+
+	if (gtk_widget_get_realized (widget))
+	{
+		rp_hex_view_update_layout (priv);
+		rp_hex_view_set_hadjustment_values (hex_view);
+		rp_hex_view_set_vadjustment_values (hex_view);
+	}
+
+	gtk_widget_queue_draw (widget);
+}
+
+/* Bytes of the document were changed on disk by someone else, only worth
+ * a redraw if they are on screen.
+ */
+static void rp_hex_view_disk_changed (RPHexFile *hex_file, guint64 start, guint64 len, RPHexView *hex_view)
+{
+	RPHexViewPrivate	*priv;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv = hex_view->priv;
+
+	if (len > 0 && start <= priv->iEndByte && start + len > priv->iStartByte)
+		gtk_widget_queue_draw (GTK_WIDGET (hex_view));
+}
+
+/* The file grew while following it. Only the row count changes, unless
+ * the addresses need another digit. If the last row was on screen the
+ * view moves along with the end of the file.
+ */
+static void rp_hex_view_data_appended (RPHexFile *hex_file, guint64 start, guint64 len, RPHexView *hex_view)
+{
+	RPHexViewPrivate	*priv;
+	GtkWidget			*widget;
+	gboolean			bAtEnd;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv	= hex_view->priv;
+	widget	= GTK_WIDGET (hex_view);
+	bAtEnd	= priv->iTopRow + priv->iVisibleRows >= priv->iRows;
+
+	priv->iFileSize = rp_hex_file_get_size (hex_file);
+
+	if (!gtk_widget_get_realized (widget))
+		return;
+
+	if (rp_hex_view_address_width (priv->iFileSize) != priv->iAddressWidth)
+	{
+		rp_hex_view_update_layout (priv);
+		rp_hex_view_set_hadjustment_values (hex_view);
+	}
+	else
+	{
+		priv->iRows		= (priv->iFileSize + priv->iBytesPerLine - 1) / priv->iBytesPerLine;
+		priv->iLastRow	= CLAMP (priv->iVisibleRows, 1, MAX (priv->iRows, 1));
+	}
+
+	gtk_adjustment_set_upper (priv->vadjustment, priv->iRows);
+
+	if (priv->bFollow && bAtEnd && priv->iRows > priv->iVisibleRows)
+	{
+		gtk_adjustment_set_value (priv->vadjustment, priv->iRows - priv->iVisibleRows);
+		gtk_widget_queue_draw (widget);
+	}
+	else if (start < priv->iStartByte + priv->iMaxVisibleBytes)
+		gtk_widget_queue_draw (widget);
+}
+
 void rp_hex_view_print_begin_print (GtkPrintOperation *operation, GtkPrintContext *context, gpointer user_data)
 {
 	RPHexView         *hex_view;
@@ -2236,6 +2540,127 @@ void rp_hex_view_toggle_auto_fit (GtkWidget *widget, gboolean bEnable)
 	gtk_widget_queue_draw (GTK_WIDGET (hex_view));
 }
 
+void rp_hex_view_toggle_follow (GtkWidget *widget, gboolean bEnable)
+{
+	RPHexView			*hex_view;
+	RPHexViewPrivate	*priv;
+
+	hex_view = RP_HEX_VIEW (widget);
+	priv = hex_view->priv;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	priv->bFollow = bEnable;
+
+	if (bEnable && gtk_widget_get_realized (widget) && priv->iRows > priv->iVisibleRows)
+		gtk_adjustment_set_value (priv->vadjustment, priv->iRows - priv->iVisibleRows);
+
+	gtk_widget_queue_draw (widget);
+}
+
+/* Move the cursor to the start of the next or previous data extent,
+ * skipping the holes of a sparse file. Ctrl+Page Down/Up.
+ */
+void rp_hex_view_goto_data (GtkWidget *widget, gboolean bForward)
+{
+	RPHexView			*hex_view;
+	RPHexViewPrivate	*priv;
+	guint64				address = 0;
+	gboolean			bFound;
+
+	hex_view = RP_HEX_VIEW (widget);
+	priv = hex_view->priv;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	bFound = priv->hex_file != NULL && 
+			 (bForward ? rp_hex_file_next_data (priv->hex_file, priv->iBytePos, &address) :
+						 rp_hex_file_prev_data (priv->hex_file, priv->iBytePos, &address));
+
+	if (!bFound)
+	{
+		gdk_display_beep (gdk_display_get_default());
+		return;
+	}
+
+	rp_hex_view_set_cursor (widget, address);
+}
+
+/* Start of the selection, else the byte under the cursor */
+guint64 rp_hex_view_get_position (GtkWidget *widget)
+{
+	RPHexView			*hex_view;
+	RPHexViewPrivate	*priv;
+
+	hex_view = RP_HEX_VIEW (widget);
+	priv = hex_view->priv;
+
+	g_return_val_if_fail (RP_IS_HEX_VIEW (hex_view), 0);
+
+	if (rp_hex_view_has_selection (widget))
+		return MIN (priv->selection->startSel, priv->selection->endSel);
+
+	return priv->iBytePos;
+}
+
+/* Hex digits the addresses are drawn with, they grow with the file */
+gint rp_hex_view_get_address_width (GtkWidget *widget)
+{
+	RPHexView			*hex_view;
+	RPHexViewPrivate	*priv;
+
+	hex_view = RP_HEX_VIEW (widget);
+	priv = hex_view->priv;
+
+	g_return_val_if_fail (RP_IS_HEX_VIEW (hex_view), 8);
+
+	return rp_hex_view_address_width (priv->iFileSize);
+}
+
+/* Select len bytes at address with the cursor on the first one, and
+ * scroll them into view. Used to show search results.
+ */
+void rp_hex_view_select_range (GtkWidget *widget, guint64 address, guint64 len)
+{
+	RPHexView			*hex_view;
+	RPHexViewPrivate	*priv;
+
+	hex_view = RP_HEX_VIEW (widget);
+	priv = hex_view->priv;
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+	g_return_if_fail (len > 0);
+
+	rp_hex_view_set_selection (widget, address + len - 1, address);
+
+	if (priv->iBytePos < priv->iStartByte || address + len - 1 > priv->iEndByte)
+		rp_hex_view_scroll_byte_into_view (priv, priv->iBytePos);
+
+	priv->num_entered = priv->num_del = priv->num_bs = 0;
+
+	gtk_widget_queue_draw (widget);
+
+	g_signal_emit_by_name (G_OBJECT(hex_view), "byte_pos_changed", priv->iBytePos);
+	g_signal_emit_by_name (G_OBJECT(hex_view), "selection_changed");
+}
+
+/* Number of screens read ahead in the direction of scrolling, 0 turns
+ * prefetching off.
+ */
+void rp_hex_view_set_prefetch (GtkWidget *widget, guint iViewports)
+{
+	RPHexView			*hex_view;
+
+	hex_view = RP_HEX_VIEW (widget);
+
+	g_return_if_fail (RP_IS_HEX_VIEW (hex_view));
+
+	hex_view->priv->iPrefetchViewports = iViewports;
+
+	if (iViewports == 0 && hex_view->priv->hex_file != NULL)
+		rp_hex_file_cancel_prefetch (hex_view->priv->hex_file);
+}
+
 gboolean isMonospaceFont (guchar *font)
 {
 	return TRUE;
@@ -2299,4 +2724,18 @@ void rp_hex_view_toggle_print_font (GtkWidget *widget, guchar *font)
 		priv->pPrintFontDescription	= pango_font_description_from_string (DEFAULT_FONT);
 		priv->pPrintFontName = DEFAULT_FONT;
 	}
-}
\ No newline at end of file
+}
+
+void rp_hex_view_undo (GtkWidget *widget)
+{
+	g_return_if_fail (RP_IS_HEX_VIEW (widget));
+
+	g_signal_emit_by_name (G_OBJECT(widget), "edit_undo");
+}
+
+void rp_hex_view_redo (GtkWidget *widget)
+{
+	g_return_if_fail (RP_IS_HEX_VIEW (widget));
+
+	g_signal_emit_by_name (G_OBJECT(widget), "edit_redo");
+}
@@ -33,6 +33,8 @@ G_BEGIN_DECLS
 #define RP_IS_HEX_VIEW_CLASS(klass)	(G_TYPE_CHECK_CLASS_TYPE ((klass), RP_TYPE_HEX_VIEW))
 #define RP_HEX_VIEW_GET_CLASS(obj)	(G_TYPE_INSTANCE_GET_CLASS ((obj), RP_TYPE_HEX_VIEW, RPHexViewClass))
 
+#define RP_HEX_VIEW_DEFAULT_PREFETCH	4
+
 typedef enum
 {
 	RP_HEX_WINDOW_WIDGET = 1,
@@ -61,6 +63,8 @@ struct _RPHexViewClass
 	void (*edit_paste)			(RPHexView *);
 	void (*edit_delete)			(RPHexView *);
 	void (*edit_select_all)		(RPHexView *);
+	void (*edit_undo)			(RPHexView *);
+	void (*edit_redo)			(RPHexView *);
 };
 
 GType		rp_hex_view_get_type		(void) G_GNUC_CONST;
@@ -72,8 +76,16 @@ gboolean 	rp_hex_view_print 					(GtkWidget *widget, GtkWindow *parent, const gc
 void 		rp_hex_view_toggle_draw_addresses	(GtkWidget *widget, gboolean bEnable);
 void		rp_hex_view_toggle_draw_characters	(GtkWidget *widget, gboolean bEnable);
 void		rp_hex_view_toggle_auto_fit 		(GtkWidget *widget, gboolean bEnable);
+void		rp_hex_view_toggle_follow			(GtkWidget *widget, gboolean bEnable);
+void		rp_hex_view_set_prefetch			(GtkWidget *widget, guint iViewports);
+void		rp_hex_view_goto_data				(GtkWidget *widget, gboolean bForward);
+guint64		rp_hex_view_get_position			(GtkWidget *widget);
+gint		rp_hex_view_get_address_width		(GtkWidget *widget);
+void		rp_hex_view_select_range			(GtkWidget *widget, guint64 address, guint64 len);
 void		rp_hex_view_toggle_font 			(GtkWidget *widget, guchar *font);
 void		rp_hex_view_toggle_print_font		(GtkWidget *widget, guchar *font);
+void		rp_hex_view_undo					(GtkWidget *widget);
+void		rp_hex_view_redo					(GtkWidget *widget);
 
 G_END_DECLS
 
@@ -0,0 +1,515 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpjournal.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <glib/gstdio.h>
+#include "rpjournal.h"
+
+/* The file is the magic followed by batches. Every batch starts with its
+ * length and the crc32 of the records in it, a batch torn by a crash
+ * fails the check and replay stops in front of it.
+ */
+#define RP_JOURNAL_MAGIC		"RPJRNL01"
+#define RP_JOURNAL_HEADER_SIZE	(sizeof (guint64) + sizeof (guint32))
+#define RP_JOURNAL_HAS_DATA		0x80		// Operation byte flag, data follows the numbers
+
+struct _RPJournal
+{
+    gchar		*path;
+    gint		fd;				// Locked, -1 until the first batch is written
+    gboolean	disabled;		// Somebody else writes the journal of this file
+    GByteArray	*batch;			// Records not written yet
+    guint		timeout_id;
+};
+
+static gchar *rp_journal_state_dir (void)
+{
+#if GLIB_CHECK_VERSION (2, 72, 0)
+    return g_strdup (g_get_user_state_dir ());
+#else
+    const gchar *dir = g_getenv ("XDG_STATE_HOME");
+
+    if (dir != NULL && g_path_is_absolute (dir))
+        return g_strdup (dir);
+
+    return g_build_filename (g_get_home_dir (), ".local", "state", NULL);
+#endif
+}
+
+/* NULL if the file can't be looked at */
+RPJournal *rp_journal_new (const gchar *path)
+{
+    g_autofree gchar	*dir = NULL;
+    g_autofree gchar	*name = NULL;
+    RPJournal			*journal;
+    struct stat			st;
+
+    if (g_stat (path, &st) != 0)
+        return NULL;
+
+    dir  = rp_journal_state_dir ();
+    name = g_strdup_printf ("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%"
+                            G_GINT64_MODIFIER "x.%09ld.jnl", (guint64)st.st_dev, (guint64)st.st_ino,
+                            (guint64)st.st_size, (guint64)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+    journal = g_new0 (RPJournal, 1);
+
+    journal->path	= g_build_filename (dir, "hexviewer", "journal", name, NULL);
+    journal->fd		= -1;
+    journal->batch	= g_byte_array_new ();
+
+    return journal;
+}
+
+/* Writes what is pending, the file stays for the next start */
+void rp_journal_free (RPJournal *journal)
+{
+    GError *error = NULL;
+
+    if (journal == NULL)
+        return;
+
+    if (!rp_journal_flush (journal, &error))
+    {
+        g_message ("Journal: %s", error->message);
+        g_clear_error (&error);
+    }
+
+    if (journal->fd >= 0)
+        close (journal->fd);
+
+    g_byte_array_unref (journal->batch);
+    g_free (journal->path);
+    g_free (journal);
+}
+
+/* TRUE if an earlier session left records behind. A journal another
+ * window is writing doesn't count.
+ */
+gboolean rp_journal_exists (RPJournal *journal)
+{
+    struct stat	st;
+    gint		fd;
+    gboolean	bFree;
+
+    if (journal->fd >= 0 || g_stat (journal->path, &st) != 0 || 
+        st.st_size <= (goffset)strlen (RP_JOURNAL_MAGIC))
+        return FALSE;
+
+    fd = g_open (journal->path, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return FALSE;
+
+    bFree = flock (fd, LOCK_EX | LOCK_NB) == 0;
+    close (fd);
+
+    return bFree;
+}
+
+/* Opens and locks the journal file, writing the magic into a new one */
+static gboolean rp_journal_open (RPJournal *journal, GError **error)
+{
+    g_autofree gchar	*dir = g_path_get_dirname (journal->path);
+    struct stat			st;
+    gint				saved_errno;
+
+    if (journal->fd >= 0)
+        return TRUE;
+
+    if (g_mkdir_with_parents (dir, 0700) != 0)
+        goto failed;
+
+    journal->fd = g_open (journal->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+
+    if (journal->fd < 0)
+        goto failed;
+
+    if (flock (journal->fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close (journal->fd);
+        journal->fd = -1;
+        journal->disabled = TRUE;
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY, "%s is in use by another window", journal->path);
+        return FALSE;
+    }
+
+    if (fstat (journal->fd, &st) == 0 && st.st_size == 0 &&
+        write (journal->fd, RP_JOURNAL_MAGIC, strlen (RP_JOURNAL_MAGIC)) != (gssize)strlen (RP_JOURNAL_MAGIC))
+        goto failed;
+
+    return TRUE;
+
+failed:
+    saved_errno = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Can't write %s: %s", journal->path, g_strerror (saved_errno));
+
+    if (journal->fd >= 0)
+        close (journal->fd);
+
+    journal->fd = -1;
+    return FALSE;
+}
+
+static gboolean rp_journal_write_all (RPJournal *journal, const guchar *data, guint64 len, GError **error)
+{
+    while (len > 0)
+    {
+        gssize actual = write (journal->fd, data, MIN (len, G_MAXSSIZE));
+
+        if (actual < 0 && errno == EINTR)
+            continue;
+
+        if (actual <= 0)
+        {
+            gint saved_errno = errno;
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                         "Can't write %s: %s", journal->path, g_strerror (saved_errno));
+            return FALSE;
+        }
+
+        data	+= actual;
+        len		-= actual;
+    }
+
+    return TRUE;
+}
+
+static guint32 rp_journal_crc (guint32 crc, const guchar *data, guint64 len)
+{
+    for (guint64 done = 0, chunk; done < len; done += chunk)
+    {
+        chunk	= MIN (len - done, G_MAXUINT32);
+        crc		= crc32 (crc, data + done, chunk);
+    }
+
+    return crc;
+}
+
+/* Appends the pending records as one batch, with tail as the end of its
+ * last record. Large data goes to the file without a copy in the batch.
+ */
+static gboolean rp_journal_write_batch (RPJournal *journal, const guchar *tail, guint64 tail_len, GError **error)
+{
+    guchar		header[RP_JOURNAL_HEADER_SIZE];
+    guint64		len = journal->batch->len + tail_len;
+    guint32		crc;
+    gboolean	bRet;
+
+    if (!rp_journal_open (journal, error))
+    {
+        g_byte_array_set_size (journal->batch, 0);
+        return FALSE;
+    }
+
+    crc = rp_journal_crc (crc32 (0, NULL, 0), journal->batch->data, journal->batch->len);
+    crc = rp_journal_crc (crc, tail, tail_len);
+
+    memcpy (header, &len, sizeof (len));
+    memcpy (header + sizeof (len), &crc, sizeof (crc));
+
+    bRet = rp_journal_write_all (journal, header, sizeof (header), error) &&
+           rp_journal_write_all (journal, journal->batch->data, journal->batch->len, error) &&
+           rp_journal_write_all (journal, tail, tail_len, error);
+
+    g_byte_array_set_size (journal->batch, 0);
+
+    return bRet;
+}
+
+static void rp_journal_sync_thread (GTask *task, gpointer source_object, gpointer task_data, 
+                                    GCancellable *cancellable)
+{
+    gint fd = GPOINTER_TO_INT (task_data);
+
+    if (fdatasync (fd) != 0)
+        g_message ("Journal: sync failed: %s", g_strerror (errno));
+
+    close (fd);
+}
+
+/* Writes the pending records and has them synced to the disk on a worker
+ * thread, the main loop doesn't wait for the disk.
+ */
+gboolean rp_journal_flush (RPJournal *journal, GError **error)
+{
+    g_autoptr(GTask)	task = NULL;
+    gint				fd;
+
+    g_clear_handle_id (&journal->timeout_id, g_source_remove);
+
+    if (journal->batch->len == 0)
+        return TRUE;
+
+    if (journal->disabled)
+    {
+        g_byte_array_set_size (journal->batch, 0);
+        return TRUE;
+    }
+
+    if (!rp_journal_write_batch (journal, NULL, 0, error))
+        return FALSE;
+
+    // The duplicate stays open while the sync runs, whatever happens to ours
+    fd = dup (journal->fd);
+
+    if (fd < 0)
+        return TRUE;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    g_task_set_task_data (task, GINT_TO_POINTER (fd), NULL);
+    g_task_run_in_thread (task, rp_journal_sync_thread);
+
+    return TRUE;
+}
+
+static gboolean rp_journal_timeout (gpointer user_data)
+{
+    RPJournal	*journal = user_data;
+    GError		*error = NULL;
+
+    journal->timeout_id = 0;
+
+    if (!rp_journal_flush (journal, &error))
+    {
+        g_message ("Journal: %s", error->message);
+        g_clear_error (&error);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_journal_put_number (GByteArray *batch, guint64 n)
+{
+    guint8	bytes[10];
+    guint	i = 0;
+
+    do
+    {
+        bytes[i] = n & 0x7f;
+        n >>= 7;
+
+        if (n != 0)
+            bytes[i] |= 0x80;
+
+        i++;
+    }
+    while (n != 0);
+
+    g_byte_array_append (batch, bytes, i);
+}
+
+static gboolean rp_journal_get_number (const guchar **p, const guchar *end, guint64 *n)
+{
+    *n = 0;
+
+    for (guint shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        guchar b = *(*p)++;
+
+        *n |= (guint64)(b & 0x7f) << shift;
+
+        if ((b & 0x80) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* data, if not NULL, holds len bytes. Records are only kept in memory
+ * until the next write, which comes after RP_JOURNAL_SYNC_INTERVAL
+ * seconds or when enough of them have piled up.
+ */
+void rp_journal_record (RPJournal *journal, gchar op, guint64 address, guint64 len, guint count,
+                        const guchar *data)
+{
+    guchar	code = (guchar)op | (data != NULL ? RP_JOURNAL_HAS_DATA : 0);
+    GError	*error = NULL;
+
+    g_return_if_fail ((op & RP_JOURNAL_HAS_DATA) == 0);
+
+    if (journal->disabled)
+        return;
+
+    g_byte_array_append (journal->batch, &code, 1);
+    rp_journal_put_number (journal->batch, address);
+    rp_journal_put_number (journal->batch, len);
+    rp_journal_put_number (journal->batch, count);
+
+    // A big paste is written straight from where it is
+    if (data != NULL && len >= RP_JOURNAL_BATCH_SIZE)
+    {
+        g_clear_handle_id (&journal->timeout_id, g_source_remove);
+
+        if (!rp_journal_write_batch (journal, data, len, &error))
+        {
+            g_message ("Journal: %s", error->message);
+            g_clear_error (&error);
+        }
+
+        return;
+    }
+
+    if (data != NULL)
+        g_byte_array_append (journal->batch, data, len);
+
+    if (journal->batch->len >= RP_JOURNAL_BATCH_SIZE)
+        rp_journal_timeout (journal);
+    else if (journal->timeout_id == 0)
+        journal->timeout_id = g_timeout_add_seconds (RP_JOURNAL_SYNC_INTERVAL, rp_journal_timeout, journal);
+}
+
+/* Hands every record to func, data points into the journal and is only
+ * valid during the call. Afterwards the journal ends with the last record
+ * taken, so new records follow what was replayed. Records taken from a
+ * batch that stopped part-way are written again as a batch of their own.
+ */
+gboolean rp_journal_replay (RPJournal *journal, RPJournalFunc func, gpointer user_data, GError **error)
+{
+    GMappedFile		*mapped_file;
+    const guchar	*data;
+    const guchar	*end;
+    const guchar	*p;
+    gboolean		bStopped = FALSE;
+
+    if (!rp_journal_open (journal, error))
+        return FALSE;
+
+    mapped_file = g_mapped_file_new (journal->path, FALSE, error);
+
+    if (mapped_file == NULL)
+        return FALSE;
+
+    data	= (const guchar *)g_mapped_file_get_contents (mapped_file);
+    end		= data + g_mapped_file_get_length (mapped_file);
+    p		= data + strlen (RP_JOURNAL_MAGIC);
+
+    if (data == NULL || p > end || memcmp (data, RP_JOURNAL_MAGIC, strlen (RP_JOURNAL_MAGIC)) != 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a journal", journal->path);
+        g_mapped_file_unref (mapped_file);
+        return FALSE;
+    }
+
+    while (!bStopped && (gsize)(end - p) >= RP_JOURNAL_HEADER_SIZE)
+    {
+        const guchar	*batch = p + RP_JOURNAL_HEADER_SIZE;
+        const guchar	*q;
+        const guchar	*taken = batch;		// End of the records func took
+        guint64			len;
+        guint32			crc;
+
+        memcpy (&len, p, sizeof (len));
+        memcpy (&crc, p + sizeof (len), sizeof (crc));
+
+        if (len > (guint64)(end - batch) || rp_journal_crc (crc32 (0, NULL, 0), batch, len) != crc)
+            break;
+
+        for (q = batch; q < batch + len; taken = q)
+        {
+            guchar			code = *q++;
+            guint64			address, rlen, count;
+            const guchar	*rdata = NULL;
+
+            if (!rp_journal_get_number (&q, batch + len, &address) ||
+                !rp_journal_get_number (&q, batch + len, &rlen) ||
+                !rp_journal_get_number (&q, batch + len, &count))
+            {
+                bStopped = TRUE;
+                break;
+            }
+
+            if (code & RP_JOURNAL_HAS_DATA)
+            {
+                if (rlen > (guint64)(batch + len - q))
+                {
+                    bStopped = TRUE;
+                    break;
+                }
+
+                rdata	= q;
+                q		+= rlen;
+            }
+
+            if (!func (code & ~RP_JOURNAL_HAS_DATA, address, rlen, count, rdata, user_data))
+            {
+                bStopped = TRUE;
+                break;
+            }
+        }
+
+        if (!bStopped)
+            p = batch + len;
+        else
+            g_byte_array_append (journal->batch, batch, taken - batch);
+    }
+
+    // Whatever follows was torn by the crash or not taken
+    if (p < end && ftruncate (journal->fd, p - data) != 0)
+    {
+        gint saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Can't truncate %s: %s", journal->path, g_strerror (saved_errno));
+        g_byte_array_set_size (journal->batch, 0);
+        g_mapped_file_unref (mapped_file);
+        return FALSE;
+    }
+
+    g_mapped_file_unref (mapped_file);
+
+    // The records before the one that stopped the replay are in the document
+    if (journal->batch->len > 0 && !rp_journal_write_batch (journal, NULL, 0, error))
+        return FALSE;
+
+    if (bStopped)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s doesn't fit the file", journal->path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The document was saved or thrown away, nothing is left to recover */
+void rp_journal_discard (RPJournal *journal)
+{
+    g_clear_handle_id (&journal->timeout_id, g_source_remove);
+    g_byte_array_set_size (journal->batch, 0);
+
+    if (journal->fd < 0)
+        journal->fd = g_open (journal->path, O_RDONLY | O_CLOEXEC, 0);
+
+    if (journal->fd < 0)
+        return;
+
+    // Left alone if another window is writing it
+    if (flock (journal->fd, LOCK_EX | LOCK_NB) == 0)
+        g_unlink (journal->path);
+
+    close (journal->fd);
+    journal->fd = -1;
+}
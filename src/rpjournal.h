@@ -0,0 +1,60 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpjournal.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_JOURNAL_H__
+#define __RP_JOURNAL_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Log of the unsaved modifications of a document, so a crash doesn't lose
+ * them. Records are collected in memory and appended to a file under
+ * $XDG_STATE_HOME in one write, at most RP_JOURNAL_SYNC_INTERVAL seconds
+ * after the first of them, and synced to the disk behind it. Journals are
+ * looked up by inode, size and modification time of the file, the same
+ * way as gzip indexes.
+ *
+ * A record is an operation byte and three numbers, usually an address, a
+ * length and a count, followed by the data if there is any. What they mean
+ * is up to the caller.
+ */
+#define RP_JOURNAL_SYNC_INTERVAL	2
+#define RP_JOURNAL_BATCH_SIZE		(1024 * 1024)	// Written right away once this much is pending
+
+typedef struct _RPJournal	RPJournal;
+
+/* Called by rp_journal_replay for every record in order, returns FALSE to
+ * stop there.
+ */
+typedef gboolean (*RPJournalFunc) (gchar op, guint64 address, guint64 len, guint count, const guchar *data,
+                                   gpointer user_data);
+
+RPJournal	*rp_journal_new (const gchar *path);
+void		rp_journal_free (RPJournal *journal);
+gboolean	rp_journal_exists (RPJournal *journal);
+void		rp_journal_record (RPJournal *journal, gchar op, guint64 address, guint64 len, guint count,
+                               const guchar *data);
+gboolean	rp_journal_flush (RPJournal *journal, GError **error);
+gboolean	rp_journal_replay (RPJournal *journal, RPJournalFunc func, gpointer user_data, GError **error);
+void		rp_journal_discard (RPJournal *journal);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,337 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rppiecetree.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rppiecetree.h"
+
+struct _RPPieceNode
+{
+    doc_loc		piece;
+    guint64		size;		// Bytes in this subtree
+    guint		count;		// Pieces in this subtree
+    guint32		priority;	// Heap key, parents are >= their children
+    gint		ref_count;	// Trees and parent nodes sharing this node
+    RPPieceNode	*left;
+    RPPieceNode	*right;
+};
+
+#define node_size(n)	((n) ? (n)->size : 0)
+#define node_count(n)	((n) ? (n)->count : 0)
+
+static RPPieceNode *rp_piece_node_new (const doc_loc *piece)
+{
+    RPPieceNode *node = g_new0 (RPPieceNode, 1);
+
+    node->piece     = *piece;
+    node->size      = piece->len;
+    node->count     = 1;
+    node->priority  = g_random_int ();
+    node->ref_count = 1;
+
+    return node;
+}
+
+static void rp_piece_node_unref (RPPieceNode *node)
+{
+    if (node == NULL || !g_atomic_int_dec_and_test (&node->ref_count))
+        return;
+
+    rp_piece_node_unref (node->left);
+    rp_piece_node_unref (node->right);
+    g_free (node);
+}
+
+/* Returns a node that may be changed in place of the given reference. A
+ * node shared with another tree is copied first, the copy shares both
+ * children, so only the path down to a change is ever duplicated.
+ */
+static RPPieceNode *rp_piece_node_own (RPPieceNode *node)
+{
+    RPPieceNode *copy;
+
+    if (g_atomic_int_get (&node->ref_count) == 1)
+        return node;
+
+    copy = g_new (RPPieceNode, 1);
+    *copy = *node;
+    copy->ref_count = 1;
+
+    if (copy->left)
+        g_atomic_int_inc (&copy->left->ref_count);
+
+    if (copy->right)
+        g_atomic_int_inc (&copy->right->ref_count);
+
+    rp_piece_node_unref (node);
+
+    return copy;
+}
+
+static void rp_piece_node_update (RPPieceNode *node)
+{
+    node->size  = node_size (node->left) + node->piece.len + node_size (node->right);
+    node->count = node_count (node->left) + 1 + node_count (node->right);
+}
+
+static RPPieceNode *rp_piece_node_merge (RPPieceNode *a, RPPieceNode *b)
+{
+    if (a == NULL)
+        return b;
+
+    if (b == NULL)
+        return a;
+
+    if (a->priority > b->priority)
+    {
+        a = rp_piece_node_own (a);
+        a->right = rp_piece_node_merge (a->right, b);
+        rp_piece_node_update (a);
+        return a;
+    }
+
+    b = rp_piece_node_own (b);
+    b->left = rp_piece_node_merge (a, b->left);
+    rp_piece_node_update (b);
+    return b;
+}
+
+/* Split the subtree so that *left holds exactly the first 'address' bytes.
+ * A piece straddling the split point is cut in two.
+ */
+static void rp_piece_node_split (RPPieceNode *node, guint64 address,
+                                RPPieceNode **left, RPPieceNode **right)
+{
+    guint64 lsize;
+
+    if (node == NULL)
+    {
+        *left = *right = NULL;
+        return;
+    }
+
+    node  = rp_piece_node_own (node);
+    lsize = node_size (node->left);
+
+    if (address <= lsize)
+    {
+        rp_piece_node_split (node->left, address, left, &node->left);
+        rp_piece_node_update (node);
+        *right = node;
+    }
+    else if (address >= lsize + node->piece.len)
+    {
+        rp_piece_node_split (node->right, address - lsize - node->piece.len, &node->right, right);
+        rp_piece_node_update (node);
+        *left = node;
+    }
+    else
+    {
+        guint64 split   = address - lsize;
+        doc_loc tail    = node->piece;
+        RPPieceNode *rest;
+
+        tail.len -= split;
+
+        if (tail.location != loc_mem)
+            tail.fileaddr += split;
+        else
+            tail.memaddr += split;
+
+        node->piece.len = split;
+        rest = node->right;
+        node->right = NULL;
+        rp_piece_node_update (node);
+
+        *left   = node;
+        *right  = rp_piece_node_merge (rp_piece_node_new (&tail), rest);
+    }
+}
+
+static gboolean rp_piece_contiguous (const doc_loc *a, const doc_loc *b)
+{
+    if (a->location != b->location)
+        return FALSE;
+
+    if (a->location != loc_mem)
+        return a->fileaddr + a->len == b->fileaddr;
+
+    return a->memaddr + a->len == b->memaddr;
+}
+
+static void rp_piece_node_grow_last (RPPieceNode **link, guint64 len)
+{
+    RPPieceNode *node = *link = rp_piece_node_own (*link);
+
+    if (node->right != NULL)
+        rp_piece_node_grow_last (&node->right, len);
+    else
+        node->piece.len += len;
+
+    rp_piece_node_update (node);
+}
+
+/* Grow the last piece of the subtree by 'piece' if it continues right
+ * where that piece ends. Keeps runs of typed bytes in a single piece.
+ */
+static gboolean rp_piece_node_extend_last (RPPieceNode **link, const doc_loc *piece)
+{
+    RPPieceNode *last = *link;
+
+    if (last == NULL)
+        return FALSE;
+
+    while (last->right != NULL)
+        last = last->right;
+
+    if (!rp_piece_contiguous (&last->piece, piece))
+        return FALSE;
+
+    rp_piece_node_grow_last (link, piece->len);
+    return TRUE;
+}
+
+RPPieceTree *rp_piece_tree_new (void)
+{
+    return g_new0 (RPPieceTree, 1);
+}
+
+void rp_piece_tree_free (RPPieceTree *tree)
+{
+    if (tree == NULL)
+        return;
+
+    rp_piece_node_unref (tree->root);
+    g_free (tree);
+}
+
+void rp_piece_tree_clear (RPPieceTree *tree)
+{
+    rp_piece_node_unref (tree->root);
+    tree->root = NULL;
+}
+
+/* A second tree with the same pieces, in O(1). Both share every node
+ * until one of them is changed, which copies only the nodes on the path
+ * to the change. Either tree can be read from one thread while the other
+ * is edited on another.
+ */
+RPPieceTree *rp_piece_tree_copy (RPPieceTree *tree)
+{
+    RPPieceTree *copy = rp_piece_tree_new ();
+
+    if (tree->root != NULL)
+    {
+        g_atomic_int_inc (&tree->root->ref_count);
+        copy->root = tree->root;
+    }
+
+    return copy;
+}
+
+guint64 rp_piece_tree_get_size (RPPieceTree *tree)
+{
+    return node_size (tree->root);
+}
+
+guint rp_piece_tree_get_count (RPPieceTree *tree)
+{
+    return node_count (tree->root);
+}
+
+/* Returns the piece containing 'address' and its document offset in
+ * piece_start, or NULL if address is at or beyond the end of the document.
+ */
+const doc_loc *rp_piece_tree_lookup (RPPieceTree *tree, guint64 address, guint64 *piece_start)
+{
+    RPPieceNode *node   = tree->root;
+    guint64     pos     = 0;
+
+    while (node != NULL)
+    {
+        guint64 lsize = node_size (node->left);
+
+        if (address < pos + lsize)
+            node = node->left;
+        else if (address < pos + lsize + node->piece.len)
+        {
+            if (piece_start)
+                *piece_start = pos + lsize;
+
+            return &node->piece;
+        }
+        else
+        {
+            pos += lsize + node->piece.len;
+            node = node->right;
+        }
+    }
+
+    return NULL;
+}
+
+void rp_piece_tree_insert (RPPieceTree *tree, guint64 address, const doc_loc *piece)
+{
+    RPPieceNode *left, *right;
+
+    g_assert (address <= node_size (tree->root));
+    g_assert (piece->location == loc_file || piece->location == loc_mem || piece->location == loc_zero);
+
+    if (piece->len == 0)
+        return;
+
+    rp_piece_node_split (tree->root, address, &left, &right);
+
+    if (!rp_piece_node_extend_last (&left, piece))
+        left = rp_piece_node_merge (left, rp_piece_node_new (piece));
+
+    tree->root = rp_piece_node_merge (left, right);
+}
+
+static void rp_piece_node_collect (RPPieceNode *node, GArray *pieces)
+{
+    if (node == NULL)
+        return;
+
+    rp_piece_node_collect (node->left, pieces);
+    g_array_append_val (pieces, node->piece);
+    rp_piece_node_collect (node->right, pieces);
+}
+
+/* Remove len bytes at address. If removed is not NULL the pieces that made
+ * up the range are appended to it in document order, so they can be put
+ * back later with rp_piece_tree_insert.
+ */
+void rp_piece_tree_delete (RPPieceTree *tree, guint64 address, guint64 len, GArray *removed)
+{
+    RPPieceNode *left, *middle, *right;
+
+    g_assert (address + len <= node_size (tree->root));
+
+    if (len == 0)
+        return;
+
+    rp_piece_node_split (tree->root, address, &left, &middle);
+    rp_piece_node_split (middle, len, &middle, &right);
+
+    if (removed != NULL)
+        rp_piece_node_collect (middle, removed);
+
+    rp_piece_node_unref (middle);
+
+    tree->root = rp_piece_node_merge (left, right);
+}
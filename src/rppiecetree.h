@@ -0,0 +1,71 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rppiecetree.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_PIECE_TREE_H__
+#define __RP_PIECE_TREE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+enum { loc_unknown = 'u', loc_file = 'f', loc_mem = 'm', loc_zero = 'z' };
+
+typedef struct _doc_loc doc_loc;
+
+struct _doc_loc
+{
+    gchar	location;  // File, memory or a hole of the file?
+    guint64	len;
+    union
+    {
+        guint64 fileaddr; 	// File location (if loc_file or loc_zero)
+        guchar 	*memaddr;	// Ptr to data (if loc_mem)
+    };
+};
+
+/* The location list of a document is kept in a treap (randomized balanced
+ * binary tree) ordered by document offset. Every node caches the number of
+ * bytes in its subtree, so finding the piece for an offset, splitting a
+ * piece and inserting or deleting a range are all O(log n) in the number
+ * of pieces.
+ *
+ * Nodes are reference counted and copied on write, so a tree can be
+ * copied in O(1) and the copies changed independently afterwards.
+ */
+typedef struct _RPPieceNode	RPPieceNode;
+typedef struct _RPPieceTree	RPPieceTree;
+
+struct _RPPieceTree
+{
+    RPPieceNode	*root;
+};
+
+RPPieceTree		*rp_piece_tree_new (void);
+void			rp_piece_tree_free (RPPieceTree *tree);
+void			rp_piece_tree_clear (RPPieceTree *tree);
+RPPieceTree		*rp_piece_tree_copy (RPPieceTree *tree);
+guint64			rp_piece_tree_get_size (RPPieceTree *tree);
+guint			rp_piece_tree_get_count (RPPieceTree *tree);
+const doc_loc	*rp_piece_tree_lookup (RPPieceTree *tree, guint64 address, guint64 *piece_start);
+void			rp_piece_tree_insert (RPPieceTree *tree, guint64 address, const doc_loc *piece);
+void			rp_piece_tree_delete (RPPieceTree *tree, guint64 address, guint64 len, GArray *removed);
+
+G_END_DECLS
+
+#endif
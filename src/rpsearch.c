@@ -0,0 +1,1081 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpsearch.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "rpsearch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RP_SEARCH_HAVE_AVX2
+#endif
+
+struct _RPSearchPattern
+{
+    gint		ref_count;
+    guchar		*bytes;		// Masked already
+    guchar		*mask;		// Bits that have to match, NULL if all do
+    gsize		len;
+    gsize		min_len;	// Shortest match, len is the longest
+    gsize		first;		// Bytes compared in the SIMD prefilter, both
+    gsize		last;		// ends of the longest run without wildcards
+    gboolean	zero;		// Nothing but zeros, can match inside a hole
+    GRegex		*regex;		// Set for a regular expression instead of bytes
+    gsize		behind;		// Bytes read before and after each window for
+    gsize		ahead;		// an expression to look at, none for bytes
+};
+
+/* A search is split into ranges of RP_SEARCH_RANGE_SIZE candidate
+ * positions, numbered from 'from' on in the direction of the search. The
+ * threads take the ranges in that order, so once one has a match only
+ * the ranges before it still need to be finished.
+ */
+typedef struct
+{
+    RPHexFile			*hex_file;
+    RPHexSnapshot		*snapshot;
+    RPSearchPattern		*pattern;
+    guint64				from;
+    gboolean			bForward;
+    guint				threads;
+    GCancellable		*cancellable;
+    RPHexFileProgress	progress;
+    gpointer			progress_data;
+    GMainContext		*context;	// Where progress is reported
+    GMutex				lock;		// Guards everything below
+    GCond				cond;
+    guint64				done;
+    guint64				total;
+    gint				percent;	// Last reported
+    guint64				ranges;
+    guint64				next_range;	// Next one to take
+    guint64				hit_range;	// First one with a match, 'ranges' while none
+    guint64				hit;
+    guint				running;	// Threads still working
+} RPSearchJob;
+
+typedef struct
+{
+    RPHexFile			*hex_file;
+    RPHexFileProgress	progress;
+    gpointer			progress_data;
+    guint64				done;
+    guint64				total;
+} RPSearchProgress;
+
+RPSearchPattern *rp_search_pattern_new (const guchar *bytes, gsize len)
+{
+    return rp_search_pattern_new_masked (bytes, NULL, len);
+}
+
+/* Bits clear in mask match anything, a NULL mask makes every bit count.
+ * The prefilter looks at the longest run of bytes that are matched in
+ * full, or at the best constrained byte if there is none.
+ */
+RPSearchPattern *rp_search_pattern_new_masked (const guchar *bytes, const guchar *mask, gsize len)
+{
+    RPSearchPattern *pattern;
+    gsize           run = 0;
+    gsize           best = 0;
+
+    g_return_val_if_fail (len > 0, NULL);
+
+    pattern				= g_new0 (RPSearchPattern, 1);
+    pattern->ref_count	= 1;
+    pattern->bytes		= g_malloc (len);
+    pattern->len		= len;
+    pattern->min_len	= len;
+    pattern->zero		= TRUE;
+
+    memcpy (pattern->bytes, bytes, len);
+
+    for (gsize i = 0; mask != NULL && pattern->mask == NULL && i < len; i++)
+    {
+        if (mask[i] != 0xff)
+        {
+            pattern->mask = g_malloc (len);
+            memcpy (pattern->mask, mask, len);
+        }
+    }
+
+    for (gsize i = 0; i < len; i++)
+    {
+        guchar bits = pattern->mask ? pattern->mask[i] : 0xff;
+
+        pattern->bytes[i] &= bits;
+
+        if (pattern->bytes[i] != 0)
+            pattern->zero = FALSE;
+
+        run = (bits == 0xff) ? run + 1 : 0;
+
+        if (run > best)
+        {
+            best			= run;
+            pattern->first	= i + 1 - run;
+            pattern->last	= i;
+        }
+    }
+
+    // No byte without wildcards, take the one with the most bits set
+    for (gsize i = 0, most = 0; best == 0 && i < len; i++)
+    {
+        guint bits = __builtin_popcount (pattern->mask[i]);
+
+        if (i == 0 || bits > most)
+        {
+            most = bits;
+            pattern->first = pattern->last = i;
+        }
+    }
+
+    return pattern;
+}
+
+/* Pairs of hex digits, blanks between the pairs are ignored. A '?' in
+ * place of a digit matches any nibble there, "??" any byte.
+ */
+RPSearchPattern *rp_search_pattern_new_from_hex (const gchar *text, GError **error)
+{
+    g_autoptr(GByteArray)	bytes = g_byte_array_new ();
+    g_autoptr(GByteArray)	mask = g_byte_array_new ();
+    gint					digits = 0;
+    guint8					byte = 0;
+    guint8					bits = 0;
+
+    for (const gchar *scan = text; *scan != '\0'; scan++)
+    {
+        gint digit;
+
+        if (g_ascii_isspace (*scan) && digits == 0)
+            continue;
+
+        if (*scan == '?')
+        {
+            byte <<= 4;
+            bits <<= 4;
+        }
+        else if ((digit = g_ascii_xdigit_value (*scan)) >= 0)
+        {
+            byte = (byte << 4) | digit;
+            bits = (bits << 4) | 0x0f;
+        }
+        else
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "'%c' is not a hex digit", *scan);
+            return NULL;
+        }
+
+        if (++digits < 2)
+            continue;
+
+        g_byte_array_append (bytes, &byte, 1);
+        g_byte_array_append (mask, &bits, 1);
+        digits = 0;
+        byte = bits = 0;
+    }
+
+    if (digits > 0 || bytes->len == 0)
+    {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                             bytes->len == 0 && digits == 0 ? "Nothing to search for" : "Odd number of hex digits");
+        return NULL;
+    }
+
+    return rp_search_pattern_new_masked (bytes->data, mask->data, bytes->len);
+}
+
+/* \z, \Z and \G match where the bytes handed to GRegex end or where
+ * matching starts, which are window borders rather than the ends of the
+ * document. $ and ^ are told apart with NOTEOL and NOTBOL, these can't be.
+ */
+static gboolean rp_search_regex_check (const gchar *text, GError **error)
+{
+    for (const gchar *scan = text; *scan != '\0'; scan++)
+    {
+        if (*scan != '\\' || scan[1] == '\0')
+            continue;
+
+        scan++;
+
+        // Quoted text is taken literally
+        if (*scan == 'Q' && (scan = strstr (scan, "\\E")) == NULL)
+            break;
+
+        if (*scan == 'z' || *scan == 'Z' || *scan == 'G')
+        {
+            g_set_error (error, G_REGEX_ERROR, G_REGEX_ERROR_COMPILE,
+                         "\\%c is not supported in a search, use ^ and $ for the ends of the document", *scan);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Regular expression over raw bytes, '.' matches any byte and \xhh a
+ * given one. Matches are at most max_len bytes long, a longer one counts
+ * only if the expression also matches within max_len bytes. Documents are
+ * searched in windows that overlap by max_len, so it bounds the memory
+ * used as well. Each window comes with the bytes the expression looks
+ * back at and one byte after it, so lookbehind, \b, ^ and $ see the
+ * document rather than the window.
+ */
+RPSearchPattern *rp_search_pattern_new_regex (const gchar *text, gsize max_len, GError **error)
+{
+    RPSearchPattern *pattern;
+    GRegex          *regex;
+
+    g_return_val_if_fail (max_len > 0, NULL);
+
+    if (!rp_search_regex_check (text, error))
+        return NULL;
+
+    regex = g_regex_new (text, G_REGEX_RAW | G_REGEX_DOTALL | G_REGEX_OPTIMIZE, G_REGEX_MATCH_NOTEMPTY, error);
+
+    if (regex == NULL)
+        return NULL;
+
+    pattern				= g_new0 (RPSearchPattern, 1);
+    pattern->ref_count	= 1;
+    pattern->regex		= regex;
+    pattern->len		= max_len;
+    pattern->min_len	= 1;
+    pattern->zero		= TRUE;
+    pattern->behind		= MAX (1, g_regex_get_max_lookbehind (regex));
+    pattern->ahead		= 1;
+
+    return pattern;
+}
+
+RPSearchPattern *rp_search_pattern_ref (RPSearchPattern *pattern)
+{
+    g_atomic_int_inc (&pattern->ref_count);
+
+    return pattern;
+}
+
+void rp_search_pattern_unref (RPSearchPattern *pattern)
+{
+    if (pattern == NULL || !g_atomic_int_dec_and_test (&pattern->ref_count))
+        return;
+
+    g_free (pattern->bytes);
+    g_free (pattern->mask);
+    g_clear_pointer (&pattern->regex, g_regex_unref);
+    g_free (pattern);
+}
+
+gsize rp_search_pattern_get_length (RPSearchPattern *pattern)
+{
+    return pattern->len;
+}
+
+/* Bytes under a wildcard read as zero, NULL for a regular expression */
+const guchar *rp_search_pattern_get_bytes (RPSearchPattern *pattern)
+{
+    return pattern->bytes;
+}
+
+gboolean rp_search_pattern_has_wildcards (RPSearchPattern *pattern)
+{
+    return pattern->mask != NULL;
+}
+
+/* Whole pattern at a position that passed the prefilter */
+static inline gboolean rp_search_verify (const RPSearchPattern *pattern, const guchar *at)
+{
+    if (pattern->mask == NULL)
+        return memcmp (at, pattern->bytes, pattern->len) == 0;
+
+    for (gsize i = 0; i < pattern->len; i++)
+        if ((at[i] & pattern->mask[i]) != pattern->bytes[i])
+            return FALSE;
+
+    return TRUE;
+}
+
+static inline guchar rp_search_mask (const RPSearchPattern *pattern, gsize i)
+{
+    return pattern->mask ? pattern->mask[i] : 0xff;
+}
+
+/* First match starting at or after 'from' */
+static gssize rp_search_forward_scalar (const RPSearchPattern *pattern, const guchar *buf, gsize len, gsize from)
+{
+    gsize			first = pattern->first;
+    gboolean		bExact = rp_search_mask (pattern, first) == 0xff;
+    const guchar	*last = buf + len - pattern->len;
+
+    for (const guchar *scan = buf + from; scan <= last; scan++)
+    {
+        if (bExact && (scan = memchr (scan + first, pattern->bytes[first], last - scan + 1)) == NULL)
+            return -1;
+
+        if (bExact)
+            scan -= first;
+
+        if (rp_search_verify (pattern, scan))
+            return scan - buf;
+    }
+
+    return -1;
+}
+
+/* Last match starting before 'to' */
+static gssize rp_search_backward_scalar (const RPSearchPattern *pattern, const guchar *buf, gsize to)
+{
+    gsize	first = pattern->first;
+    guchar	bits = rp_search_mask (pattern, first);
+
+    for (gsize i = to; i-- > 0;)
+        if ((buf[i + first] & bits) == pattern->bytes[first] && rp_search_verify (pattern, buf + i))
+            return i;
+
+    return -1;
+}
+
+#ifdef __SSE2__
+static gssize rp_search_forward_sse2 (const RPSearchPattern *pattern, const guchar *buf, gsize len, gsize from)
+{
+    gsize	m = pattern->len;
+    __m128i	first = _mm_set1_epi8 (pattern->bytes[pattern->first]);
+    __m128i	first_mask = _mm_set1_epi8 (rp_search_mask (pattern, pattern->first));
+    __m128i	last = _mm_set1_epi8 (pattern->bytes[pattern->last]);
+    __m128i	last_mask = _mm_set1_epi8 (rp_search_mask (pattern, pattern->last));
+    gsize	i;
+
+    for (i = from; i + m - 1 + 16 <= len; i += 16)
+    {
+        __m128i	a = _mm_loadu_si128 ((const __m128i *)(buf + i + pattern->first));
+        __m128i	b = _mm_loadu_si128 ((const __m128i *)(buf + i + pattern->last));
+        guint	mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (_mm_and_si128 (a, first_mask), first),
+                                                         _mm_cmpeq_epi8 (_mm_and_si128 (b, last_mask), last)));
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            gsize at = i + __builtin_ctz (mask);
+
+            if (rp_search_verify (pattern, buf + at))
+                return at;
+        }
+    }
+
+    return rp_search_forward_scalar (pattern, buf, len, i);
+}
+
+static gssize rp_search_backward_sse2 (const RPSearchPattern *pattern, const guchar *buf, gsize to)
+{
+    __m128i	first = _mm_set1_epi8 (pattern->bytes[pattern->first]);
+    __m128i	first_mask = _mm_set1_epi8 (rp_search_mask (pattern, pattern->first));
+    __m128i	last = _mm_set1_epi8 (pattern->bytes[pattern->last]);
+    __m128i	last_mask = _mm_set1_epi8 (rp_search_mask (pattern, pattern->last));
+    gsize	i;
+
+    for (i = to; i >= 16; i -= 16)
+    {
+        __m128i	a = _mm_loadu_si128 ((const __m128i *)(buf + i - 16 + pattern->first));
+        __m128i	b = _mm_loadu_si128 ((const __m128i *)(buf + i - 16 + pattern->last));
+        guint	mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (_mm_and_si128 (a, first_mask), first),
+                                                         _mm_cmpeq_epi8 (_mm_and_si128 (b, last_mask), last)));
+
+        while (mask != 0)
+        {
+            gint bit = 31 - __builtin_clz (mask);
+
+            if (rp_search_verify (pattern, buf + i - 16 + bit))
+                return i - 16 + bit;
+
+            mask &= ~(1u << bit);
+        }
+    }
+
+    return rp_search_backward_scalar (pattern, buf, i);
+}
+#endif
+
+#ifdef RP_SEARCH_HAVE_AVX2
+__attribute__((target ("avx2")))
+static gssize rp_search_forward_avx2 (const RPSearchPattern *pattern, const guchar *buf, gsize len, gsize from)
+{
+    gsize	m = pattern->len;
+    __m256i	first = _mm256_set1_epi8 (pattern->bytes[pattern->first]);
+    __m256i	first_mask = _mm256_set1_epi8 (rp_search_mask (pattern, pattern->first));
+    __m256i	last = _mm256_set1_epi8 (pattern->bytes[pattern->last]);
+    __m256i	last_mask = _mm256_set1_epi8 (rp_search_mask (pattern, pattern->last));
+    gsize	i;
+
+    for (i = from; i + m - 1 + 32 <= len; i += 32)
+    {
+        __m256i	a = _mm256_loadu_si256 ((const __m256i *)(buf + i + pattern->first));
+        __m256i	b = _mm256_loadu_si256 ((const __m256i *)(buf + i + pattern->last));
+        guint32	mask = _mm256_movemask_epi8 (_mm256_and_si256 (
+                                _mm256_cmpeq_epi8 (_mm256_and_si256 (a, first_mask), first),
+                                _mm256_cmpeq_epi8 (_mm256_and_si256 (b, last_mask), last)));
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            gsize at = i + __builtin_ctz (mask);
+
+            if (rp_search_verify (pattern, buf + at))
+                return at;
+        }
+    }
+
+    return rp_search_forward_scalar (pattern, buf, len, i);
+}
+
+__attribute__((target ("avx2")))
+static gssize rp_search_backward_avx2 (const RPSearchPattern *pattern, const guchar *buf, gsize to)
+{
+    __m256i	first = _mm256_set1_epi8 (pattern->bytes[pattern->first]);
+    __m256i	first_mask = _mm256_set1_epi8 (rp_search_mask (pattern, pattern->first));
+    __m256i	last = _mm256_set1_epi8 (pattern->bytes[pattern->last]);
+    __m256i	last_mask = _mm256_set1_epi8 (rp_search_mask (pattern, pattern->last));
+    gsize	i;
+
+    for (i = to; i >= 32; i -= 32)
+    {
+        __m256i	a = _mm256_loadu_si256 ((const __m256i *)(buf + i - 32 + pattern->first));
+        __m256i	b = _mm256_loadu_si256 ((const __m256i *)(buf + i - 32 + pattern->last));
+        guint32	mask = _mm256_movemask_epi8 (_mm256_and_si256 (
+                                _mm256_cmpeq_epi8 (_mm256_and_si256 (a, first_mask), first),
+                                _mm256_cmpeq_epi8 (_mm256_and_si256 (b, last_mask), last)));
+
+        while (mask != 0)
+        {
+            gint bit = 31 - __builtin_clz (mask);
+
+            if (rp_search_verify (pattern, buf + i - 32 + bit))
+                return i - 32 + bit;
+
+            mask &= ~(1u << bit);
+        }
+    }
+
+    return rp_search_backward_scalar (pattern, buf, i);
+}
+
+static gboolean rp_search_use_avx2 (void)
+{
+    static gsize use_avx2 = 0;
+
+    if (g_once_init_enter (&use_avx2))
+    {
+        __builtin_cpu_init ();
+        g_once_init_leave (&use_avx2, __builtin_cpu_supports ("avx2") ? 2 : 1);
+    }
+
+    return use_avx2 == 2;
+}
+#endif
+
+/* First match of the expression starting in [from, limit), the match
+ * may go on up to the end of buf. Bytes before from are only looked at,
+ * flags say whether buf starts and ends where the document does. The end
+ * of the match goes to match_end if that isn't NULL.
+ */
+static gssize rp_search_regex_next (const RPSearchPattern *pattern, const guchar *buf, gsize len,
+                                    gsize from, gsize limit, GRegexMatchFlags flags, gsize *match_end)
+{
+    while (from < limit)
+    {
+        GMatchInfo			*match_info = NULL;
+        GRegexMatchFlags	retry_flags = flags | G_REGEX_MATCH_ANCHORED;
+        gsize				retry_len;
+        gint				start = 0;
+        gint				end = 0;
+        gboolean			bFound;
+
+        bFound = g_regex_match_full (pattern->regex, (const gchar *)buf, len, from, flags, &match_info, NULL) &&
+                 g_match_info_fetch_pos (match_info, 0, &start, &end);
+        g_match_info_free (match_info);
+
+        if (!bFound || (gsize)start >= limit)
+            return -1;
+
+        // Too long, but there may be a match within the limit as well
+        if ((gsize)(end - start) > pattern->len)
+        {
+            retry_len = MIN (len, start + pattern->len);
+
+            if (retry_len < len)
+                retry_flags |= G_REGEX_MATCH_NOTEOL;
+
+            match_info = NULL;
+            bFound = g_regex_match_full (pattern->regex, (const gchar *)buf, retry_len, start, retry_flags,
+                                         &match_info, NULL) &&
+                     g_match_info_fetch_pos (match_info, 0, &start, &end);
+            g_match_info_free (match_info);
+        }
+
+        if (bFound)
+        {
+            if (match_end != NULL)
+                *match_end = end;
+
+            return start;
+        }
+
+        from = start + 1;
+    }
+
+    return -1;
+}
+
+static gssize rp_search_regex_last (const RPSearchPattern *pattern, const guchar *buf, gsize len,
+                                    gsize from, gsize limit, GRegexMatchFlags flags)
+{
+    gssize	last = -1;
+    gssize	hit;
+
+    while ((hit = rp_search_regex_next (pattern, buf, len, from, limit, flags, NULL)) >= 0)
+    {
+        last = hit;
+        from = hit + 1;
+    }
+
+    return last;
+}
+
+/* Offset of the first or the last match in buf that starts in [from,
+ * limit). Only expressions are given bytes before from and flags, from
+ * is 0 for bytes.
+ */
+static gssize rp_search_pattern_scan_range (const RPSearchPattern *pattern, const guchar *buf, gsize len,
+                                            gsize from, gsize limit, GRegexMatchFlags flags, gboolean bForward)
+{
+    if (pattern->regex != NULL)
+        return bForward ? rp_search_regex_next (pattern, buf, len, from, limit, flags, NULL) :
+                          rp_search_regex_last (pattern, buf, len, from, limit, flags);
+
+#ifdef RP_SEARCH_HAVE_AVX2
+    if (rp_search_use_avx2 ())
+        return bForward ? rp_search_forward_avx2 (pattern, buf, limit + pattern->len - 1, from) :
+                          rp_search_backward_avx2 (pattern, buf, limit);
+#endif
+#ifdef __SSE2__
+    return bForward ? rp_search_forward_sse2 (pattern, buf, limit + pattern->len - 1, from) :
+                      rp_search_backward_sse2 (pattern, buf, limit);
+#else
+    return bForward ? rp_search_forward_scalar (pattern, buf, limit + pattern->len - 1, from) :
+                      rp_search_backward_scalar (pattern, buf, limit);
+#endif
+}
+
+/* Offset of the first (bForward) or the last match that lies completely
+ * inside buf, -1 if there is none. buf is taken as the whole document.
+ */
+gssize rp_search_pattern_scan (RPSearchPattern *pattern, const guchar *buf, gsize len, gboolean bForward)
+{
+    if (len < pattern->min_len)
+        return -1;
+
+    return rp_search_pattern_scan_range (pattern, buf, len, 0, len - pattern->min_len + 1, 0, bForward);
+}
+
+/* Whether the bytes read for a window start and end where the document does */
+static GRegexMatchFlags rp_search_regex_flags (guint64 address, gsize len, guint64 size)
+{
+    return ((address > 0) ? G_REGEX_MATCH_NOTBOL : 0) |
+           ((address + len < size) ? G_REGEX_MATCH_NOTEOL : 0);
+}
+
+/* Length of the match at address, -1 if there is none. An expression is
+ * matched the way the search does, with the bytes around it.
+ */
+gssize rp_hex_snapshot_match (RPHexSnapshot *snapshot, RPSearchPattern *pattern, guint64 address)
+{
+    gsize				before = MIN (address, pattern->behind);
+    gsize				want = before + pattern->len + pattern->ahead;
+    g_autofree guchar	*buf = g_malloc (want);
+    gsize				len;
+    gsize				end = 0;
+
+    len = rp_hex_snapshot_get_data (snapshot, buf, want, address - before);
+
+    if (len < before + pattern->min_len)
+        return -1;
+
+    if (pattern->regex == NULL)
+        return (len >= pattern->len && rp_search_verify (pattern, buf)) ? (gssize)pattern->len : -1;
+
+    if (rp_search_regex_next (pattern, buf, len, before, before + 1,
+                              rp_search_regex_flags (address - before, len, rp_hex_snapshot_get_size (snapshot)),
+                              &end) < 0)
+        return -1;
+
+    return end - before;
+}
+
+gssize rp_hex_file_match (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 address)
+{
+    RPHexSnapshot	*snapshot = rp_hex_file_snapshot (hex_file);
+    gssize			match = rp_hex_snapshot_match (snapshot, pattern, address);
+
+    rp_hex_snapshot_unref (snapshot);
+
+    return match;
+}
+
+static gboolean rp_search_progress_report (gpointer data)
+{
+    RPSearchProgress *report = data;
+
+    report->progress (report->hex_file, report->done, report->total, report->progress_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_search_progress_free (gpointer data)
+{
+    RPSearchProgress *report = data;
+
+    g_object_unref (report->hex_file);
+    g_free (report);
+}
+
+/* Account for len more bytes searched in range, returns FALSE once the
+ * search was cancelled or a match was found in a range before it.
+ * Progress goes to the main thread whenever the percentage changes.
+ */
+static gboolean rp_search_job_advance (RPSearchJob *job, guint64 range, guint64 len)
+{
+    gboolean	bRet;
+    gint		percent;
+
+    if (g_cancellable_is_cancelled (job->cancellable))
+        return FALSE;
+
+    g_mutex_lock (&job->lock);
+
+    bRet        = range < job->hit_range;
+    job->done   += len;
+    percent     = (job->total > 0) ? (gint)(MIN (job->done, job->total) * 100 / job->total) : 100;
+
+    if (job->progress != NULL && percent != job->percent)
+    {
+        RPSearchProgress *report = g_new (RPSearchProgress, 1);
+
+        report->hex_file        = g_object_ref (job->hex_file);
+        report->progress        = job->progress;
+        report->progress_data   = job->progress_data;
+        report->done            = job->done;
+        report->total           = job->total;
+        job->percent            = percent;
+
+        g_main_context_invoke_full (job->context, G_PRIORITY_DEFAULT, rp_search_progress_report,
+                                    report, rp_search_progress_free);
+    }
+
+    g_mutex_unlock (&job->lock);
+
+    return bRet;
+}
+
+/* Windows of the document are either pieces read in place or copies into
+ * buf, consecutive windows overlap by the pattern length less one so a
+ * match across their border is seen by the later one. Only the window at
+ * the end of the document holds matches shorter than that close to its
+ * end. Holes can't hold a pattern with a byte other than zero and are
+ * stepped over. Expressions are always copied, after the bytes before
+ * the window they look back at. Matches starting in [pos, until) are
+ * looked for.
+ */
+static gboolean rp_search_job_forward (RPSearchJob *job, guint64 range, guint64 pos, guint64 until,
+                                       guchar *buf, guint64 *address)
+{
+    guint64	size = rp_hex_snapshot_get_size (job->snapshot);
+    gsize	m = job->pattern->len;
+
+    until = MIN (until, size - job->pattern->min_len + 1);
+
+    while (pos < until)
+    {
+        guint64			start, len;
+        gboolean		hole;
+        const guchar	*piece = rp_hex_snapshot_peek (job->snapshot, pos, &start, &len, &hole);
+        const guchar	*window;
+        gsize			window_len = MIN (RP_SEARCH_CHUNK_SIZE + m - 1, until - pos + m - 1);
+        gsize			before = 0;
+        gsize			read_len;
+        gsize			starts;
+        gssize			hit;
+
+        if (hole && !job->pattern->zero && start + len - pos >= m)
+        {
+            window_len = start + len - pos;
+            read_len = window_len;
+            window = NULL;
+        }
+        else if (piece != NULL && job->pattern->regex == NULL && start + len - pos >= m)
+        {
+            window_len = MIN (window_len, start + len - pos);
+            read_len = window_len;
+            window = piece + (pos - start);
+        }
+        else
+        {
+            before		= MIN (pos, job->pattern->behind);
+            read_len	= rp_hex_snapshot_get_data (job->snapshot, buf, before + window_len + job->pattern->ahead,
+                                                    pos - before);
+            window		= buf;
+
+            if (read_len < before + job->pattern->min_len)
+                break;
+
+            window_len = MIN (window_len, read_len - before);
+        }
+
+        starts = (pos + window_len < size) ? window_len - m + 1 : window_len - job->pattern->min_len + 1;
+        starts = MIN (starts, until - pos);
+
+        if (window != NULL)
+        {
+            hit = rp_search_pattern_scan_range (job->pattern, window, read_len, before, before + starts,
+                                                rp_search_regex_flags (pos - before, read_len, size), TRUE);
+
+            if (hit >= 0)
+            {
+                *address = pos - before + hit;
+                return TRUE;
+            }
+        }
+
+        pos += starts;
+
+        if (!rp_search_job_advance (job, range, starts))
+            break;
+    }
+
+    return FALSE;
+}
+
+/* Same as forward from the end of the range, matches starting in
+ * [lower, pos) are looked for. A window ends where the longest match
+ * from the last start in it would end.
+ */
+static gboolean rp_search_job_backward (RPSearchJob *job, guint64 range, guint64 pos, guint64 lower,
+                                        guchar *buf, guint64 *address)
+{
+    guint64	size = rp_hex_snapshot_get_size (job->snapshot);
+    gsize	m = job->pattern->len;
+
+    while (pos > lower)
+    {
+        guint64			end = MIN (pos - 1 + m, size);
+        guint64			start, len;
+        gboolean		hole;
+        const guchar	*piece = rp_hex_snapshot_peek (job->snapshot, end - 1, &start, &len, &hole);
+        const guchar	*window;
+        gsize			window_len = MIN (RP_SEARCH_CHUNK_SIZE + m - 1, end - lower);
+        gsize			before = 0;
+        gsize			read_len;
+        gsize			starts;
+        gssize			hit;
+
+        if (hole && !job->pattern->zero && end - start >= m)
+        {
+            window_len = end - start;
+            read_len = window_len;
+            window = NULL;
+        }
+        else if (piece != NULL && job->pattern->regex == NULL && end - start >= m)
+        {
+            window_len = MIN (window_len, end - start);
+            read_len = window_len;
+            window = piece + (end - window_len - start);
+        }
+        else
+        {
+            before		= MIN (end - window_len, job->pattern->behind);
+            read_len	= rp_hex_snapshot_get_data (job->snapshot, buf,
+                                                    before + window_len + MIN (job->pattern->ahead, size - end),
+                                                    end - window_len - before);
+            window		= buf;
+
+            if (read_len < before + window_len)
+                break;
+        }
+
+        starts = pos - (end - window_len);
+
+        if (window != NULL)
+        {
+            hit = rp_search_pattern_scan_range (job->pattern, window, read_len, before, before + starts,
+                                                rp_search_regex_flags (end - window_len - before, read_len, size),
+                                                FALSE);
+
+            if (hit >= 0)
+            {
+                *address = end - window_len - before + hit;
+                return *address >= lower;
+            }
+        }
+
+        pos = end - window_len;
+
+        if (!rp_search_job_advance (job, range, starts))
+            break;
+    }
+
+    return FALSE;
+}
+
+/* Search ranges until none is left that could hold an earlier match */
+static void rp_search_job_work (RPSearchJob *job)
+{
+    g_autofree guchar	*buf = g_malloc (job->pattern->behind + RP_SEARCH_CHUNK_SIZE + job->pattern->len - 1 +
+                                         job->pattern->ahead);
+    guint64				range;
+
+    for (;;)
+    {
+        guint64 first, address;
+        gboolean bFound;
+
+        g_mutex_lock (&job->lock);
+        range = job->next_range++;
+        g_mutex_unlock (&job->lock);
+
+        if (range >= job->ranges || g_cancellable_is_cancelled (job->cancellable))
+            break;
+
+        first = range * RP_SEARCH_RANGE_SIZE;
+
+        if (job->bForward)
+            bFound = rp_search_job_forward (job, range, job->from + first, 
+                                            job->from + MIN (first + RP_SEARCH_RANGE_SIZE, job->total),
+                                            buf, &address);
+        else
+            bFound = rp_search_job_backward (job, range, job->from - first,
+                                             job->from - MIN (first + RP_SEARCH_RANGE_SIZE, job->total),
+                                             buf, &address);
+
+        g_mutex_lock (&job->lock);
+
+        if (bFound && range < job->hit_range)
+        {
+            job->hit_range	= range;
+            job->hit		= address;
+        }
+
+        bFound = range >= job->hit_range;
+        g_mutex_unlock (&job->lock);
+
+        // Every range after this one comes too late
+        if (bFound)
+            break;
+    }
+
+    g_mutex_lock (&job->lock);
+
+    if (--job->running == 0)
+        g_cond_signal (&job->cond);
+
+    g_mutex_unlock (&job->lock);
+}
+
+static void rp_search_pool_func (gpointer data, gpointer user_data)
+{
+    rp_search_job_work (data);
+}
+
+/* Threads shared by all searches, created the first time one needs them */
+static GThreadPool *rp_search_get_pool (void)
+{
+    static GThreadPool *pool = NULL;
+
+    if (g_once_init_enter (&pool))
+        g_once_init_leave (&pool, g_thread_pool_new (rp_search_pool_func, NULL, -1, FALSE, NULL));
+
+    return pool;
+}
+
+/* The calling thread takes part, 'threads' includes it */
+static gboolean rp_search_job_run (RPSearchJob *job, guint64 *address)
+{
+    guint64	size = rp_hex_snapshot_get_size (job->snapshot);
+    gsize	min_len = job->pattern->min_len;
+    guint	helpers;
+
+    if (min_len > size)
+        return FALSE;
+
+    // Matches start at size - min_len at the latest
+    if (!job->bForward)
+        job->from = MIN (job->from, size - min_len + 1);
+
+    if (job->bForward ? job->from > size - min_len : job->from == 0)
+        return FALSE;
+
+    job->total		= job->bForward ? size - min_len + 1 - job->from : job->from;
+    job->ranges		= (job->total + RP_SEARCH_RANGE_SIZE - 1) / RP_SEARCH_RANGE_SIZE;
+    job->hit_range	= job->ranges;
+    job->percent	= -1;
+
+    if (job->threads == 0)
+        job->threads = g_get_num_processors ();
+
+    helpers		= MIN (job->threads, job->ranges) - 1;
+    job->running	= helpers + 1;
+
+    for (guint i = 0; i < helpers; i++)
+        g_thread_pool_push (rp_search_get_pool (), job, NULL);
+
+    rp_search_job_work (job);
+
+    g_mutex_lock (&job->lock);
+
+    while (job->running > 0)
+        g_cond_wait (&job->cond, &job->lock);
+
+    g_mutex_unlock (&job->lock);
+
+    *address = job->hit;
+
+    return job->hit_range < job->ranges;
+}
+
+static void rp_search_job_init (RPSearchJob *job, RPHexSnapshot *snapshot, RPSearchPattern *pattern,
+                                guint64 from, gboolean bForward, guint threads, GCancellable *cancellable)
+{
+    g_mutex_init (&job->lock);
+    g_cond_init (&job->cond);
+
+    job->snapshot		= rp_hex_snapshot_ref (snapshot);
+    job->pattern		= rp_search_pattern_ref (pattern);
+    job->from			= from;
+    job->bForward		= bForward;
+    job->threads		= threads;
+    job->cancellable	= cancellable ? g_object_ref (cancellable) : NULL;
+}
+
+static void rp_search_job_clear (RPSearchJob *job)
+{
+    rp_hex_snapshot_unref (job->snapshot);
+    rp_search_pattern_unref (job->pattern);
+    g_clear_object (&job->hex_file);
+    g_clear_object (&job->cancellable);
+    g_clear_pointer (&job->context, g_main_context_unref);
+    g_mutex_clear (&job->lock);
+    g_cond_clear (&job->cond);
+}
+
+/* Finds the first match starting at or after 'from', or searching
+ * backwards, the last one starting before it. Uses up to 'threads'
+ * threads, 0 for one per processor. Safe from any thread, returns FALSE
+ * if there is no match or the search was cancelled.
+ */
+gboolean rp_hex_snapshot_find (RPHexSnapshot *snapshot, RPSearchPattern *pattern, guint64 from,
+                               gboolean bForward, guint threads, GCancellable *cancellable, 
+                               guint64 *address)
+{
+    RPSearchJob	job = { 0 };
+    gboolean	bFound;
+
+    rp_search_job_init (&job, snapshot, pattern, from, bForward, threads, cancellable);
+    bFound = rp_search_job_run (&job, address);
+    rp_search_job_clear (&job);
+
+    return bFound;
+}
+
+/* Blocks until done, rp_hex_file_find_async for large documents */
+gboolean rp_hex_file_find (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 from,
+                           gboolean bForward, guint64 *address)
+{
+    RPHexSnapshot	*snapshot = rp_hex_file_snapshot (hex_file);
+    gboolean		bFound = rp_hex_snapshot_find (snapshot, pattern, from, bForward, 0, NULL, address);
+
+    rp_hex_snapshot_unref (snapshot);
+
+    return bFound;
+}
+
+static void rp_search_job_free (RPSearchJob *job)
+{
+    rp_search_job_clear (job);
+    g_free (job);
+}
+
+static void rp_hex_file_find_thread (GTask *task, gpointer source_object, gpointer task_data, 
+                                     GCancellable *cancellable)
+{
+    RPSearchJob	*job = task_data;
+    guint64		*address = g_new (guint64, 1);
+
+    if (rp_search_job_run (job, address))
+        g_task_return_pointer (task, address, g_free);
+    else
+    {
+        g_free (address);
+
+        if (!g_task_return_error_if_cancelled (task))
+            g_task_return_pointer (task, NULL, NULL);
+    }
+}
+
+/* Search the document as it is now on worker threads, it may be edited
+ * meanwhile. progress is called on the calling thread's main context.
+ */
+void rp_hex_file_find_async (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 from,
+                             gboolean bForward, guint threads, GCancellable *cancellable,
+                             RPHexFileProgress progress, gpointer progress_data,
+                             GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask			*task;
+    RPSearchJob		*job;
+    RPHexSnapshot	*snapshot;
+
+    g_return_if_fail (RP_IS_HEX_FILE (hex_file));
+
+    task = g_task_new (hex_file, cancellable, callback, user_data);
+    g_task_set_source_tag (task, rp_hex_file_find_async);
+
+    job			= g_new0 (RPSearchJob, 1);
+    snapshot	= rp_hex_file_snapshot (hex_file);
+
+    rp_search_job_init (job, snapshot, pattern, from, bForward, threads, cancellable);
+    rp_hex_snapshot_unref (snapshot);
+
+    job->hex_file		= g_object_ref (hex_file);
+    job->progress		= progress;
+    job->progress_data	= progress_data;
+    job->context		= g_main_context_ref_thread_default ();
+
+    g_task_set_task_data (task, job, (GDestroyNotify)rp_search_job_free);
+    g_task_run_in_thread (task, rp_hex_file_find_thread);
+    g_object_unref (task);
+}
+
+/* TRUE with the match in *address, FALSE if there is none or on error */
+gboolean rp_hex_file_find_finish (RPHexFile *hex_file, GAsyncResult *result, guint64 *address,
+                                  GError **error)
+{
+    g_autofree guint64 *found = NULL;
+
+    g_return_val_if_fail (g_task_is_valid (result, hex_file), FALSE);
+
+    if ((found = g_task_propagate_pointer (G_TASK (result), error)) == NULL)
+        return FALSE;
+
+    *address = *found;
+
+    return TRUE;
+}
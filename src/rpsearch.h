@@ -0,0 +1,76 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpsearch.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_SEARCH_H__
+#define __RP_SEARCH_H__
+
+#include "rphexfile.h"
+
+G_BEGIN_DECLS
+
+/* Byte pattern search. Candidates are found by comparing the first and
+ * the last byte of the pattern against 16 or 32 positions at once (SSE2,
+ * AVX2 where the CPU has it), only those are compared in full. A document
+ * is searched in chunks of RP_SEARCH_CHUNK_SIZE that overlap by the
+ * pattern length less one, pieces that can be read in place are scanned
+ * without copying them. Patterns with wildcards compare the ends of their
+ * longest fixed run instead, under the mask. Regular expressions (GRegex
+ * on raw bytes) are searched the same way, the windows overlap by the
+ * longest match allowed and are read with the bytes around them the
+ * expression looks at.
+ *
+ * Large documents are split into ranges of RP_SEARCH_RANGE_SIZE positions
+ * searched by several threads. Ranges are taken in the direction of the
+ * search and a match ends the ranges behind it, so a match close to the
+ * start is found about as fast as with one thread.
+ */
+#define RP_SEARCH_CHUNK_SIZE	(1024 * 1024)
+#define RP_SEARCH_RANGE_SIZE	(8 * 1024 * 1024)
+
+typedef struct _RPSearchPattern	RPSearchPattern;
+
+RPSearchPattern	*rp_search_pattern_new (const guchar *bytes, gsize len);
+RPSearchPattern	*rp_search_pattern_new_masked (const guchar *bytes, const guchar *mask, gsize len);
+RPSearchPattern	*rp_search_pattern_new_from_hex (const gchar *text, GError **error);
+RPSearchPattern	*rp_search_pattern_new_regex (const gchar *text, gsize max_len, GError **error);
+RPSearchPattern	*rp_search_pattern_ref (RPSearchPattern *pattern);
+void			rp_search_pattern_unref (RPSearchPattern *pattern);
+gsize			rp_search_pattern_get_length (RPSearchPattern *pattern);
+const guchar	*rp_search_pattern_get_bytes (RPSearchPattern *pattern);
+gboolean		rp_search_pattern_has_wildcards (RPSearchPattern *pattern);
+gssize			rp_search_pattern_scan (RPSearchPattern *pattern, const guchar *buf, gsize len,
+                                        gboolean bForward);
+
+gboolean		rp_hex_snapshot_find (RPHexSnapshot *snapshot, RPSearchPattern *pattern, guint64 from,
+                                      gboolean bForward, guint threads, GCancellable *cancellable,
+                                      guint64 *address);
+gssize			rp_hex_snapshot_match (RPHexSnapshot *snapshot, RPSearchPattern *pattern, guint64 address);
+gssize			rp_hex_file_match (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 address);
+gboolean		rp_hex_file_find (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 from,
+                                  gboolean bForward, guint64 *address);
+void			rp_hex_file_find_async (RPHexFile *hex_file, RPSearchPattern *pattern, guint64 from,
+                                        gboolean bForward, guint threads, GCancellable *cancellable,
+                                        RPHexFileProgress progress, gpointer progress_data,
+                                        GAsyncReadyCallback callback, gpointer user_data);
+gboolean		rp_hex_file_find_finish (RPHexFile *hex_file, GAsyncResult *result, guint64 *address,
+                                         GError **error);
+
+G_END_DECLS
+
+#endif
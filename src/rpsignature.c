@@ -0,0 +1,654 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpsignature.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "rpsignature.h"
+#include "rpsearch.h"
+
+#define RP_SIGNATURE_CHUNK_SIZE	(1024 * 1024)
+#define RP_SIGNATURE_OUTPUT		0x80000000u		// Transition into a state where signatures end
+#define RP_SIGNATURE_SHALLOW	0x40000000u		// Transition into the start state or one below
+#define RP_SIGNATURE_ROW		0x3fffffffu
+#define RP_SIGNATURE_PAIRS		16				// Pairs compared with SSE2 at most
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Bytes no signature uses share class 0, every other byte has a class of
+ * its own, which keeps the transition table small for short lists. The
+ * table holds the row offset of the next state, so stepping costs one
+ * load per byte. In the start state bytes are skipped up to the next pair
+ * of bytes a signature starts with, most of the data never reaches the
+ * table. With few such pairs SSE2 compares them at 16 positions at once.
+ */
+struct _RPSignatureSet
+{
+    gint		ref_count;
+    GPtrArray	*names;
+    GPtrArray	*bytes;			// GBytes of every signature
+    GMutex		lock;			// Guards building the automaton
+    guint32		*next;			// 'classes' transitions per state
+    guint32		*first;			// Per state, the first signature ending there + 1, 0 if none
+    guint32		*dict;			// Per state, the closest suffix state where one ends
+    guint32		*same;			// Per signature, the next one ending in the same state + 1
+    guint		states;
+    guint		classes;
+    guint16		class_of[256];
+    guint8		start[65536 / 8];	// Bit per pair of bytes a signature can start with
+    guint		pairs;			// Different start pairs, up to RP_SIGNATURE_PAIRS + 1
+    guchar		pair_first[RP_SIGNATURE_PAIRS][16];
+    guchar		pair_second[RP_SIGNATURE_PAIRS][16];
+    guchar		pair_any[RP_SIGNATURE_PAIRS][16];	// 0xff where any second byte will do
+};
+
+typedef struct
+{
+    RPHexFile			*hex_file;
+    RPHexSnapshot		*snapshot;
+    RPSignatureSet		*set;
+    GCancellable		*cancellable;
+    RPHexFileProgress	progress;
+    gpointer			progress_data;
+    GMainContext		*context;	// Where progress is reported
+    gint				percent;	// Last reported
+} RPSignatureJob;
+
+typedef struct
+{
+    RPHexFile			*hex_file;
+    RPHexFileProgress	progress;
+    gpointer			progress_data;
+    guint64				done;
+    guint64				total;
+} RPSignatureProgress;
+
+RPSignatureSet *rp_signature_set_new (void)
+{
+    RPSignatureSet *set = g_new0 (RPSignatureSet, 1);
+
+    set->ref_count	= 1;
+    set->names		= g_ptr_array_new_with_free_func (g_free);
+    set->bytes		= g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+    g_mutex_init (&set->lock);
+
+    return set;
+}
+
+RPSignatureSet *rp_signature_set_ref (RPSignatureSet *set)
+{
+    g_atomic_int_inc (&set->ref_count);
+
+    return set;
+}
+
+void rp_signature_set_unref (RPSignatureSet *set)
+{
+    if (set == NULL || !g_atomic_int_dec_and_test (&set->ref_count))
+        return;
+
+    g_ptr_array_unref (set->names);
+    g_ptr_array_unref (set->bytes);
+    g_mutex_clear (&set->lock);
+    g_free (set->next);
+    g_free (set->first);
+    g_free (set->dict);
+    g_free (set->same);
+    g_free (set);
+}
+
+/* Returns the id of the signature. Nothing can be added once the set was
+ * used for a scan.
+ */
+guint rp_signature_set_add (RPSignatureSet *set, const gchar *name, const guchar *bytes, gsize len)
+{
+    g_return_val_if_fail (set->next == NULL, 0);
+    g_return_val_if_fail (len > 0, 0);
+
+    g_ptr_array_add (set->names, g_strdup (name));
+    g_ptr_array_add (set->bytes, g_bytes_new (bytes, len));
+
+    return set->names->len - 1;
+}
+
+/* Adds the signatures in a signature file, see rpsignature.h */
+gboolean rp_signature_set_load (RPSignatureSet *set, const gchar *path, GError **error)
+{
+    g_autofree gchar	*contents = NULL;
+    g_auto(GStrv)		lines = NULL;
+    guint				count = 0;
+
+    if (!g_file_get_contents (path, &contents, NULL, error))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", -1);
+
+    for (guint i = 0; lines[i] != NULL; i++)
+    {
+        g_autoptr(GError)	local_error = NULL;
+        gchar				*line = g_strstrip (lines[i]);
+        gchar				*hex = strchr (line, '=');
+        RPSearchPattern		*pattern;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        if (hex != NULL)
+        {
+            *hex++ = '\0';
+            g_strstrip (line);
+        }
+        else
+            hex = line;
+
+        if ((pattern = rp_search_pattern_new_from_hex (hex, &local_error)) == NULL)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Line %u: %s", i + 1, local_error->message);
+            return FALSE;
+        }
+
+        if (rp_search_pattern_has_wildcards (pattern))
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Line %u: Signatures can't have wildcards", i + 1);
+            rp_search_pattern_unref (pattern);
+            return FALSE;
+        }
+
+        rp_signature_set_add (set, (*line != '\0') ? line : g_strstrip (hex),
+                              rp_search_pattern_get_bytes (pattern), rp_search_pattern_get_length (pattern));
+        rp_search_pattern_unref (pattern);
+        count++;
+    }
+
+    if (count == 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "No signatures in %s", path);
+        return FALSE;
+    }
+
+    g_message ("Signature: Loaded %u signatures from %s", count, path);
+
+    return TRUE;
+}
+
+guint rp_signature_set_get_size (RPSignatureSet *set)
+{
+    return set->names->len;
+}
+
+const gchar *rp_signature_set_get_name (RPSignatureSet *set, guint id)
+{
+    g_return_val_if_fail (id < set->names->len, NULL);
+
+    return g_ptr_array_index (set->names, id);
+}
+
+gsize rp_signature_set_get_length (RPSignatureSet *set, guint id)
+{
+    g_return_val_if_fail (id < set->bytes->len, 0);
+
+    return g_bytes_get_size (g_ptr_array_index (set->bytes, id));
+}
+
+static void rp_signature_set_add_start (RPSignatureSet *set, const guchar *bytes, gsize len)
+{
+    guint k;
+
+    // A single byte starts a pair with any other
+    for (guint pair = bytes[0] << 8; pair <= (guint)(bytes[0] << 8 | 0xff); pair++)
+        if (len == 1 || (pair & 0xff) == bytes[1])
+            set->start[pair >> 3] |= 1 << (pair & 7);
+
+    for (k = 0; k < MIN (set->pairs, RP_SIGNATURE_PAIRS); k++)
+        if (set->pair_first[k][0] == bytes[0] && (set->pair_any[k][0] || (len > 1 && set->pair_second[k][0] == bytes[1])))
+            return;
+
+    if (set->pairs > RP_SIGNATURE_PAIRS || (k = set->pairs++) == RP_SIGNATURE_PAIRS)
+        return;
+
+    memset (set->pair_first[k], bytes[0], 16);
+    memset (set->pair_second[k], (len > 1) ? bytes[1] : 0, 16);
+    memset (set->pair_any[k], (len > 1) ? 0 : 0xff, 16);
+}
+
+/* Trie of all signatures first, then the missing transitions are filled
+ * in breadth first from the state of the longest proper suffix, which
+ * makes the automaton deterministic.
+ */
+static void rp_signature_set_build (RPSignatureSet *set)
+{
+    g_autoptr(GArray)	next = g_array_new (FALSE, TRUE, sizeof (guint32));
+    g_autoptr(GArray)	first = g_array_new (FALSE, TRUE, sizeof (guint32));
+    g_autofree guint32	*fail = NULL;
+    g_autofree guint32	*queue = NULL;
+    g_autofree gboolean	*shallow = NULL;
+    gboolean			used[256] = { FALSE };
+    guint				head = 0;
+    guint				tail = 0;
+    guint				classes = 1;
+    guint				states = 1;
+
+    g_mutex_lock (&set->lock);
+
+    if (set->next != NULL)
+    {
+        g_mutex_unlock (&set->lock);
+        return;
+    }
+
+    memset (set->class_of, 0, sizeof (set->class_of));
+
+    for (guint id = 0; id < set->bytes->len; id++)
+    {
+        gsize			len;
+        const guchar	*bytes = g_bytes_get_data (g_ptr_array_index (set->bytes, id), &len);
+
+        rp_signature_set_add_start (set, bytes, len);
+
+        for (gsize i = 0; i < len; i++)
+        {
+            if (!used[bytes[i]])
+            {
+                used[bytes[i]] = TRUE;
+                set->class_of[bytes[i]] = classes++;
+            }
+        }
+    }
+
+    set->same = g_new0 (guint32, set->bytes->len);
+    g_array_set_size (next, classes);
+    g_array_set_size (first, 1);
+
+    for (guint id = 0; id < set->bytes->len; id++)
+    {
+        gsize			len;
+        const guchar	*bytes = g_bytes_get_data (g_ptr_array_index (set->bytes, id), &len);
+        guint32			state = 0;
+
+        for (gsize i = 0; i < len; i++)
+        {
+            guint32 *to = &g_array_index (next, guint32, state * classes + set->class_of[bytes[i]]);
+
+            if (*to == 0)
+            {
+                *to = states++;
+                g_array_set_size (next, states * classes);
+                g_array_set_size (first, states);
+                to = &g_array_index (next, guint32, state * classes + set->class_of[bytes[i]]);
+            }
+
+            state = *to;
+        }
+
+        set->same[id] = g_array_index (first, guint32, state);
+        g_array_index (first, guint32, state) = id + 1;
+    }
+
+    set->next	= (guint32 *)g_array_free (g_steal_pointer (&next), FALSE);
+    set->first	= (guint32 *)g_array_free (g_steal_pointer (&first), FALSE);
+    set->dict	= g_new0 (guint32, states);
+    set->states	= states;
+    set->classes	= classes;
+    fail		= g_new0 (guint32, states);
+    queue		= g_new (guint32, states);
+
+    shallow		= g_new0 (gboolean, states);
+    shallow[0]	= TRUE;
+
+    // Children of the root fall back to the root itself
+    for (guint c = 0; c < classes; c++)
+    {
+        if (set->next[c] != 0)
+        {
+            queue[tail++] = set->next[c];
+            shallow[set->next[c]] = TRUE;
+        }
+    }
+
+    while (head < tail)
+    {
+        guint32 state = queue[head++];
+
+        for (guint c = 0; c < classes; c++)
+        {
+            guint32 *to = &set->next[state * classes + c];
+            guint32 back = set->next[fail[state] * classes + c];
+
+            if (*to == 0)
+            {
+                *to = back;
+                continue;
+            }
+
+            fail[*to]		= back;
+            set->dict[*to]	= set->first[back] ? back : set->dict[back];
+            queue[tail++]	= *to;
+        }
+    }
+
+    for (gsize i = 0; i < (gsize)states * classes; i++)
+    {
+        guint32 to = set->next[i];
+
+        set->next[i] = to * classes | ((set->first[to] || set->dict[to]) ? RP_SIGNATURE_OUTPUT : 0) |
+                       (shallow[to] ? RP_SIGNATURE_SHALLOW : 0);
+    }
+
+    g_message ("Signature: Automaton with %u states and %u byte classes", states, classes);
+
+    g_mutex_unlock (&set->lock);
+}
+
+/* Appends the signatures ending at 'end' in state, FALSE once there are
+ * RP_SIGNATURE_MAX_HITS.
+ */
+static gboolean rp_signature_report (RPSignatureSet *set, guint32 state, guint64 end, GArray *hits)
+{
+    for (; state != 0; state = set->dict[state])
+    {
+        for (guint32 id = set->first[state]; id != 0; id = set->same[id - 1])
+        {
+            RPSignatureHit hit;
+
+            if (hits->len >= RP_SIGNATURE_MAX_HITS)
+                return FALSE;
+
+            hit.id		= id - 1;
+            hit.address	= end + 1 - rp_signature_set_get_length (set, hit.id);
+
+            g_array_append_val (hits, hit);
+        }
+    }
+
+    return TRUE;
+}
+
+static inline gboolean rp_signature_may_start (const RPSignatureSet *set, guchar a, guchar b)
+{
+    guint pair = a << 8 | b;
+
+    return (set->start[pair >> 3] & (1 << (pair & 7))) != 0;
+}
+
+/* First position from i on where a start pair begins, the last one if
+ * there is none before.
+ */
+static gsize rp_signature_skip (const RPSignatureSet *set, const guchar *data, gsize i, gsize len)
+{
+#ifdef __SSE2__
+    for (; set->pairs <= RP_SIGNATURE_PAIRS && i + 17 <= len; i += 16)
+    {
+        __m128i	a = _mm_loadu_si128 ((const __m128i *)(data + i));
+        __m128i	b = _mm_loadu_si128 ((const __m128i *)(data + i + 1));
+        __m128i	hit = _mm_setzero_si128 ();
+        guint	mask;
+
+        for (guint k = 0; k < set->pairs; k++)
+        {
+            __m128i first = _mm_cmpeq_epi8 (a, _mm_loadu_si128 ((const __m128i *)set->pair_first[k]));
+            __m128i second = _mm_cmpeq_epi8 (b, _mm_loadu_si128 ((const __m128i *)set->pair_second[k]));
+
+            second	= _mm_or_si128 (second, _mm_loadu_si128 ((const __m128i *)set->pair_any[k]));
+            hit		= _mm_or_si128 (hit, _mm_and_si128 (first, second));
+        }
+
+        if ((mask = _mm_movemask_epi8 (hit)) != 0)
+            return i + __builtin_ctz (mask);
+    }
+#endif
+
+    for (; i + 1 < len; i++)
+        if (rp_signature_may_start (set, data[i], data[i + 1]))
+            break;
+
+    return i;
+}
+
+/* Run len bytes at 'address' through the automaton, *state is the row
+ * offset of the current state. The start state skips bytes that begin no
+ * signature together with the next one, the automaton would get to where
+ * that next byte takes it from the start state anyway. So does the state
+ * one byte in when the next byte doesn't go deeper.
+ */
+static gboolean rp_signature_feed (RPSignatureSet *set, guint32 *state, const guchar *data, gsize len,
+                                   guint64 address, GArray *hits)
+{
+    const guint32	*next = set->next;
+    const guint16	*class_of = set->class_of;
+    guint32			row = *state;
+
+    for (gsize i = 0; i < len; i++)
+    {
+        guint32 to;
+
+        if (row == 0)
+            i = rp_signature_skip (set, data, i, len);
+
+        to	= next[row + class_of[data[i]]];
+        row	= to & RP_SIGNATURE_ROW;
+
+        if (G_UNLIKELY (to & RP_SIGNATURE_OUTPUT) &&
+            !rp_signature_report (set, row / set->classes, address + i, hits))
+        {
+            *state = row;
+            return FALSE;
+        }
+
+        if ((to & RP_SIGNATURE_SHALLOW) && i + 1 < len && !rp_signature_may_start (set, data[i], data[i + 1]))
+            row = 0;
+    }
+
+    *state = row;
+
+    return TRUE;
+}
+
+static gboolean rp_signature_progress_report (gpointer data)
+{
+    RPSignatureProgress *report = data;
+
+    report->progress (report->hex_file, report->done, report->total, report->progress_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void rp_signature_progress_free (gpointer data)
+{
+    RPSignatureProgress *report = data;
+
+    g_object_unref (report->hex_file);
+    g_free (report);
+}
+
+/* Progress goes to the main thread whenever the percentage changes */
+static gboolean rp_signature_job_advance (RPSignatureJob *job, guint64 done, guint64 total)
+{
+    gint percent = (total > 0) ? (gint)(done * 100 / total) : 100;
+
+    if (job->progress != NULL && percent != job->percent)
+    {
+        RPSignatureProgress *report = g_new (RPSignatureProgress, 1);
+
+        report->hex_file		= g_object_ref (job->hex_file);
+        report->progress		= job->progress;
+        report->progress_data	= job->progress_data;
+        report->done			= done;
+        report->total			= total;
+        job->percent			= percent;
+
+        g_main_context_invoke_full (job->context, G_PRIORITY_DEFAULT, rp_signature_progress_report,
+                                    report, rp_signature_progress_free);
+    }
+
+    return !g_cancellable_is_cancelled (job->cancellable);
+}
+
+static gint rp_signature_hit_compare (gconstpointer a, gconstpointer b)
+{
+    const RPSignatureHit *hit_a = a;
+    const RPSignatureHit *hit_b = b;
+
+    if (hit_a->address != hit_b->address)
+        return (hit_a->address < hit_b->address) ? -1 : 1;
+
+    return (hit_a->id > hit_b->id) - (hit_a->id < hit_b->id);
+}
+
+/* Pieces that can be read in place are fed as they are, the rest is
+ * copied in chunks. Zeros of a hole are fed until the automaton stays in
+ * the same state without a signature ending, the rest of the hole would
+ * change nothing.
+ */
+static GArray *rp_signature_job_run (RPSignatureJob *job)
+{
+    g_autofree guchar	*buf = g_malloc (RP_SIGNATURE_CHUNK_SIZE);
+    GArray				*hits = g_array_new (FALSE, FALSE, sizeof (RPSignatureHit));
+    guint64				size = rp_hex_snapshot_get_size (job->snapshot);
+    guint64				pos = 0;
+    guint32				state = 0;
+    gboolean			bFull = FALSE;
+    gboolean			bZeros = FALSE;		// buf holds zeros
+
+    rp_signature_set_build (job->set);
+
+    while (!bFull && pos < size)
+    {
+        guint64			start, len;
+        gboolean		hole;
+        const guchar	*piece = rp_hex_snapshot_peek (job->snapshot, pos, &start, &len, &hole);
+        const guchar	*data;
+        gsize			chunk = MIN (RP_SIGNATURE_CHUNK_SIZE, size - pos);
+
+        if (hole)
+        {
+            chunk = MIN (chunk, start + len - pos);
+            data = buf;
+
+            if (!bZeros)
+                memset (buf, 0, RP_SIGNATURE_CHUNK_SIZE);
+
+            bZeros = TRUE;
+        }
+        else if (piece != NULL)
+        {
+            chunk = MIN (chunk, start + len - pos);
+            data = piece + (pos - start);
+        }
+        else
+        {
+            chunk = rp_hex_snapshot_get_data (job->snapshot, buf, chunk, pos);
+            data = buf;
+            bZeros = FALSE;
+
+            if (chunk == 0)
+                break;
+        }
+
+        bFull = !rp_signature_feed (job->set, &state, data, chunk, pos, hits);
+        pos += chunk;
+
+        if (hole && ((job->set->next[state + job->set->class_of[0]] & ~RP_SIGNATURE_SHALLOW) == state ||
+                     (state == 0 && !rp_signature_may_start (job->set, 0, 0))))
+            pos = start + len;
+
+        if (!rp_signature_job_advance (job, pos, size))
+        {
+            g_array_unref (hits);
+            return NULL;
+        }
+    }
+
+    g_array_sort (hits, rp_signature_hit_compare);
+
+    return hits;
+}
+
+static void rp_signature_job_free (RPSignatureJob *job)
+{
+    rp_hex_snapshot_unref (job->snapshot);
+    rp_signature_set_unref (job->set);
+    g_clear_object (&job->hex_file);
+    g_clear_object (&job->cancellable);
+    g_clear_pointer (&job->context, g_main_context_unref);
+    g_free (job);
+}
+
+/* All hits in the document ordered by address, NULL if cancelled. Safe
+ * from any thread.
+ */
+GArray *rp_hex_snapshot_scan (RPHexSnapshot *snapshot, RPSignatureSet *set, GCancellable *cancellable)
+{
+    RPSignatureJob job = { 0 };
+
+    job.snapshot	= snapshot;
+    job.set			= set;
+    job.cancellable	= cancellable;
+
+    return rp_signature_job_run (&job);
+}
+
+static void rp_hex_file_scan_thread (GTask *task, gpointer source_object, gpointer task_data,
+                                     GCancellable *cancellable)
+{
+    GArray *hits = rp_signature_job_run (task_data);
+
+    if (hits != NULL)
+        g_task_return_pointer (task, hits, (GDestroyNotify)g_array_unref);
+    else if (!g_task_return_error_if_cancelled (task))
+        g_task_return_pointer (task, NULL, NULL);
+}
+
+/* Scan the document as it is now on a worker thread, it may be edited
+ * meanwhile. progress is called on the calling thread's main context.
+ */
+void rp_hex_file_scan_async (RPHexFile *hex_file, RPSignatureSet *set, GCancellable *cancellable,
+                             RPHexFileProgress progress, gpointer progress_data,
+                             GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask			*task;
+    RPSignatureJob	*job;
+
+    g_return_if_fail (RP_IS_HEX_FILE (hex_file));
+
+    task = g_task_new (hex_file, cancellable, callback, user_data);
+    g_task_set_source_tag (task, rp_hex_file_scan_async);
+
+    job					= g_new0 (RPSignatureJob, 1);
+    job->hex_file		= g_object_ref (hex_file);
+    job->snapshot		= rp_hex_file_snapshot (hex_file);
+    job->set			= rp_signature_set_ref (set);
+    job->cancellable	= cancellable ? g_object_ref (cancellable) : NULL;
+    job->progress		= progress;
+    job->progress_data	= progress_data;
+    job->percent		= -1;
+    job->context		= g_main_context_ref_thread_default ();
+
+    g_task_set_task_data (task, job, (GDestroyNotify)rp_signature_job_free);
+    g_task_run_in_thread (task, rp_hex_file_scan_thread);
+    g_object_unref (task);
+}
+
+/* The RPSignatureHit table, NULL on error */
+GArray *rp_hex_file_scan_finish (RPHexFile *hex_file, GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, hex_file), NULL);
+
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rpsignature.h
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RP_SIGNATURE_H__
+#define __RP_SIGNATURE_H__
+
+#include "rphexfile.h"
+
+G_BEGIN_DECLS
+
+/* Looks for many byte signatures at once. The signatures are compiled
+ * into an Aho-Corasick automaton on the first scan, which then reads the
+ * document once from start to end, whatever the number of signatures.
+ * Holes are only read as far as it takes the automaton to settle.
+ *
+ * A signature file has one signature per line, a name, '=' and the hex
+ * bytes, or just the bytes. Blank lines and lines starting with '#' are
+ * skipped. Signatures can't have wildcards.
+ *
+ *     # Executables
+ *     PE = 4D 5A
+ *     ELF = 7F 45 4C 46
+ *
+ * A scan keeps at most RP_SIGNATURE_MAX_HITS hits and stops there.
+ */
+#define RP_SIGNATURE_MAX_HITS	100000
+
+typedef struct _RPSignatureSet	RPSignatureSet;
+
+typedef struct
+{
+    guint64	address;
+    guint	id;			// Index of the signature in its set
+} RPSignatureHit;
+
+RPSignatureSet	*rp_signature_set_new (void);
+RPSignatureSet	*rp_signature_set_ref (RPSignatureSet *set);
+void			rp_signature_set_unref (RPSignatureSet *set);
+guint			rp_signature_set_add (RPSignatureSet *set, const gchar *name, const guchar *bytes, gsize len);
+gboolean		rp_signature_set_load (RPSignatureSet *set, const gchar *path, GError **error);
+guint			rp_signature_set_get_size (RPSignatureSet *set);
+const gchar		*rp_signature_set_get_name (RPSignatureSet *set, guint id);
+gsize			rp_signature_set_get_length (RPSignatureSet *set, guint id);
+
+GArray			*rp_hex_snapshot_scan (RPHexSnapshot *snapshot, RPSignatureSet *set, GCancellable *cancellable);
+void			rp_hex_file_scan_async (RPHexFile *hex_file, RPSignatureSet *set, GCancellable *cancellable,
+                                        RPHexFileProgress progress, gpointer progress_data,
+                                        GAsyncReadyCallback callback, gpointer user_data);
+GArray			*rp_hex_file_scan_finish (RPHexFile *hex_file, GAsyncResult *result, GError **error);
+
+G_END_DECLS
+
+#endif
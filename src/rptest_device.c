@@ -0,0 +1,259 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rptest_device.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Editing a block device in place. A temporary image is attached to a
+ * loop device with 4096 byte sectors, bytes that don't line up with the
+ * sectors are overtyped and saved, and the image must then hold exactly
+ * the document. Needs root and losetup, without them the test is skipped
+ * (exit code 77). Opening a character device must fail instead of
+ * showing an empty document.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+#include "rphexfile.h"
+
+#define RP_TEST_SKIP			77
+#define RP_TEST_IMAGE_SIZE		(1024 * 1024)
+#define RP_TEST_SECTOR_SIZE		4096
+
+/* Overtyped runs, none of them starts or ends on a sector boundary */
+static const struct
+{
+    guint64	address;
+    guint	len;
+} test_edits[] =
+{
+    { 1, 1 },
+    { 4095, 2 },
+    { 8190, 5 },
+    { 65536 + 5, 100 },
+    { RP_TEST_IMAGE_SIZE / 2 + 4095, 2 },
+    { RP_TEST_IMAGE_SIZE - 1, 1 }
+};
+
+static gboolean rp_test_char_device (void)
+{
+    g_autoptr(GFile)	file = g_file_new_for_path ("/dev/null");
+    g_autoptr(GError)	error = NULL;
+    RPHexFile			*hex_file;
+
+    hex_file = rp_hex_file_new_with_file (file, RP_HEX_FILE_OPEN_READ_ONLY, &error);
+
+    if (hex_file != NULL)
+    {
+        g_printerr ("/dev/null was opened, %" G_GUINT64_FORMAT " bytes\n", rp_hex_file_get_size (hex_file));
+        g_object_unref (hex_file);
+        return FALSE;
+    }
+
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+        g_printerr ("/dev/null: unexpected error %s\n", error->message);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Run losetup, returns its output or NULL with the reason printed */
+static gchar *rp_test_losetup (const gchar * const *args)
+{
+    g_autoptr(GPtrArray)	argv = g_ptr_array_new ();
+    g_autoptr(GError)		error = NULL;
+    g_autofree gchar		*err_output = NULL;
+    gchar					*output = NULL;
+    gint					status;
+
+    g_ptr_array_add (argv, "losetup");
+
+    for (; *args != NULL; args++)
+        g_ptr_array_add (argv, (gpointer)*args);
+
+    g_ptr_array_add (argv, NULL);
+
+    if (!g_spawn_sync (NULL, (gchar **)argv->pdata, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
+                       &output, &err_output, &status, &error))
+    {
+        g_printerr ("losetup: %s\n", error->message);
+        return NULL;
+    }
+
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+        g_printerr ("losetup: %s", err_output);
+        g_free (output);
+        return NULL;
+    }
+
+    return g_strstrip (output);
+}
+
+/* Overtype the device, save it in place and read the document back */
+static gboolean rp_test_edit_device (const gchar *device, guchar *data)
+{
+    g_autoptr(GFile)	file = g_file_new_for_path (device);
+    g_autoptr(GError)	error = NULL;
+    g_autofree guchar	*buf = g_malloc (RP_TEST_IMAGE_SIZE);
+    RPHexFile			*hex_file;
+    gboolean			bRet = FALSE;
+
+    hex_file = rp_hex_file_new_with_file (file, RP_HEX_FILE_OPEN_NONE, &error);
+
+    if (hex_file == NULL)
+    {
+        g_printerr ("Can't open %s: %s\n", device, error->message);
+        return FALSE;
+    }
+
+    if (rp_hex_file_get_size (hex_file) != RP_TEST_IMAGE_SIZE || hex_file->sector_size != RP_TEST_SECTOR_SIZE ||
+        rp_hex_file_is_read_only (hex_file))
+    {
+        g_printerr ("%s: %" G_GUINT64_FORMAT " bytes in %u byte sectors%s\n", device,
+                    rp_hex_file_get_size (hex_file), hex_file->sector_size,
+                    rp_hex_file_is_read_only (hex_file) ? ", read-only" : "");
+        g_object_unref (hex_file);
+        return FALSE;
+    }
+
+    for (guint k = 0; k < G_N_ELEMENTS (test_edits); k++)
+    {
+        rp_hex_file_begin_user_action (hex_file);
+
+        for (guint i = 0; i < test_edits[k].len; i++)
+        {
+            guchar c = 0xa0 + k;
+
+            rp_hex_file_change_data (hex_file, mod_replace, test_edits[k].address + i, 1, &c, i * 2);
+            data[test_edits[k].address + i] = c;
+        }
+
+        rp_hex_file_end_user_action (hex_file);
+    }
+
+    if (!rp_hex_file_only_overtype_changes (hex_file))
+        g_printerr ("%s: overtyping changed the layout\n", device);
+    else if (!rp_hex_file_write_in_place (hex_file, &error))
+        g_printerr ("Can't save %s: %s\n", device, error->message);
+    else if (rp_hex_file_get_is_modified (hex_file))
+        g_printerr ("%s: still modified after saving\n", device);
+    else if (rp_hex_file_get_data (hex_file, buf, RP_TEST_IMAGE_SIZE, 0) != RP_TEST_IMAGE_SIZE ||
+             memcmp (buf, data, RP_TEST_IMAGE_SIZE) != 0)
+        g_printerr ("%s: the saved document differs from what was typed\n", device);
+    else
+        bRet = TRUE;
+
+    rp_hex_file_discard_journal (hex_file);
+    g_object_unref (hex_file);
+
+    return bRet;
+}
+
+int main (void)
+{
+    g_autoptr(GError)	error = NULL;
+    g_autofree gchar	*image = NULL;
+    g_autofree gchar	*device = NULL;
+    g_autofree gchar	*contents = NULL;
+    g_autofree gchar	*losetup = NULL;
+    g_autofree guchar	*data = NULL;
+    gchar				sector_size[16];
+    gsize				len;
+    gboolean			bRet;
+    gint				fd;
+
+#ifndef __linux__
+    g_print ("skipped: loop devices are Linux only\n");
+    return RP_TEST_SKIP;
+#endif
+
+    if (!rp_test_char_device ())
+        return 1;
+
+    if (geteuid () != 0)
+    {
+        g_print ("skipped: attaching a loop device needs root\n");
+        return RP_TEST_SKIP;
+    }
+
+    losetup = g_find_program_in_path ("losetup");
+
+    if (losetup == NULL)
+    {
+        g_print ("skipped: losetup isn't installed\n");
+        return RP_TEST_SKIP;
+    }
+
+    data = g_malloc (RP_TEST_IMAGE_SIZE);
+
+    for (gsize i = 0; i < RP_TEST_IMAGE_SIZE; i++)
+        data[i] = (i * 7) ^ (i >> 12);
+
+    fd = g_file_open_tmp ("rptest-XXXXXX", &image, &error);
+
+    if (fd < 0)
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    close (fd);
+
+    if (!g_file_set_contents (image, (const gchar *)data, RP_TEST_IMAGE_SIZE, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        g_unlink (image);
+        return 1;
+    }
+
+    g_snprintf (sector_size, sizeof (sector_size), "%d", RP_TEST_SECTOR_SIZE);
+    device = rp_test_losetup ((const gchar *[]){ "--sector-size", sector_size, "--find", "--show", image, NULL });
+
+    // No loop devices in this container or kernel
+    if (device == NULL)
+    {
+        g_print ("skipped: can't attach %s to a loop device\n", image);
+        g_unlink (image);
+        return RP_TEST_SKIP;
+    }
+
+    bRet = rp_test_edit_device (device, data);
+
+    g_free (rp_test_losetup ((const gchar *[]){ "--detach", device, NULL }));
+
+    if (bRet && !g_file_get_contents (image, &contents, &len, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        bRet = FALSE;
+    }
+    else if (bRet && (len != RP_TEST_IMAGE_SIZE || memcmp (contents, data, len) != 0))
+    {
+        g_printerr ("%s: the image differs from the saved document\n", image);
+        bRet = FALSE;
+    }
+
+    g_unlink (image);
+
+    if (bRet)
+        g_print ("%s: %u unaligned runs saved in place\n", device, (guint)G_N_ELEMENTS (test_edits));
+
+    return bRet ? 0 : 1;
+}
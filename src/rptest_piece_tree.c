@@ -0,0 +1,277 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rptest_piece_tree.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Random inserts and deletes on a piece tree, checked against a flat
+ * array holding where every byte of the document comes from:
+ *
+ *   rptest_piece_tree [SEED]
+ *
+ * Pieces removed by a delete are put back somewhere else the way undo
+ * does it, and copies of the tree must not change when the tree does.
+ */
+
+#include <string.h>
+#include "rppiecetree.h"
+
+#define RP_TEST_STEPS			10000
+#define RP_TEST_PIECE_MAX		64
+#define RP_TEST_DELETE_MAX		(2 * RP_TEST_PIECE_MAX)
+#define RP_TEST_DOC_MAX			(16 * 1024)
+#define RP_TEST_COPIES			4
+#define RP_TEST_PROBES			8
+#define RP_TEST_MEM_SOURCE		((guint64)1 << 63)	// Marks a byte from memory
+
+typedef struct
+{
+    RPPieceTree	*tree;
+    GArray		*sources;
+} RPTestCopy;
+
+static GRand		*test_rand;
+static guchar		*test_memory;				// Where loc_mem pieces point to
+static gsize		test_memory_used;
+static guint64		test_file_used;
+static GArray		*test_sources;				// Source of every document byte
+
+/* Where byte i of a piece comes from, a file offset or a memory offset */
+static guint64 rp_test_source (const doc_loc *piece, guint64 i)
+{
+    if (piece->location == loc_mem)
+        return RP_TEST_MEM_SOURCE | (piece->memaddr - test_memory + i);
+
+    g_assert_cmpint (piece->location, ==, loc_file);
+
+    return piece->fileaddr + i;
+}
+
+static void rp_test_check (RPPieceTree *tree, GArray *sources)
+{
+    guint64	address = 0;
+    guint	count = 0;
+
+    g_assert_cmpuint (rp_piece_tree_get_size (tree), ==, sources->len);
+
+    while (address < sources->len)
+    {
+        guint64			start = G_MAXUINT64;
+        const doc_loc	*piece = rp_piece_tree_lookup (tree, address, &start);
+
+        g_assert_nonnull (piece);
+        g_assert_cmpuint (start, ==, address);
+        g_assert_cmpuint (piece->len, >, 0);
+        g_assert_cmpuint (address + piece->len, <=, sources->len);
+
+        for (guint64 i = 0; i < piece->len; i++)
+            g_assert_cmpuint (rp_test_source (piece, i), ==, g_array_index (sources, guint64, address + i));
+
+        address += piece->len;
+        count++;
+    }
+
+    g_assert_null (rp_piece_tree_lookup (tree, address, NULL));
+    g_assert_cmpuint (rp_piece_tree_get_count (tree), ==, count);
+
+    // Lookups that land inside a piece
+    for (gint i = 0; i < RP_TEST_PROBES && sources->len > 0; i++)
+    {
+        guint64			probe = g_rand_int_range (test_rand, 0, sources->len);
+        guint64			start = G_MAXUINT64;
+        const doc_loc	*piece = rp_piece_tree_lookup (tree, probe, &start);
+
+        g_assert_nonnull (piece);
+        g_assert_cmpuint (start, <=, probe);
+        g_assert_cmpuint (probe, <, start + piece->len);
+        g_assert_cmpuint (rp_test_source (piece, probe - start), ==, g_array_index (sources, guint64, probe));
+    }
+}
+
+static void rp_test_insert_sources (guint64 address, const doc_loc *piece)
+{
+    guint64 sources[RP_TEST_DELETE_MAX];   // Put back pieces are the longest
+
+    g_assert_cmpuint (piece->len, <=, G_N_ELEMENTS (sources));
+
+    for (guint64 i = 0; i < piece->len; i++)
+        sources[i] = rp_test_source (piece, i);
+
+    g_array_insert_vals (test_sources, address, sources, piece->len);
+}
+
+/* Insert a new piece. Now and then it carries on where the byte before it
+ * comes from, so the tree can merge it into that piece.
+ */
+static void rp_test_insert (RPPieceTree *tree)
+{
+    guint64	address = g_rand_int_range (test_rand, 0, test_sources->len + 1);
+    guint64	len = g_rand_int_range (test_rand, 1, RP_TEST_PIECE_MAX + 1);
+    doc_loc	piece;
+
+    if (address > 0 && g_rand_int_range (test_rand, 0, 4) == 0)
+    {
+        guint64 before = g_array_index (test_sources, guint64, address - 1);
+        guint64 next = (before & ~RP_TEST_MEM_SOURCE) + 1;
+
+        if (before & RP_TEST_MEM_SOURCE)
+        {
+            // Only within the memory handed out so far
+            len = MIN (len, test_memory_used - next);
+            piece.location	= loc_mem;
+            piece.memaddr	= test_memory + next;
+        }
+        else
+        {
+            piece.location	= loc_file;
+            piece.fileaddr	= next;
+        }
+
+        if (len == 0)
+            return;
+
+        piece.len = len;
+    }
+    else if (g_rand_boolean (test_rand))
+    {
+        piece.location	= loc_mem;
+        piece.len		= len;
+        piece.memaddr	= test_memory + test_memory_used;
+        test_memory_used += len;
+    }
+    else
+    {
+        piece.location	= loc_file;
+        piece.len		= len;
+        piece.fileaddr	= test_file_used;
+        test_file_used	+= len;
+    }
+
+    rp_piece_tree_insert (tree, address, &piece);
+    rp_test_insert_sources (address, &piece);
+}
+
+/* Delete a range, check the pieces that made it up and put them back
+ * elsewhere half of the time
+ */
+static void rp_test_delete (RPPieceTree *tree)
+{
+    g_autoptr(GArray)	removed = g_array_new (FALSE, FALSE, sizeof (doc_loc));
+    g_autoptr(GArray)	deleted = g_array_new (FALSE, FALSE, sizeof (guint64));
+    guint64				address = g_rand_int_range (test_rand, 0, test_sources->len);
+    guint64				len = g_rand_int_range (test_rand, 1, RP_TEST_DELETE_MAX + 1);
+    guint64				offset = 0;
+
+    len = MIN (len, test_sources->len - address);
+
+    g_array_append_vals (deleted, &g_array_index (test_sources, guint64, address), len);
+    g_array_remove_range (test_sources, address, len);
+    rp_piece_tree_delete (tree, address, len, removed);
+
+    for (guint i = 0; i < removed->len; i++)
+    {
+        const doc_loc *piece = &g_array_index (removed, doc_loc, i);
+
+        for (guint64 j = 0; j < piece->len; j++)
+            g_assert_cmpuint (rp_test_source (piece, j), ==, g_array_index (deleted, guint64, offset + j));
+
+        offset += piece->len;
+    }
+
+    g_assert_cmpuint (offset, ==, len);
+
+    if (g_rand_boolean (test_rand))
+        return;
+
+    address = g_rand_int_range (test_rand, 0, test_sources->len + 1);
+
+    for (guint i = 0; i < removed->len; i++)
+    {
+        const doc_loc *piece = &g_array_index (removed, doc_loc, i);
+
+        rp_piece_tree_insert (tree, address, piece);
+        rp_test_insert_sources (address, piece);
+        address += piece->len;
+    }
+}
+
+/* Replace one of the copies, after checking it still holds what it did */
+static void rp_test_copy (RPPieceTree *tree, RPTestCopy *copy)
+{
+    if (copy->tree != NULL)
+    {
+        rp_test_check (copy->tree, copy->sources);
+        rp_piece_tree_free (copy->tree);
+        g_array_unref (copy->sources);
+    }
+
+    copy->tree		= rp_piece_tree_copy (tree);
+    copy->sources	= g_array_sized_new (FALSE, FALSE, sizeof (guint64), test_sources->len);
+    g_array_append_vals (copy->sources, test_sources->data, test_sources->len);
+}
+
+int main (int argc, char *argv[])
+{
+    RPTestCopy	copies[RP_TEST_COPIES] = { { NULL } };
+    RPPieceTree	*tree = rp_piece_tree_new ();
+    guint		count_max = 0;
+    guint32		seed;
+
+    seed = argc > 1 ? (guint32)g_ascii_strtoull (argv[1], NULL, 10) : g_random_int ();
+    test_rand = g_rand_new_with_seed (seed);
+    g_print ("seed %u\n", seed);
+
+    test_memory		= g_malloc (RP_TEST_STEPS * RP_TEST_PIECE_MAX);
+    test_sources	= g_array_new (FALSE, FALSE, sizeof (guint64));
+
+    for (gint step = 0; step < RP_TEST_STEPS; step++)
+    {
+        gint op = g_rand_int_range (test_rand, 0, 20);
+
+        if (op < 12 && test_sources->len < RP_TEST_DOC_MAX)
+            rp_test_insert (tree);
+        else if (op < 18 && test_sources->len > 0)
+            rp_test_delete (tree);
+        else if (op >= 18)
+            rp_test_copy (tree, &copies[g_rand_int_range (test_rand, 0, RP_TEST_COPIES)]);
+
+        rp_test_check (tree, test_sources);
+        count_max = MAX (count_max, rp_piece_tree_get_count (tree));
+    }
+
+    for (gint i = 0; i < RP_TEST_COPIES; i++)
+    {
+        if (copies[i].tree != NULL)
+        {
+            rp_test_check (copies[i].tree, copies[i].sources);
+            rp_piece_tree_free (copies[i].tree);
+            g_array_unref (copies[i].sources);
+        }
+    }
+
+    rp_piece_tree_clear (tree);
+    g_assert_cmpuint (rp_piece_tree_get_size (tree), ==, 0);
+    g_assert_null (rp_piece_tree_lookup (tree, 0, NULL));
+
+    g_print ("up to %u pieces\n", count_max);
+
+    rp_piece_tree_free (tree);
+    g_array_unref (test_sources);
+    g_free (test_memory);
+    g_rand_free (test_rand);
+
+    return 0;
+}
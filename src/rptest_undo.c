@@ -0,0 +1,343 @@
+/* -*- Mode: C; c-file-style: "gnu"; tab-width: 4 -*- */
+/* rptest_undo.c
+ *
+ * Copyright 2021 Ralph Perlich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Random edits, undos and redos on a document, checked against a flat
+ * copy of what the document should hold after every step:
+ *
+ *   rptest_undo [SEED]
+ *
+ * The undo limit is small, so old records are dropped all the time and
+ * the add buffer gets compacted many times over. Snapshots taken along
+ * the way must keep showing what they showed when they were taken.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "rphexfile.h"
+
+#define RP_TEST_FILE_SIZE		32768
+#define RP_TEST_DOC_MAX			(128 * 1024)
+#define RP_TEST_UNDO_LIMIT		(64 * 1024)
+#define RP_TEST_HISTORY			4096	// More steps than the undo limit keeps
+#define RP_TEST_STEPS			20000
+#define RP_TEST_SNAPSHOTS		4
+#define RP_TEST_ADD_MAX			(4 * 1024 * 1024)
+
+typedef struct
+{
+    guchar	*data;
+    gsize	len;
+} RPTestState;
+
+typedef struct
+{
+    RPHexSnapshot	*snapshot;
+    RPTestState		state;
+} RPTestSnapshot;
+
+static GRand		*test_rand;
+static guchar		test_doc[RP_TEST_DOC_MAX];  // What the document should hold
+static gsize		test_len;
+
+// Document states, the ones from test_base to test_top can be reached by
+// undo and redo, test_pos is the current one
+static RPTestState	test_history[RP_TEST_HISTORY];
+static gint64		test_base, test_pos, test_top;
+
+static RPTestSnapshot	test_snapshots[RP_TEST_SNAPSHOTS];
+
+static void rp_test_check (RPHexFile *hex_file)
+{
+    static guchar	buf[RP_TEST_DOC_MAX];
+
+    g_assert_cmpuint (rp_hex_file_get_size (hex_file), ==, test_len);
+    g_assert_cmpuint (rp_hex_file_get_data (hex_file, buf, test_len, 0), ==, test_len);
+    g_assert_cmpmem (buf, test_len, test_doc, test_len);
+}
+
+static void rp_test_check_snapshot (RPTestSnapshot *snap)
+{
+    static guchar	buf[RP_TEST_DOC_MAX];
+    gsize			len = snap->state.len;
+
+    g_assert_cmpuint (rp_hex_snapshot_get_size (snap->snapshot), ==, len);
+    g_assert_cmpuint (rp_hex_snapshot_get_data (snap->snapshot, buf, len, 0), ==, len);
+    g_assert_cmpmem (buf, len, snap->state.data, len);
+}
+
+static void rp_test_save_state (RPTestState *state)
+{
+    state->data	= g_realloc (state->data, MAX (test_len, 1));
+    state->len	= test_len;
+    memcpy (state->data, test_doc, test_len);
+}
+
+static void rp_test_load_state (RPTestState *state)
+{
+    memcpy (test_doc, state->data, state->len);
+    test_len = state->len;
+}
+
+/* Replace one of the snapshots, after checking it still shows what it did */
+static void rp_test_snapshot (RPHexFile *hex_file)
+{
+    RPTestSnapshot *snap = &test_snapshots[g_rand_int_range (test_rand, 0, RP_TEST_SNAPSHOTS)];
+
+    if (snap->snapshot != NULL)
+    {
+        rp_test_check_snapshot (snap);
+        rp_hex_snapshot_unref (snap->snapshot);
+    }
+
+    snap->snapshot = rp_hex_file_snapshot (hex_file);
+    rp_test_save_state (&snap->state);
+}
+
+/* A new undo record was made, anything that could be redone is gone */
+static void rp_test_push (void)
+{
+    test_top = ++test_pos;
+
+    if (test_pos - test_base >= RP_TEST_HISTORY)
+        test_base = test_pos - RP_TEST_HISTORY + 1;
+
+    rp_test_save_state (&test_history[test_pos % RP_TEST_HISTORY]);
+}
+
+static guint64 rp_test_address (void)
+{
+    return g_rand_int_range (test_rand, 0, test_len);
+}
+
+/* Overwrite a block at once, like a paste */
+static void rp_test_replace_block (RPHexFile *hex_file)
+{
+    guchar	buf[8192];
+    guint64	address = rp_test_address ();
+    gsize	len = g_rand_int_range (test_rand, 1, sizeof (buf) + 1);
+
+    len = MIN (len, test_len - address);
+
+    for (gsize i = 0; i < len; i++)
+        buf[i] = g_rand_int (test_rand);
+
+    rp_hex_file_change_data (hex_file, mod_replace, address, len, buf, 0);
+    memcpy (test_doc + address, buf, len);
+}
+
+/* Type a run of bytes the way RPHexView does, then both nibbles of the
+ * next byte in hex. A search may take a snapshot between the nibbles.
+ */
+static void rp_test_type (RPHexFile *hex_file)
+{
+    guint64		address = rp_test_address ();
+    gint		len = g_rand_int_range (test_rand, 1, 41);
+    gboolean	bInsert = test_len + len < RP_TEST_DOC_MAX && g_rand_boolean (test_rand);
+    guint		num_entered = 0;
+    guchar		c;
+
+    rp_hex_file_begin_user_action (hex_file);
+
+    for (gint i = 0; i < len && address < test_len; i++, address++)
+    {
+        c = g_rand_int (test_rand);
+        rp_hex_file_change_data (hex_file, bInsert ? mod_insert : mod_replace, address, 1, &c, num_entered);
+
+        if (bInsert)
+        {
+            memmove (test_doc + address + 1, test_doc + address, test_len - address);
+            test_len++;
+        }
+
+        test_doc[address] = c;
+        num_entered += 2;
+    }
+
+    if (address < test_len)
+    {
+        c = 0x01;
+        rp_hex_file_change_data (hex_file, mod_replace, address, 1, &c, 0);
+        test_doc[address] = c;
+
+        if (g_rand_int_range (test_rand, 0, 4) == 0)
+            rp_test_snapshot (hex_file);
+
+        c = 0x1f;
+        rp_hex_file_change_data (hex_file, mod_replace, address, 1, &c, 1);
+        test_doc[address] = c;
+    }
+
+    rp_hex_file_end_user_action (hex_file);
+}
+
+static void rp_test_delete (RPHexFile *hex_file)
+{
+    guint64	address = rp_test_address ();
+    guint64	len = g_rand_int_range (test_rand, 1, 301);
+
+    len = MIN (len, test_len - address);
+
+    rp_hex_file_change_data (hex_file, mod_delforw, address, len, NULL, 0);
+    memmove (test_doc + address, test_doc + address + len, test_len - address - len);
+    test_len -= len;
+}
+
+static void rp_test_undo (RPHexFile *hex_file)
+{
+    if (rp_hex_file_undo (hex_file, NULL))
+    {
+        g_assert_cmpint (test_pos, >, test_base);
+        rp_test_load_state (&test_history[--test_pos % RP_TEST_HISTORY]);
+    }
+    else
+    {
+        // The undo limit dropped the records before this state
+        g_assert_cmpint (test_pos - test_base, <, RP_TEST_HISTORY);
+        test_base = test_pos;
+    }
+
+    rp_test_check (hex_file);
+}
+
+static void rp_test_redo (RPHexFile *hex_file)
+{
+    if (rp_hex_file_redo (hex_file, NULL))
+    {
+        g_assert_cmpint (test_pos, <, test_top);
+        rp_test_load_state (&test_history[++test_pos % RP_TEST_HISTORY]);
+    }
+    else
+        g_assert_cmpint (test_pos, ==, test_top);
+
+    rp_test_check (hex_file);
+}
+
+static RPHexFile *rp_test_open (gchar **path)
+{
+    g_autoptr(GFile)	file = NULL;
+    g_autoptr(GError)	error = NULL;
+    RPHexFile			*hex_file;
+    gint				fd;
+
+    for (gsize i = 0; i < RP_TEST_FILE_SIZE; i++)
+        test_doc[i] = g_rand_int (test_rand);
+
+    test_len = RP_TEST_FILE_SIZE;
+
+    fd = g_file_open_tmp ("rptest-XXXXXX", path, &error);
+    g_assert_no_error (error);
+    close (fd);
+
+    g_file_set_contents (*path, (const gchar *)test_doc, test_len, &error);
+    g_assert_no_error (error);
+
+    // Read-only keeps the journal out of it, editing works all the same
+    file = g_file_new_for_path (*path);
+    hex_file = rp_hex_file_new_with_file (file, RP_HEX_FILE_OPEN_READ_ONLY, &error);
+    g_assert_no_error (error);
+
+    return hex_file;
+}
+
+int main (int argc, char *argv[])
+{
+    g_autofree gchar *path = NULL;
+    RPHexFile		*hex_file;
+    guint32			seed;
+    gsize			add_max = 0;
+    guint			undos = 0;
+
+    seed = argc > 1 ? (guint32)g_ascii_strtoull (argv[1], NULL, 10) : g_random_int ();
+    test_rand = g_rand_new_with_seed (seed);
+    g_print ("seed %u\n", seed);
+
+    hex_file = rp_test_open (&path);
+    rp_hex_file_set_undo_limit (hex_file, RP_TEST_UNDO_LIMIT);
+    rp_test_save_state (&test_history[0]);
+
+    for (gint step = 0; step < RP_TEST_STEPS; step++)
+    {
+        gint op = g_rand_int_range (test_rand, 0, 20);
+
+        if (op < 6)
+            rp_test_replace_block (hex_file);
+        else if (op < 12)
+            rp_test_type (hex_file);
+        else if (op < 14 && test_len > RP_TEST_FILE_SIZE / 2)
+            rp_test_delete (hex_file);
+        else if (op < 14)
+            continue;
+        else if (op < 17)
+            rp_test_undo (hex_file);
+        else if (op < 19)
+            rp_test_redo (hex_file);
+        else
+            rp_test_snapshot (hex_file);
+
+        if (op < 14)
+        {
+            rp_test_push ();
+            rp_test_check (hex_file);
+        }
+
+        add_max = MAX (add_max, rp_add_buffer_get_size (hex_file->add_buffer));
+    }
+
+    // Everything the undo history still holds can be undone and redone
+    while (rp_hex_file_undo (hex_file, NULL))
+    {
+        g_assert_cmpint (test_pos, >, test_base);
+        rp_test_load_state (&test_history[--test_pos % RP_TEST_HISTORY]);
+        rp_test_check (hex_file);
+        undos++;
+    }
+
+    while (rp_hex_file_redo (hex_file, NULL))
+    {
+        rp_test_load_state (&test_history[++test_pos % RP_TEST_HISTORY]);
+        rp_test_check (hex_file);
+    }
+
+    g_assert_cmpint (test_pos, ==, test_top);
+
+    for (gint i = 0; i < RP_TEST_SNAPSHOTS; i++)
+    {
+        if (test_snapshots[i].snapshot != NULL)
+        {
+            rp_test_check_snapshot (&test_snapshots[i]);
+            rp_hex_snapshot_unref (test_snapshots[i].snapshot);
+            g_free (test_snapshots[i].state.data);
+        }
+    }
+
+    // Without compaction the add buffer would hold everything ever typed
+    g_print ("add buffer at most %" G_GSIZE_FORMAT " KiB, %u undos at the end\n", add_max >> 10, undos);
+    g_assert_cmpuint (add_max, <, RP_TEST_ADD_MAX);
+
+    g_object_unref (hex_file);
+    g_unlink (path);
+
+    for (gint i = 0; i < RP_TEST_HISTORY; i++)
+        g_free (test_history[i].data);
+
+    g_rand_free (test_rand);
+
+    return 0;
+}